@@ -70,6 +70,19 @@ typedef unsigned __int64 UINT64;
 typedef long long INT64;
 typedef unsigned long long UINT64;
 #endif
+#ifdef _OPENMP
+#include <omp.h>
+#define uf_omp_get_thread_num() omp_get_thread_num()
+#define uf_omp_get_max_threads() omp_get_max_threads()
+#else
+#define uf_omp_get_thread_num() 0
+#define uf_omp_get_max_threads() 1
+#endif
+
+#if defined(HAVE_MMAP) && !defined(_WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #ifdef NODEPS
 #define NO_JASPER
@@ -136,6 +149,14 @@ tone_curve_size = 0, tone_curve_offset = 0; /* Nikon Tone Curves UF*/
 tone_mode_offset = 0, tone_mode_size = 0; /* Nikon ToneComp UF*/
 messageBuffer = NULL;
 lastStatus = DCRAW_SUCCESS;
+gbh_bitbuf = gbh_vbits = gbh_reset = 0;
+shot_image = NULL;
+ph1_bitbuf = ph1_vbits = pana_vbits = sony_p = crx_index = 0;
+idct_cs[0] = 0;
+saved_raw_image = NULL;
+ifpMap = NULL;
+ifpMapSize = ifpMapPos = ifpMapLast = ifpMapStep = 0;
+ifpMapEof = 0;
 ifname = NULL;
 ifname_display = NULL;
 ifpReadCount = 0;
@@ -146,6 +167,12 @@ eofCount = 0;
 
 CLASS ~DCRaw()
 {
+ifp_unmap();
+#ifdef DCRAW_NOMAIN
+/* dcraw_load_raw() allocates these with glib */
+g_free(shot_image);
+g_free(saved_raw_image);
+#endif
 free(ifname);
 free(ifname_display);
 }
@@ -166,7 +193,22 @@ void CLASS ifpProgress(unsigned readCount) {
 }
 
 size_t CLASS fread(void *ptr, size_t size, size_t nmemb, FILE *stream) {
-    size_t num = ::fread(ptr, size, nmemb, stream);
+    size_t num;
+    if (stream==ifp && ifpMap) {
+        num = size ? (ifpMapSize - ifpMapPos) / size : 0;
+        if (num > nmemb) num = nmemb;
+        memcpy(ptr, ifpMap + ifpMapPos, size*num);
+        ifpMapPos += size*num;
+        if (num != nmemb) {
+            /* Like stdio, consume the trailing partial item */
+            ifpMapPos = ifpMapSize;
+            ifpMapEof = 1;
+        }
+        if (ifpMapPos - ifpMapLast >= ifpMapStep) ifpMapProgress();
+    } else {
+        num = ::fread(ptr, size, nmemb, stream);
+        if (stream==ifp) ifpProgress(size*nmemb);
+    }
     if ( num != nmemb ) {
         if (eofCount < 10)
             // Maybe this should be a DCRAW_WARNING
@@ -177,7 +219,6 @@ size_t CLASS fread(void *ptr, size_t size, size_t nmemb, FILE *stream) {
                     ifname_display);
         eofCount++;
     }
-    if (stream==ifp) ifpProgress(size*nmemb);
     return num;
 }
 
@@ -206,6 +247,14 @@ char *CLASS fgets(char *s, int size, FILE *stream) {
 }
 
 int CLASS fgetc(FILE *stream) {
+    if (stream==ifp && ifpMap) {
+        if (ifpMapPos >= ifpMapSize) {
+            ifpMapEof = 1;
+            return EOF;
+        }
+        if (ifpMapPos - ifpMapLast >= ifpMapStep) ifpMapProgress();
+        return ifpMap[ifpMapPos++];
+    }
     int chr = ::fgetc(stream);
     if (stream==ifp) ifpProgress(1);
     return chr;
@@ -219,6 +268,85 @@ int CLASS fscanf(FILE *stream, const char *format, void *ptr) {
     return 1;
 }
 
+int CLASS fseek(FILE *stream, long offset, int whence) {
+    if (stream!=ifp || !ifpMap)
+        return ::fseek(stream, offset, whence);
+    if (whence == SEEK_CUR) offset += ifpMapPos;
+    else if (whence == SEEK_END) offset += ifpMapSize;
+    if (offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    ifpMapProgress();
+    ifpMapPos = ifpMapLast =
+	(size_t)offset < ifpMapSize ? (size_t)offset : ifpMapSize;
+    ifpMapEof = 0;
+    return 0;
+}
+
+long CLASS ftell(FILE *stream) {
+    if (stream==ifp && ifpMap) return ifpMapPos;
+    return ::ftell(stream);
+}
+
+int CLASS feof(FILE *stream) {
+    if (stream==ifp && ifpMap) return ifpMapEof;
+    return ::feof(stream);
+}
+
+/*
+ * Map the input file into memory so that the raw loaders read it without
+ * the stdio locking and buffering overhead. Only regular files are mapped,
+ * pipes and anything else we fail to map keep using the FILE stream.
+ * Progress is reported once every ifpMapStep bytes instead of on every read.
+ */
+int CLASS ifp_map()
+{
+#if defined(HAVE_MMAP) && !defined(_WIN32)
+  struct stat st;
+  void *map;
+
+  if (ifpMap) return 1;
+  /* libjpeg reads these through the FILE stream itself */
+  if (load_raw == &CLASS kodak_jpeg_load_raw ||
+      load_raw == &CLASS lossy_dng_load_raw) return 0;
+  if (fstat (fileno(ifp), &st) || !S_ISREG(st.st_mode) || st.st_size <= 0)
+    return 0;
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(ifp), 0);
+  if (map == MAP_FAILED) return 0;
+#ifdef MADV_WILLNEED
+  madvise (map, st.st_size, MADV_WILLNEED);
+#endif
+  ifpMap = (const uchar *) map;
+  ifpMapSize = st.st_size;
+  ifpMapStep = ifpSize >= STEPS ? ifpSize / STEPS : ~(size_t) 0;
+  ifpMapPos = ifpMapLast = ::ftell(ifp);
+  ifpMapEof = 0;
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+void CLASS ifp_unmap()
+{
+#if defined(HAVE_MMAP) && !defined(_WIN32)
+  if (!ifpMap) return;
+  ifpMapProgress();
+  munmap ((void *) ifpMap, ifpMapSize);
+  ifpMap = NULL;
+  /* Continue with the FILE stream where the mapped reads stopped */
+  ::fseek (ifp, ifpMapPos, SEEK_SET);
+#endif
+}
+
+void CLASS ifpMapProgress()
+{
+  if (ifpMapPos > ifpMapLast)
+    ifpProgress (ifpMapPos - ifpMapLast);
+  ifpMapLast = ifpMapPos;
+}
+
 #define FORC(cnt) for (c=0; c < cnt; c++)
 #define FORC3 FORC(3)
 #define FORC4 FORC(4)
@@ -367,7 +495,7 @@ void CLASS derror()
     else
 #ifdef HAVE_FSEEKO
       dcraw_message (DCRAW_WARNING,_("Corrupt data near 0x%llx\n"),
-		(INT64) ftello(ifp));
+		ifpMap ? (INT64) ifpMapPos : (INT64) ftello(ifp));
 #else
       dcraw_message (DCRAW_WARNING,_("Corrupt data near 0x%lx\n"), ftell(ifp));
 #endif
@@ -375,6 +503,82 @@ void CLASS derror()
   data_error++;
 }
 
+/*
+   Loaders whose data splits into independent parts (DNG tiles, restart
+   intervals) can decode them in parallel from the memory mapping.  Every
+   thread works on a shallow copy of this object, with its own file cursor,
+   bit reader, error count and failure jump buffer, but sharing the mapping,
+   the decoding tables and the output image.
+ */
+DCRaw * CLASS reader_fork()
+{
+  DCRaw *r;
+
+  r = (DCRaw *) malloc (sizeof *r);
+  merror (r, "reader_fork()");
+  memcpy ((void *) r, (void *) this, sizeof *r);
+  r->messageBuffer = NULL;
+  r->lastStatus = DCRAW_SUCCESS;
+  r->data_error = 0;
+  r->gbh_bitbuf = r->gbh_vbits = r->gbh_reset = 0;
+  r->ifpMapEof = 0;
+  /* Only count the bytes read, join_reader() reports the progress */
+  r->ifpReadCount = r->ifpSize = 0;
+  /* and keep the verbose fread() messages out of the threads */
+  r->eofCount = 11;
+  return r;
+}
+
+void CLASS reader_join (DCRaw *r)
+{
+  r->ifpMapProgress();
+  ifpProgress (r->ifpReadCount);
+  if (r->messageBuffer) {
+    dcraw_message (r->lastStatus, "%s", r->messageBuffer);
+#ifdef DCRAW_NOMAIN
+    g_free (r->messageBuffer);
+#endif
+  }
+  data_error += r->data_error;
+  free (r);
+}
+
+/*
+   Call (r->*part)(i, data) for every part i on the forked readers.
+   Returns nonzero if any part failed, so that the caller can free its
+   buffers before failing the whole load.
+ */
+int CLASS fork_parts (int nparts, void (DCRaw::*part)(int, void *), void *data)
+{
+  DCRaw **reader;
+  char *failed;
+  int nreaders, fail=0, i;
+
+  nreaders = uf_omp_get_max_threads();
+  if (nreaders > nparts) nreaders = nparts;
+  reader = (DCRaw **) calloc (nreaders, sizeof *reader + 1);
+  merror (reader, "fork_parts()");
+  failed = (char *) (reader + nreaders);
+  for (i=0; i < nreaders; i++)
+    reader[i] = reader_fork();
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(nreaders)
+#endif
+  for (i=0; i < nparts; i++) {
+    DCRaw *r = reader[uf_omp_get_thread_num()];
+    if (setjmp (r->failure))
+      failed[uf_omp_get_thread_num()] = 1;
+    else
+      (r->*part)(i, data);
+  }
+  for (i=0; i < nreaders; i++) {
+    fail |= failed[i];
+    reader_join (reader[i]);
+  }
+  free (reader);
+  return fail;
+}
+
 ushort CLASS sget2 (uchar *s)
 {
   if (order == 0x4949)		/* "II" means little-endian */
@@ -679,30 +883,73 @@ int CLASS canon_s2is()
 
 unsigned CLASS getbithuff (int nbits, ushort *huff)
 {
-  // TODO: The following static variables are not thread-safe
-  static unsigned bitbuf=0;
-  static int vbits=0, reset=0;
   unsigned c;
 
   if (nbits > 25) return 0;
   if (nbits < 0)
-    return bitbuf = vbits = reset = 0;
-  if (nbits == 0 || vbits < 0) return 0;
-  while (!reset && vbits < nbits && (c = fgetc(ifp)) != (unsigned) EOF &&
-    !(reset = zero_after_ff && c == 0xff && fgetc(ifp))) {
-    bitbuf = (bitbuf << 8) + (uchar) c;
-    vbits += 8;
-  }
-  c = bitbuf << (32-vbits) >> (32-nbits);
+    return gbh_bitbuf = gbh_vbits = gbh_reset = 0;
+  if (nbits == 0 || gbh_vbits < 0) return 0;
+  while (!gbh_reset && gbh_vbits < nbits && (c = fgetc(ifp)) != (unsigned) EOF &&
+    !(gbh_reset = zero_after_ff && c == 0xff && fgetc(ifp))) {
+    gbh_bitbuf = (gbh_bitbuf << 8) + (uchar) c;
+    gbh_vbits += 8;
+  }
+  c = gbh_vbits <= 0 ? 0 : gbh_bitbuf << (64-gbh_vbits) >> (64-nbits);
   if (huff) {
-    vbits -= huff[c] >> 8;
+    gbh_vbits -= huff[c] >> 8;
     c = (uchar) huff[c];
   } else
-    vbits -= nbits;
-  if (vbits < 0) derror();
+    gbh_vbits -= nbits;
+  if (gbh_vbits < 0) derror();
   return c;
 }
 
+/*
+   Read ahead as many bytes as fit into the getbithuff() buffer, instead of
+   only the bits needed for the next symbol.  0xff00 stuffing and markers
+   are handled just like in getbithuff(), so this may be mixed with it.
+   Only use it where reading ahead of the current symbol does not matter.
+ */
+void CLASS getbits_fill()
+{
+  unsigned c;
+  int n;
+
+  if (gbh_reset || gbh_vbits < 0) return;
+  if (ifpMap) {
+    while (gbh_vbits <= 56 && ifpMapSize - ifpMapPos >= 8) {
+      const uchar *p = ifpMap + ifpMapPos;
+      UINT64 word = 0;
+      n = (64 - gbh_vbits) >> 3;
+      FORC(8) word = word << 8 | p[c];
+      /* Eight bytes at a time, unless one of them is 0xff */
+      if (!zero_after_ff ||
+	  !((~word - 0x0101010101010101ULL) & word & 0x8080808080808080ULL)) {
+	gbh_bitbuf = n == 8 ? word : gbh_bitbuf << (n*8) | word >> (64 - n*8);
+	gbh_vbits += n*8;
+	ifpMapPos += n;
+	break;
+      }
+      for (; n && ifpMapSize - ifpMapPos >= 2; n--) {
+	c = ifpMap[ifpMapPos++];
+	if (c == 0xff && ifpMap[ifpMapPos++]) {
+	  gbh_reset = 1;
+	  break;
+	}
+	gbh_bitbuf = (gbh_bitbuf << 8) + c;
+	gbh_vbits += 8;
+      }
+      if (n) break;
+    }
+    if (ifpMapPos - ifpMapLast >= ifpMapStep) ifpMapProgress();
+  }
+  while (!gbh_reset && gbh_vbits <= 56 && (c = fgetc(ifp)) != (unsigned) EOF &&
+    !(gbh_reset = zero_after_ff && c == 0xff && fgetc(ifp))) {
+    gbh_bitbuf = (gbh_bitbuf << 8) + (uchar) c;
+    gbh_vbits += 8;
+  }
+}
+
 #define getbits(n) getbithuff(n,0)
 #define gethuff(h) getbithuff(*h,h+1)
 
@@ -756,6 +1003,35 @@ ushort * CLASS make_decoder (const uchar *source)
   return make_decoder_ref (&source);
 }
 
+/*
+   Build a lookup table for ljpeg_diff_fast() from a make_decoder() table.
+   It is indexed by the next FAST_BITS bits of the stream.  When both the
+   Huffman code and the difference bits that follow it fit in there, the
+   entry holds the decoded difference times 256 plus the number of bits
+   used.  Otherwise the entry is zero and the symbol is decoded the slow way.
+ */
+#define FAST_BITS 11
+
+int * CLASS make_fast_decoder (const ushort *huff)
+{
+  int max=huff[0], *fast, p, code, len, bits, diff;
+
+  fast = (int *) calloc (1 << FAST_BITS, sizeof *fast);
+  merror (fast, "make_fast_decoder()");
+  if (!max) return fast;
+  for (p=0; p < 1 << FAST_BITS; p++) {
+    code = max > FAST_BITS ? huff[1 + (p << (max-FAST_BITS))]
+			   : huff[1 + (p >> (FAST_BITS-max))];
+    len = (uchar) code;
+    if (!(code >> 8) || (code >> 8) > FAST_BITS || len > 15 ||
+	(code >> 8) + len > FAST_BITS) continue;
+    bits = p >> (FAST_BITS - (code >> 8) - len) & ((1 << len) - 1);
+    diff = len && !(bits & (1 << (len-1))) ? bits - (1 << len) + 1 : bits;
+    fast[p] = diff * 256 + (code >> 8) + len;
+  }
+  return fast;
+}
+
 void CLASS crw_init_tables (unsigned table, ushort *huff[2])
 {
   static const uchar first_tree[3][29] = {
@@ -897,6 +1173,7 @@ void CLASS canon_load_raw()
 struct jhead {
   int algo, bits, high, wide, clrs, sraw, psv, restart, vpred[6];
   ushort quant[64], idct[64], *huff[20], *free[20], *row;
+  int *fast[20], *free_fast[20];
 };
 
 int CLASS ljpeg_start (struct jhead *jh, int info_only)
@@ -925,12 +1202,14 @@ int CLASS ljpeg_start (struct jhead *jh, int info_only)
 	jh->high = data[1] << 8 | data[2];
 	jh->wide = data[3] << 8 | data[4];
 	jh->clrs = data[5] + jh->sraw;
-	if (len == 9 && !dng_version) getc(ifp);
+	if (len == 9 && !dng_version) fgetc(ifp);
 	break;
       case 0xffc4:
 	if (info_only) break;
-	for (dp = data; dp < data+len && !((c = *dp++) & -20); )
+	for (dp = data; dp < data+len && !((c = *dp++) & -20); ) {
 	  jh->free[c] = jh->huff[c] = make_decoder_ref (&dp);
+	  jh->free_fast[c] = jh->fast[c] = make_fast_decoder (jh->huff[c]);
+	}
 	break;
       case 0xffda:
 	jh->psv = data[1+data[0]*2];
@@ -947,10 +1226,19 @@ int CLASS ljpeg_start (struct jhead *jh, int info_only)
      !jh->bits || !jh->high || !jh->wide || !jh->clrs) return 0;
   if (info_only) return 1;
   if (!jh->huff[0]) return 0;
-  FORC(19) if (!jh->huff[c+1]) jh->huff[c+1] = jh->huff[c];
+  FORC(19) if (!jh->huff[c+1]) {
+    jh->huff[c+1] = jh->huff[c];
+    jh->fast[c+1] = jh->fast[c];
+  }
   if (jh->sraw) {
-    FORC(4)        jh->huff[2+c] = jh->huff[1];
-    FORC(jh->sraw) jh->huff[1+c] = jh->huff[0];
+    FORC(4) {
+      jh->huff[2+c] = jh->huff[1];
+      jh->fast[2+c] = jh->fast[1];
+    }
+    FORC(jh->sraw) {
+      jh->huff[1+c] = jh->huff[0];
+      jh->fast[1+c] = jh->fast[0];
+    }
   }
   jh->row = (ushort *) calloc (jh->wide*jh->clrs, 4);
   merror (jh->row, "ljpeg_start()");
@@ -961,6 +1249,7 @@ void CLASS ljpeg_end (struct jhead *jh)
 {
   int c;
   FORC4 if (jh->free[c]) free (jh->free[c]);
+  FORC(20) if (jh->free_fast[c]) free (jh->free_fast[c]);
   free (jh->row);
 }
 
@@ -980,6 +1269,33 @@ int CLASS ljpeg_diff (ushort *huff)
   return diff;
 }
 
+/*
+   Same as ljpeg_diff(), but decodes the common short symbols with a single
+   lookup and reads the stream ahead with getbits_fill().
+ */
+int CLASS ljpeg_diff_fast (ushort *huff, const int *fast)
+{
+  int code, len, diff;
+
+  if (!huff)
+    longjmp(failure, 2);
+
+  if (gbh_vbits < 32) getbits_fill();
+  if (gbh_vbits < 32 || !huff[0]) return ljpeg_diff (huff);
+  if ((diff = fast[gbh_bitbuf >> (gbh_vbits-FAST_BITS) & ((1 << FAST_BITS)-1)])) {
+    gbh_vbits -= diff & 0xff;
+    return diff >> 8;
+  }
+  code = huff[1 + (gbh_bitbuf >> (gbh_vbits-huff[0]) & ((1 << huff[0])-1))];
+  if ((len = (uchar) code) > 15) return ljpeg_diff (huff);
+  gbh_vbits -= code >> 8;
+  if (!len) return 0;
+  diff = gbh_bitbuf >> (gbh_vbits -= len) & ((1 << len)-1);
+  if ((diff & (1 << (len-1))) == 0)
+    diff -= (1 << len) - 1;
+  return diff;
+}
+
 ushort * CLASS ljpeg_row (int jrow, struct jhead *jh)
 {
   int col, c, diff, pred, spred=0;
@@ -997,7 +1313,7 @@ ushort * CLASS ljpeg_row (int jrow, struct jhead *jh)
   FORC3 row[c] = jh->row + jh->wide*jh->clrs*((jrow+c) & 1);
   for (col=0; col < jh->wide; col++)
     FORC(jh->clrs) {
-      diff = ljpeg_diff (jh->huff[c]);
+      diff = ljpeg_diff_fast (jh->huff[c], jh->fast[c]);
       if (jh->sraw && c <= jh->sraw && (col | c))
 		    pred = spred;
       else if (col) pred = row[0][-jh->clrs];
@@ -1019,19 +1335,17 @@ ushort * CLASS ljpeg_row (int jrow, struct jhead *jh)
   return row[2];
 }
 
-void CLASS lossless_jpeg_load_raw()
+void CLASS lossless_jpeg_rows (struct jhead *jh, int jrow, int jend)
 {
-  int jwide, jrow, jcol, val, jidx, i, j, row=0, col=0;
-  struct jhead jh;
+  int jwide, jcol, val, jidx, i, j, row, col;
   ushort *rp;
 
-  if (!ljpeg_start (&jh, 0)) return;
-  if (jh.wide < 1 || jh.high < 1 || jh.clrs < 1 || jh.bits < 1)
-    longjmp (failure, 2);
-  jwide = jh.wide * jh.clrs;
+  jwide = jh->wide * jh->clrs;
+  row = jrow * jwide / raw_width;
+  col = jrow * jwide % raw_width;
 
-  for (jrow=0; jrow < jh.high; jrow++) {
-    rp = ljpeg_row (jrow, &jh);
+  for (; jrow < jend; jrow++) {
+    rp = ljpeg_row (jrow, jh);
     if (load_flags & 1)
       row = jrow & 1 ? height-1-jrow/2 : jrow/2;
     for (jcol=0; jcol < jwide; jcol++) {
@@ -1054,7 +1368,77 @@ void CLASS lossless_jpeg_load_raw()
 	col = (row++,0);
     }
   }
+}
+
+struct ljpeg_parts {
+  struct jhead *jh;
+  int rows;
+  off_t *offset;
+};
+
+void CLASS lossless_jpeg_part (int part, void *data)
+{
+  struct ljpeg_parts *lp = (struct ljpeg_parts *) data;
+  struct jhead jh = *lp->jh;
+  int jrow = part * lp->rows;
+  jmp_buf jb;
+
+  jh.row = (ushort *) calloc (jh.wide*jh.clrs, 4);
+  merror (jh.row, "lossless_jpeg_part()");
+  memcpy (jb, failure, sizeof jb);
+  if (setjmp (failure)) {
+    free (jh.row);
+    memcpy (failure, jb, sizeof jb);
+    longjmp (failure, 2);
+  }
+  fseek (ifp, lp->offset[part], SEEK_SET);
+  lossless_jpeg_rows (&jh, jrow, MIN (jrow + lp->rows, jh.high));
+  memcpy (failure, jb, sizeof jb);
+  free (jh.row);
+}
+
+/*
+   Restart intervals of whole rows can be decoded independently, as long
+   as the predictor does not look at the row above.  Returns 0 if the
+   image cannot be split this way, -1 if decoding a part failed.
+ */
+int CLASS lossless_jpeg_fork (struct jhead *jh)
+{
+  struct ljpeg_parts lp;
+  size_t pos;
+  int nparts, n=0, fail=0;
+
+  if (!ifpMap || jh->psv != 1 || jh->restart >= INT_MAX ||
+	jh->restart < jh->wide || jh->restart % jh->wide) return 0;
+  if (!cr2_slice[0] && ((load_flags & 1) || raw_width == 3984)) return 0;
+  lp.jh = jh;
+  lp.rows = jh->restart / jh->wide;
+  if ((nparts = (jh->high + lp.rows - 1) / lp.rows) < 2) return 0;
+  lp.offset = (off_t *) calloc (nparts, sizeof *lp.offset);
+  merror (lp.offset, "lossless_jpeg_fork()");
+  /* Entropy coded data never has 0xff followed by a marker code */
+  lp.offset[n++] = ifpMapPos;
+  for (pos = ifpMapPos; n < nparts && pos+1 < ifpMapSize; pos++)
+    if (ifpMap[pos] == 0xff && (ifpMap[pos+1] & 0xf8) == 0xd0)
+      lp.offset[n++] = pos += 2;
+  if (n == nparts)
+    fail = fork_parts (nparts, &CLASS lossless_jpeg_part, &lp);
+  free (lp.offset);
+  return fail ? -1 : n == nparts;
+}
+
+void CLASS lossless_jpeg_load_raw()
+{
+  struct jhead jh;
+  int forked;
+
+  if (!ljpeg_start (&jh, 0)) return;
+  if (jh.wide < 1 || jh.high < 1 || jh.clrs < 1 || jh.bits < 1)
+    longjmp (failure, 2);
+  if (!(forked = lossless_jpeg_fork (&jh)))
+    lossless_jpeg_rows (&jh, 0, jh.high);
   ljpeg_end (&jh);
+  if (forked < 0) longjmp (failure, 2);
 }
 
 void CLASS canon_sraw_load_raw()
@@ -1151,15 +1535,14 @@ void CLASS ljpeg_idct (struct jhead *jh)
 {
   int c, i, j, len, skip, coef;
   float work[3][8][8];
-  static float cs[106] = { 0 };
   static const uchar zigzag[80] =
   {  0, 1, 8,16, 9, 2, 3,10,17,24,32,25,18,11, 4, 5,12,19,26,33,
     40,48,41,34,27,20,13, 6, 7,14,21,28,35,42,49,56,57,50,43,36,
     29,22,15,23,30,37,44,51,58,59,52,45,38,31,39,46,53,60,61,54,
     47,55,62,63,63,63,63,63,63,63,63,63,63,63,63,63,63,63,63,63 };
 
-  if (!cs[0])
-    FORC(106) cs[c] = cos((c & 31)*M_PI/16)/2;
+  if (!idct_cs[0])
+    FORC(106) idct_cs[c] = cos((c & 31)*M_PI/16)/2;
   memset (work, 0, sizeof work);
   work[0][0][0] = jh->vpred[0] += ljpeg_diff (jh->huff[0]) * jh->quant[0];
   for (i=1; i < 64; i++ ) {
@@ -1175,58 +1558,138 @@ void CLASS ljpeg_idct (struct jhead *jh)
   FORC(8) work[0][c][0] *= M_SQRT1_2;
   for (i=0; i < 8; i++)
     for (j=0; j < 8; j++)
-      FORC(8) work[1][i][j] += work[0][i][c] * cs[(j*2+1)*c];
+      FORC(8) work[1][i][j] += work[0][i][c] * idct_cs[(j*2+1)*c];
   for (i=0; i < 8; i++)
     for (j=0; j < 8; j++)
-      FORC(8) work[2][i][j] += work[1][c][j] * cs[(i*2+1)*c];
+      FORC(8) work[2][i][j] += work[1][c][j] * idct_cs[(i*2+1)*c];
 
   FORC(64) jh->idct[c] = CLIP(((float *)work[2])[c]+0.5);
 }
 
-void CLASS lossless_dng_load_raw()
+int CLASS lossless_dng_tile (struct jhead *jh, unsigned trow, unsigned tcol)
 {
-  unsigned save, trow=0, tcol=0, jwide, jrow, jcol, row, col, i, j;
-  struct jhead jh;
+  unsigned jwide, jrow, jcol, row, col, i, j;
   ushort *rp;
 
+  if (!ljpeg_start (jh, 0)) {
+    ljpeg_end (jh);
+    return 0;
+  }
+  jwide = jh->wide;
+  if (filters) jwide *= jh->clrs;
+  jwide /= MIN (is_raw, tiff_samples);
+  switch (jh->algo) {
+    case 0xc1:
+      jh->vpred[0] = 16384;
+      getbits(-1);
+      for (jrow=0; jrow+7 < (unsigned) jh->high; jrow += 8) {
+	for (jcol=0; jcol+7 < (unsigned) jh->wide; jcol += 8) {
+	  ljpeg_idct (jh);
+	  rp = jh->idct;
+	  row = trow + jcol/tile_width + jrow*2;
+	  col = tcol + jcol%tile_width;
+	  for (i=0; i < 16; i+=2)
+	    for (j=0; j < 8; j++)
+	      adobe_copy_pixel (row+i, col+j, &rp);
+	}
+      }
+      break;
+    case 0xc3:
+      for (row=col=jrow=0; jrow < (unsigned) jh->high; jrow++) {
+	rp = ljpeg_row (jrow, jh);
+	for (jcol=0; jcol < jwide; jcol++) {
+	  adobe_copy_pixel (trow+row, tcol+col, &rp);
+	  if (++col >= tile_width || col >= raw_width)
+	    row += 1 + (col = 0);
+	}
+      }
+  }
+  ljpeg_end (jh);
+  return 1;
+}
+
+struct dng_tiles {
+  unsigned *offset, across, stop;
+};
+
+void CLASS lossless_dng_part (int tile, void *data)
+{
+  struct dng_tiles *dt = (struct dng_tiles *) data;
+  struct jhead jh;
+  jmp_buf jb;
+  int ok;
+
+  memset (&jh, 0, sizeof jh);
+  memcpy (jb, failure, sizeof jb);
+  if (setjmp (failure)) {
+    ljpeg_end (&jh);
+    memcpy (failure, jb, sizeof jb);
+    longjmp (failure, 2);
+  }
+  fseek (ifp, dt->offset[tile], SEEK_SET);
+  ok = lossless_dng_tile (&jh, tile / dt->across * tile_length,
+			  tile % dt->across * tile_width);
+  memcpy (failure, jb, sizeof jb);
+  if (ok) return;
+#ifdef _OPENMP
+#pragma omp critical(lossless_dng_part)
+#endif
+  if (dt->stop > (unsigned) tile) dt->stop = tile;
+}
+
+/*
+   The serial loop stops at the first tile whose header is broken.
+   Clear whatever the other threads decoded past it, so that both
+   paths leave the same image behind.
+ */
+void CLASS lossless_dng_clear (struct dng_tiles *dt, unsigned ntiles)
+{
+  unsigned tile, trow, tcol, row, col;
+
+  for (tile = dt->stop+1; tile < ntiles; tile++) {
+    trow = tile / dt->across * tile_length;
+    tcol = tile % dt->across * tile_width;
+    for (row=trow; row < trow+tile_length; row++)
+      for (col=tcol; col < tcol+tile_width; col++)
+	if (raw_image) {
+	  if (row < raw_height && col < raw_width) RAW(row,col) = 0;
+	} else
+	  if (row < height && col < width)
+	    memset (image[row*width+col], 0, sizeof *image);
+  }
+}
+
+void CLASS lossless_dng_load_raw()
+{
+  unsigned save, trow=0, tcol=0, ntiles, i;
+  struct dng_tiles dt;
+  struct jhead jh;
+  int fail;
+
+  if (ifpMap && tile_width && tile_length < INT_MAX) {
+    dt.across = (raw_width + tile_width - 1) / tile_width;
+    ntiles = dt.across * ((raw_height + tile_length - 1) / tile_length);
+    if (ntiles > 1) {
+      dt.offset = (unsigned *) calloc (ntiles, sizeof *dt.offset);
+      merror (dt.offset, "lossless_dng_load_raw()");
+      for (i=0; i < ntiles; i++)
+	dt.offset[i] = get4();
+      dt.stop = ntiles;
+      fail = fork_parts (ntiles, &CLASS lossless_dng_part, &dt);
+      free (dt.offset);
+      if (fail) longjmp (failure, 2);
+      lossless_dng_clear (&dt, ntiles);
+      return;
+    }
+  }
   while (trow < raw_height) {
     save = ftell(ifp);
     if (tile_length < INT_MAX)
       fseek (ifp, get4(), SEEK_SET);
-    if (!ljpeg_start (&jh, 0)) break;
-    jwide = jh.wide;
-    if (filters) jwide *= jh.clrs;
-    jwide /= MIN (is_raw, tiff_samples);
-    switch (jh.algo) {
-      case 0xc1:
-	jh.vpred[0] = 16384;
-	getbits(-1);
-	for (jrow=0; jrow+7 < (unsigned) jh.high; jrow += 8) {
-	  for (jcol=0; jcol+7 < (unsigned) jh.wide; jcol += 8) {
-	    ljpeg_idct (&jh);
-	    rp = jh.idct;
-	    row = trow + jcol/tile_width + jrow*2;
-	    col = tcol + jcol%tile_width;
-	    for (i=0; i < 16; i+=2)
-	      for (j=0; j < 8; j++)
-		adobe_copy_pixel (row+i, col+j, &rp);
-	  }
-	}
-	break;
-      case 0xc3:
-	for (row=col=jrow=0; jrow < (unsigned) jh.high; jrow++) {
-	  rp = ljpeg_row (jrow, &jh);
-	  for (jcol=0; jcol < jwide; jcol++) {
-	    adobe_copy_pixel (trow+row, tcol+col, &rp);
-	    if (++col >= tile_width || col >= raw_width)
-	      row += 1 + (col = 0);
-	  }
-	}
-    }
+    if (!lossless_dng_tile (&jh, trow, tcol)) break;
     fseek (ifp, save+4, SEEK_SET);
     if ((tcol += tile_width) >= raw_width)
       trow += tile_length + (tcol = 0);
-    ljpeg_end (&jh);
   }
 }
 
@@ -1328,6 +1791,7 @@ void CLASS nikon_load_raw()
       max += (min = 16) << 1;
     }
     for (col=0; col < raw_width; col++) {
+      if (gbh_vbits < 32) getbits_fill();
       i = gethuff(huff);
       len = i & 15;
       shl = i >> 4;
@@ -1801,24 +2265,21 @@ void CLASS phase_one_load_raw()
 
 unsigned CLASS ph1_bithuff (int nbits, ushort *huff)
 {
-  // TODO: The following static variables are not thread-safe
-  static UINT64 bitbuf=0;
-  static int vbits=0;
   unsigned c;
 
   if (nbits == -1)
-    return bitbuf = vbits = 0;
+    return ph1_bitbuf = ph1_vbits = 0;
   if (nbits == 0) return 0;
-  if (vbits < nbits) {
-    bitbuf = bitbuf << 32 | get4();
-    vbits += 32;
+  if (ph1_vbits < nbits) {
+    ph1_bitbuf = ph1_bitbuf << 32 | get4();
+    ph1_vbits += 32;
   }
-  c = bitbuf << (64-vbits) >> (64-nbits);
+  c = ph1_bitbuf << (64-ph1_vbits) >> (64-nbits);
   if (huff) {
-    vbits -= huff[c] >> 8;
+    ph1_vbits -= huff[c] >> 8;
     return (uchar) huff[c];
   }
-  vbits -= nbits;
+  ph1_vbits -= nbits;
   return c;
 }
 #define ph1_bits(n) ph1_bithuff(n,0)
@@ -2103,18 +2564,16 @@ void CLASS canon_rmf_load_raw()
 
 unsigned CLASS pana_bits (int nbits)
 {
-  static uchar buf[0x4000];
-  static int vbits;
   int byte;
 
-  if (!nbits) return vbits=0;
-  if (!vbits) {
-    fread (buf+load_flags, 1, 0x4000-load_flags, ifp);
-    fread (buf, 1, load_flags, ifp);
+  if (!nbits) return pana_vbits=0;
+  if (!pana_vbits) {
+    fread (pana_buf+load_flags, 1, 0x4000-load_flags, ifp);
+    fread (pana_buf, 1, load_flags, ifp);
   }
-  vbits = (vbits - nbits) & 0x1ffff;
-  byte = vbits >> 3 ^ 0x3ff0;
-  return (buf[byte] | buf[byte+1] << 8) >> (vbits & 7) & ~(-1 << nbits);
+  pana_vbits = (pana_vbits - nbits) & 0x1ffff;
+  byte = pana_vbits >> 3 ^ 0x3ff0;
+  return (pana_buf[byte] | pana_buf[byte+1] << 8) >> (pana_vbits & 7) & ~(-1 << nbits);
 }
 
 void CLASS panasonic_load_raw()
@@ -2401,18 +2860,16 @@ void CLASS lossy_dng_load_raw() {}
 METHODDEF(boolean)
 fill_input_buffer (j_decompress_ptr cinfo)
 {
-  // TODO: The following static variable is not thread-safe
-  static uchar jpeg_buffer[4096];
   size_t nbytes;
   DCRaw *d = (DCRaw*)cinfo->client_data;
 
-  nbytes = fread (jpeg_buffer, 1, 4096, d->ifp);
+  nbytes = fread (d->jpeg_buffer, 1, 4096, d->ifp);
 #if defined(__MINGW64_VERSION_MAJOR) && __MINGW64_VERSION_MAJOR < 4
-  swab ((char *) jpeg_buffer, (char *) jpeg_buffer, nbytes);
+  swab ((char *) d->jpeg_buffer, (char *) d->jpeg_buffer, nbytes);
 #else
-  swab ((const char *) jpeg_buffer, (char *) jpeg_buffer, nbytes);
+  swab ((const char *) d->jpeg_buffer, (char *) d->jpeg_buffer, nbytes);
 #endif
-  cinfo->src->next_input_byte = jpeg_buffer;
+  cinfo->src->next_input_byte = d->jpeg_buffer;
   cinfo->src->bytes_in_buffer = nbytes;
   return boolean(TRUE);
 }
@@ -2764,8 +3221,7 @@ void CLASS kodak_thumb_load_raw()
 
 void CLASS sony_decrypt (unsigned *data, int len, int start, int key)
 {
-  // TODO: The following static variables are not thread-safe
-  static unsigned pad[128], p;
+  unsigned *pad = sony_pad, p = sony_p;
 
   if (start) {
     for (p=0; p < 4; p++)
@@ -2778,6 +3234,7 @@ void CLASS sony_decrypt (unsigned *data, int len, int start, int key)
   }
   while (len-- && p++)
     *data++ ^= pad[(p-1) & 127] = pad[p & 127] ^ pad[(p+64) & 127];
+  sony_p = p;
 }
 
 void CLASS sony_load_raw()
@@ -3164,14 +3621,12 @@ void CLASS redcine_load_raw()
 
 void CLASS foveon_decoder (int size, unsigned code)
 {
-  // TODO: The following static variable is not thread-safe
-  static unsigned huff[1024];
   struct decode *cur;
   int i, len;
 
   if (!code) {
     for (i=0; i < size; i++)
-      huff[i] = get4();
+      foveon_codes[i] = get4();
     memset (first_decode, 0, sizeof first_decode);
     free_decode = first_decode;
   }
@@ -3182,7 +3637,7 @@ void CLASS foveon_decoder (int size, unsigned code)
   }
   if (code)
     for (i=0; i < size; i++)
-      if (huff[i] == code) {
+      if (foveon_codes[i] == code) {
 	cur->leaf = i;
 	return;
       }
@@ -3273,8 +3728,8 @@ void CLASS foveon_huff (ushort *huff)
 
   huff[0] = 8;
   for (i=0; i < 13; i++) {
-    clen = getc(ifp);
-    code = getc(ifp);
+    clen = fgetc(ifp);
+    code = fgetc(ifp);
     for (j=0; j < 256 >> clen; )
       huff[code+ ++j] = clen << 8 | i;
   }
@@ -7270,7 +7725,6 @@ void CLASS parse_riff()
 void CLASS parse_crx (int end)
 {
   unsigned i, save, size, tag, base;
-  static int index=0, wide, high, off, len;
 
   order = 0x4d4d;
   while (ftell(ifp)+7 < end) {
@@ -7301,28 +7755,28 @@ void CLASS parse_crx (int end)
 	break;
       case 0x746b6864:				/* tkhd */
 	fseek (ifp, 12, SEEK_CUR);
-	index = get4();
+	crx_index = get4();
 	fseek (ifp, 58, SEEK_CUR);
-	wide = get4();
-	high = get4();
+	crx_wide = get4();
+	crx_high = get4();
 	break;
       case 0x7374737a:				/* stsz */
-	len = (get4(),get4());
+	crx_len = (get4(),get4());
 	break;
       case 0x636f3634:				/* co64 */
 	fseek (ifp, 12, SEEK_CUR);
-	off = get4();
-	switch (index) {
+	crx_off = get4();
+	switch (crx_index) {
 	  case 1:			/* 1 = full size, 2 = 27% size */
-	    thumb_width  = wide;
-	    thumb_height = high;
-	    thumb_length = len;
-	    thumb_offset = off;
+	    thumb_width  = crx_wide;
+	    thumb_height = crx_high;
+	    thumb_length = crx_len;
+	    thumb_offset = crx_off;
 	    break;
 	  case 3:
-	    raw_width  = wide;
-	    raw_height = high;
-	    data_offset = off;
+	    raw_width  = crx_wide;
+	    raw_height = crx_high;
+	    data_offset = crx_off;
 	    load_raw = &CLASS canon_crx_load_raw;
 	}
 	break;
@@ -10896,7 +11350,11 @@ next:
 #endif
     if (raw_image && read_from_stdin)
       fread (raw_image, 2, raw_height*raw_width, stdin);
-    else (*this.*load_raw)();
+    else {
+      ifp_map();
+      (*this.*load_raw)();
+      ifp_unmap();
+    }
     if (document_mode == 3) {
       top_margin = left_margin = fuji_width = 0;
       height = raw_height;
@@ -95,6 +95,24 @@ public:
     int tone_curve_size, tone_curve_offset; /* Nikon Tone Curves UF*/
     int tone_mode_offset, tone_mode_size; /* Nikon ToneComp UF*/
 
+    /* getbithuff() state */
+    unsigned long long gbh_bitbuf;
+    int gbh_vbits, gbh_reset;
+
+    /* Decoder state kept between calls, dcraw has these as statics */
+    unsigned long long ph1_bitbuf;
+    int ph1_vbits, pana_vbits;
+    uchar pana_buf[0x4000], jpeg_buffer[4096];
+    unsigned sony_pad[128], sony_p, foveon_codes[1024];
+    float idct_cs[106];
+    int crx_index, crx_wide, crx_high, crx_off, crx_len;
+
+    /* dcraw_load_raw() state between the shots of multishot images */
+    ushort (*shot_image)[4];
+    ushort *saved_raw_image;
+    float saved_cam_mul[4];
+    int saved_fuji_dr;
+
     /* Used by dcraw_message() */
     char *messageBuffer;
     int lastStatus;
@@ -114,11 +132,27 @@ public:
     int fscanf(FILE *stream, const char *format, void *ptr);
 // calling with more variables would triger a link error
 //int fscanf(FILE *stream, const char *format, void *ptr1, void *ptr2, ...);
+    int fseek(FILE *stream, long offset, int whence);
+    long ftell(FILE *stream);
+    int feof(FILE *stream);
+
+    /* While ifpMap is set, reads from ifp are served from a memory mapping
+     * of the input file instead of going through stdio. */
+    const uchar *ifpMap;
+    size_t ifpMapSize, ifpMapPos, ifpMapLast, ifpMapStep;
+    int ifpMapEof;
+    int ifp_map();
+    void ifp_unmap();
+    void ifpMapProgress();
 
     /* Initialization of the variables is done here */
     DCRaw();
     ~DCRaw();
     void dcraw_message(int code, const char *format, ...);
+    /* Parallel decoding of independent parts of the raw data */
+    DCRaw *reader_fork();
+    void reader_join(DCRaw *r);
+    int fork_parts(int nparts, void (DCRaw::*part)(int, void *), void *data);
     /* All dcraw functions with the CLASS prefix are members of this class. */
     int fcol(int row, int col);
     void merror(void *ptr, const char *where);
@@ -140,19 +174,28 @@ public:
     void canon_600_correct();
     int canon_s2is();
     unsigned getbithuff(int nbits, ushort *huff);
+    void getbits_fill();
     ushort * make_decoder_ref(const uchar **source);
     ushort * make_decoder(const uchar *source);
+    int * make_fast_decoder(const ushort *huff);
     void crw_init_tables(unsigned table, ushort *huff[2]);
     int canon_has_lowbits();
     void canon_load_raw();
     int ljpeg_start(struct jhead *jh, int info_only);
     void ljpeg_end(struct jhead *jh);
     int ljpeg_diff(ushort *huff);
+    int ljpeg_diff_fast(ushort *huff, const int *fast);
     ushort * ljpeg_row(int jrow, struct jhead *jh);
+    void lossless_jpeg_rows(struct jhead *jh, int jrow, int jend);
+    void lossless_jpeg_part(int part, void *data);
+    int lossless_jpeg_fork(struct jhead *jh);
     void lossless_jpeg_load_raw();
     void canon_sraw_load_raw();
     void adobe_copy_pixel(unsigned row, unsigned col, ushort **rp);
     void ljpeg_idct(struct jhead *jh);
+    int lossless_dng_tile(struct jhead *jh, unsigned trow, unsigned tcol);
+    void lossless_dng_part(int tile, void *data);
+    void lossless_dng_clear(struct dng_tiles *dt, unsigned ntiles);
     void lossless_dng_load_raw();
     void packed_dng_load_raw();
     void pentax_load_raw();
@@ -29,6 +29,14 @@
 #include <sys/types.h>
 #include "dcraw_api.h"
 #include "dcraw.h"
+#ifdef _OPENMP
+#include <omp.h>
+#define uf_omp_get_thread_num() omp_get_thread_num()
+#define uf_omp_get_num_threads() omp_get_num_threads()
+#else
+#define uf_omp_get_thread_num() 0
+#define uf_omp_get_num_threads() 1
+#endif
 
 #define FORC(cnt) for (c=0; c < cnt; c++)
 #define FORC3 FORC(3)
@@ -53,8 +61,11 @@ extern "C" {
     void lin_interpolate_INDI(gushort(*image)[4], const unsigned filters,
                               const int width, const int height,
                               const int colors, void *dcraw, dcraw_data *h);
+    void draft_interpolate_INDI(gushort(*image)[4], const unsigned filters,
+                                const int width, const int height,
+                                const int colors, void *dcraw, dcraw_data *h);
     void vng_interpolate_INDI(gushort(*image)[4], const unsigned filters,
-                              const int width, const int height, const int colors, const int rgb_max,
+                              const int width, const int height, const int colors,
                               void *dcraw, dcraw_data *h);
     void xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                                  const int width, const int height,
@@ -64,13 +75,20 @@ extern "C" {
                               const int width, const int height, const int colors, float rgb_cam[3][4],
                               void *dcraw, dcraw_data *h);
     void color_smooth(gushort(*image)[4], const int width, const int height,
-                      const int passes);
+                      const int passes, const int buffered);
     void ppg_interpolate_INDI(gushort(*image)[4], const unsigned filters,
                               const int width, const int height, const int colors, void *dcraw, dcraw_data *h);
     void flip_image_INDI(gushort(*image)[4], int *height_p, int *width_p,
                          const int flip);
+    void flip_buffer_INDI(void *buffer, const int depth, int *height_p,
+                          int *width_p, const int flip);
     void fuji_rotate_INDI(gushort(**image_p)[4], int *height_p, int *width_p,
                           int *fuji_width_p, const int colors, const double step, void *dcraw);
+    void scratch_release_INDI();
+
+    /* Number of open images. The interpolation buffers are kept while
+     * there are any. */
+    static gint dcraw_open_images = 0;
 
     int dcraw_open(dcraw_data *h, char *filename)
     {
@@ -186,6 +204,7 @@ extern "C" {
         h->thumbType = unknown_thumb_type;
         h->message = d->messageBuffer;
         memcpy(h->xtrans, d->xtrans, sizeof d->xtrans);
+        g_atomic_int_inc(&dcraw_open_images);
         return d->lastStatus;
     }
 
@@ -378,17 +397,19 @@ start:
         fseek(d->ifp, 0, SEEK_END);
         d->ifpSize = ftell(d->ifp);
         fseek(d->ifp, d->data_offset, SEEK_SET);
+        d->ifp_map();
         (d->*d->load_raw)();
+        d->ifp_unmap();
 
         /* multishot support, for now Pentax only. */
         if (d->is_raw == 4 && !strncasecmp(d->make, "Pentax", 6)) {
 
             int row, col, i;
             int positions[4][2] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
-            static dcraw_image_type *tmp = NULL;
+            dcraw_image_type *tmp = d->shot_image;
 
             if (!tmp)
-                tmp = d->image = g_new0(dcraw_image_type, d->height * d->width + d->meta_length);
+                tmp = d->shot_image = d->image = g_new0(dcraw_image_type, d->height * d->width + d->meta_length);
 
 #ifdef _OPENMP
             #pragma omp parallel for private(col)
@@ -425,22 +446,18 @@ start:
             h->filters = 0;
             h->shrink = 0;
 
-            tmp = NULL;
+            d->shot_image = NULL;
         }
 
         /* Fuji Super CCD SR and EXR support */
         if (d->is_raw == 2 && !strncasecmp(d->make, "Fujifilm", 8)) {
 
-            static int saved_fuji_dr;
-            static float saved_cam_mul[4];
-            static guint16 *saved_raw_image = NULL;
+            if (!d->saved_raw_image) {
 
-            if (!saved_raw_image) {
-
-                saved_raw_image = d->raw_image;
+                d->saved_raw_image = d->raw_image;
                 d->raw_image = NULL;
-                saved_fuji_dr = d->fuji_dr;
-                FORC4 saved_cam_mul[c] = d->cam_mul[c];
+                d->saved_fuji_dr = d->fuji_dr;
+                FORC4 d->saved_cam_mul[c] = d->cam_mul[c];
 
                 d->shot_select++;
                 fseek(d->ifp, 0, SEEK_SET);
@@ -448,10 +465,10 @@ start:
                 goto start;
             }
 
-            fuji_merge(d, saved_raw_image, saved_cam_mul, saved_fuji_dr);
+            fuji_merge(d, d->saved_raw_image, d->saved_cam_mul, d->saved_fuji_dr);
 
-            free(saved_raw_image);
-            saved_raw_image = NULL;
+            g_free(d->saved_raw_image);
+            d->saved_raw_image = NULL;
             d->shot_select--;
 
             FORC4 h->cam_mul[c] = d->cam_mul[c];
@@ -550,43 +567,6 @@ start:
         return d->lastStatus;
     }
 
-    /* Grab a pixel from the raw data, doing dark frame removal on the fly.
-     *
-     * The most obvious algorithm for dark frame removal is to simply
-     * subtract the dark frame from the image (rounding negative values to
-     * zero).  However, this leaves holes in the resulting image that need
-     * to be interpolated from the surrounding pixels.
-     *
-     * The processing works by subtracting the dark frame as usual for most
-     * pixels.  For all pixels where the dark frame is brighter than a given
-     * threshold, the result is instead calculated as the average of the
-     * dark-adjusted values of the 4 surrounding pixels.  By this method,
-     * only hot pixels (as determined by the threshold) are examined and
-     * recalculated.
-     */
-    static int get_dark_pixel(const dcraw_data *h, const dcraw_data *dark,
-                              int i, int cl)
-    {
-        return MAX(h->raw.image[i][cl] - dark->raw.image[i][cl], 0);
-    }
-
-    static int get_pixel(const dcraw_data *h, const dcraw_data *dark,
-                         int i, int cl, int pixels)
-    {
-        int pixel = h->raw.image[i][cl];
-        if (dark != 0) {
-            int w = h->raw.width;
-            pixel = (dark->raw.image[i][cl] <= dark->thresholds[cl])
-                    ? MAX(pixel - dark->raw.image[i][cl], 0)
-                    : (get_dark_pixel(h, dark, i + ((i >= 1) ? -1 : 1), cl) +
-                       get_dark_pixel(h, dark, i + ((i < pixels - 1) ? 1 : -1), cl) +
-                       get_dark_pixel(h, dark, i + ((i >= w) ? -w : w), cl) +
-                       get_dark_pixel(h, dark, i + ((i < pixels - w) ? w : -w), cl))
-                    / 4;
-        }
-        return pixel;
-    }
-
     /*
      * fcol_INDI() optimizing wrapper.
      * fcol_sequence() cooks up the filter color sequence for a row knowing that
@@ -743,11 +723,45 @@ start:
         return d->lastStatus;
     }
 
+    /* Source pixel s of a resize by mul/div is divided between the
+     * destination pixels lo and hi, with weights wlo + whi == mul.
+     * Pixels beyond the last full destination pixel get no weight. */
+    typedef struct {
+        int lo, hi;
+        guint32 wlo, whi;
+    } resize_weight;
+
+    static resize_weight *resize_weights(int n, int out, int mul, int div)
+    {
+        resize_weight *wt = g_new(resize_weight, n);
+        for (int s = 0; s < n; s++) {
+            wt[s].lo = s * mul / div;
+            wt[s].hi = (s + 1) * mul / div;
+            if (wt[s].lo == wt[s].hi) {
+                wt[s].wlo = mul;
+                wt[s].whi = 0;
+            } else {
+                wt[s].wlo = wt[s].hi * div - s * mul;
+                wt[s].whi = (s + 1) * mul - wt[s].hi * div;
+            }
+            if (wt[s].hi >= out) {
+                wt[s].hi = out - 1;
+                wt[s].whi = 0;
+            }
+            if (wt[s].lo >= out) {
+                wt[s].lo = out - 1;
+                wt[s].wlo = 0;
+            }
+        }
+        return wt;
+    }
+
     int dcraw_image_resize(dcraw_image_data *image, int size)
     {
-        int h, w, wid, r, ri, rii, c, ci, cii, cl, norm;
-        guint64 riw, riiw, ciw, ciiw;
-        guint64(*iBuf)[4];
+        int h, w, wid, r, R, c, cl, colors = image->colors;
+        guint64 norm, wr;
+        dcraw_image_type *iBuf;
+        resize_weight *rw, *cw;
         int mul = size, div = MAX(image->height, image->width);
 
         if (mul > div) return DCRAW_ERROR;
@@ -756,48 +770,60 @@ start:
         h = image->height * mul / div;
         w = image->width * mul / div;
         wid = image->width;
-        iBuf = (guint64(*)[4])g_new0(guint64, h * w * 4);
-        norm = div * div;
-
-        for (r = 0; r < image->height; r++) {
-            /* r should be divided between ri and rii */
-            ri = r * mul / div;
-            rii = (r + 1) * mul / div;
-            /* with weights riw and riiw (riw+riiw==mul) */
-            riw = rii * div - r * mul;
-            riiw = (r + 1) * mul - rii * div;
-            if (rii >= h) {
-                rii = h - 1;
-                riiw = 0;
-            }
-            if (ri >= h) {
-                ri = h - 1;
-                riw = 0;
-            }
-            for (c = 0; c < image->width; c++) {
-                ci = c * mul / div;
-                cii = (c + 1) * mul / div;
-                ciw = cii * div - c * mul;
-                ciiw = (c + 1) * mul - cii * div;
-                if (cii >= w) {
-                    cii = w - 1;
-                    ciiw = 0;
-                }
-                if (ci >= w) {
-                    ci = w - 1;
-                    ciw = 0;
-                }
-                for (cl = 0; cl < image->colors; cl++) {
-                    iBuf[ri * w + ci ][cl] += image->image[r * wid + c][cl] * riw * ciw ;
-                    iBuf[ri * w + cii][cl] += image->image[r * wid + c][cl] * riw * ciiw;
-                    iBuf[rii * w + ci ][cl] += image->image[r * wid + c][cl] * riiw * ciw ;
-                    iBuf[rii * w + cii][cl] += image->image[r * wid + c][cl] * riiw * ciiw;
+        iBuf = g_new0(dcraw_image_type, h * w);
+        norm = (guint64)div * div;
+        rw = resize_weights(image->height, h, mul, div);
+        cw = resize_weights(wid, w, mul, div);
+
+        /* Each output row sums the rows of its area after they were
+         * resized horizontally. A horizontal sum is at most 0xFFFF * div
+         * and div, an image dimension, fits in 16 bits, so it fits in
+         * 32 bits. The vertical sums need 64 bits. */
+#ifdef _OPENMP
+        #pragma omp parallel default(shared) private(r,R,c,cl,wr)
+#endif
+        {
+            guint32(*hRow)[4] = (guint32(*)[4])g_new(guint32, w * 4);
+            guint64(*vRow)[4] = (guint64(*)[4])g_new(guint64, w * 4);
+            int hLast = -1;
+#ifdef _OPENMP
+            #pragma omp for schedule(static)
+#endif
+            for (R = 0; R < h; R++) {
+                memset(vRow, 0, w * sizeof * vRow);
+                for (r = MAX((int)((gint64)R * div / mul) - 1, 0);
+                        r < image->height && rw[r].lo <= R; r++) {
+                    wr = (rw[r].lo == R ? rw[r].wlo : 0) +
+                         (rw[r].hi == R ? rw[r].whi : 0);
+                    if (wr == 0) continue;
+                    /* The last row of an area is often the first of the
+                     * next one */
+                    if (r != hLast) {
+                        hLast = r;
+                        memset(hRow, 0, w * sizeof * hRow);
+                        for (c = 0; c < wid; c++) {
+                            const gushort *pix = image->image[r * wid + c];
+                            for (cl = 0; cl < colors; cl++) {
+                                hRow[cw[c].lo][cl] += pix[cl] * cw[c].wlo;
+                                hRow[cw[c].hi][cl] += pix[cl] * cw[c].whi;
+                            }
+                        }
+                    }
+                    for (c = 0; c < w; c++)
+                        for (cl = 0; cl < colors; cl++)
+                            vRow[c][cl] += wr * hRow[c][cl];
                 }
+                for (c = 0; c < w; c++)
+                    for (cl = 0; cl < colors; cl++)
+                        iBuf[R * w + c][cl] = vRow[c][cl] / norm;
             }
+            g_free(vRow);
+            g_free(hRow);
         }
-        for (c = 0; c < h * w; c++) for (cl = 0; cl < image->colors; cl++)
-                image->image[c][cl] = iBuf[c][cl] / norm;
-        g_free(iBuf);
+        g_free(cw);
+        g_free(rw);
+        g_free(image->image);
+        image->image = iBuf;
         image->height = h;
         image->width = w;
         return DCRAW_SUCCESS;
@@ -850,6 +876,14 @@ start:
         return DCRAW_SUCCESS;
     }
 
+    int dcraw_flip_buffer(void *buffer, int depth, int *height, int *width,
+                          int flip)
+    {
+        if (flip)
+            flip_buffer_INDI(buffer, depth, height, width, flip);
+        return DCRAW_SUCCESS;
+    }
+
     int dcraw_set_color_scale(dcraw_data *h, int useCameraWB)
     {
         DCRaw *d = (DCRaw *)h->dcraw;
@@ -890,44 +924,138 @@ start:
      * (plus normalization to use the full 16 bit pixel value range) in one
      * pass.
      *
-     * TODO: recode and optimize dark frame path
+     * The dark frame path finalizes the rows of each thread in order with
+     * dcraw_finalize_raw_row(), keeping the unfinalized rows around the
+     * current one in a ring. The row below the last row of a thread is
+     * taken before any thread starts.
      */
-    void dcraw_finalize_raw(dcraw_data *h, dcraw_data *dark, int rgbWB[4])
+    void dcraw_finalize_raw(dcraw_data *h, dcraw_data *dark,
+                            const int rgbWB[4])
     {
         const int pixels = h->raw.width * h->raw.height;
         const unsigned black = dark ? MAX(h->black - dark->black, 0) : h->black;
-        if (h->colors == 3)
-            rgbWB[3] = rgbWB[1];
+        const int wb[4] = { rgbWB[0], rgbWB[1], rgbWB[2],
+                            h->colors == 3 ? rgbWB[1] : rgbWB[3]
+                          };
         if (dark) {
+            const int w = h->raw.width, height = h->raw.height;
+            const size_t size = w * sizeof(dcraw_image_type);
 #ifdef _OPENMP
-            #pragma omp parallel for schedule(static) \
-            shared(h,dark,rgbWB)
+            #pragma omp parallel default(shared)
 #endif
-            for (int i = 0; i < pixels; i++) {
-                int cc;
-                for (cc = 0; cc < 4; cc++) {
-                    gint32 p = (gint64)(get_pixel(h, dark, i, cc, pixels) - black) *
-                               rgbWB[cc] / 0x10000;
-                    h->raw.image[i][cc] = MIN(MAX(p, 0), 0xFFFF);
+            {
+                const int threads = uf_omp_get_num_threads();
+                const int thread = uf_omp_get_thread_num();
+                const int first = height * thread / threads;
+                const int last = height * (thread + 1) / threads;
+                dcraw_image_type *ring = g_new(dcraw_image_type, 4 * w);
+                dcraw_image_type *below = ring + 3 * w;
+                dcraw_image_type *rows[3];
+                int row;
+                if (first < last) {
+                    if (first > 0)
+                        memcpy(ring + (first - 1) % 3 * w,
+                               h->raw.image + (first - 1) * w, size);
+                    memcpy(ring + first % 3 * w, h->raw.image + first * w, size);
+                    if (last < height)
+                        memcpy(below, h->raw.image + last * w, size);
+                }
+#ifdef _OPENMP
+                #pragma omp barrier
+#endif
+                for (row = first; row < last; row++) {
+                    rows[0] = row > 0 ? ring + (row - 1) % 3 * w : NULL;
+                    rows[1] = ring + row % 3 * w;
+                    if (row + 1 < last) {
+                        rows[2] = ring + (row + 1) % 3 * w;
+                        memcpy(rows[2], h->raw.image + (row + 1) * w, size);
+                    } else {
+                        rows[2] = last < height ? below : NULL;
+                    }
+                    dcraw_finalize_raw_row(h, dark, wb, rows,
+                                           h->raw.image + row * w, row);
                 }
+                g_free(ring);
             }
         } else {
 #ifdef _OPENMP
             #pragma omp parallel for schedule(static) \
-            shared(h,dark,rgbWB)
+            shared(h,dark,wb)
 #endif
             for (int i = 0; i < pixels; i++) {
                 int cc;
                 for (cc = 0; cc < 4; cc++)
                     h->raw.image[i][cc] = MIN(MAX(
                                                   ((gint64)h->raw.image[i][cc] - black) *
-                                                  rgbWB[cc] / 0x10000, 0), 0xFFFF);
+                                                  wb[cc] / 0x10000, 0), 0xFFFF);
+            }
+        }
+    }
+
+    /*
+     * dcraw_finalize_raw() of a single row, for callers that do more work
+     * on each row in the same pass. rows[1] is the row itself, rows[0] and
+     * rows[2] the rows above and below it, or NULL outside the image. The
+     * dark frame needs them to replace its hot pixels. The result is
+     * written to out.
+     *
+     * The most obvious algorithm for dark frame removal is to simply
+     * subtract the dark frame from the image (rounding negative values to
+     * zero).  However, this leaves holes in the resulting image that need
+     * to be interpolated from the surrounding pixels.
+     *
+     * The processing works by subtracting the dark frame as usual for most
+     * pixels.  For all pixels where the dark frame is brighter than a given
+     * threshold, the result is instead calculated as the average of the
+     * dark-adjusted values of the 4 surrounding pixels.  By this method,
+     * only hot pixels (as determined by the threshold) are examined and
+     * recalculated. The neighbours are taken before they are finalized.
+     */
+    void dcraw_finalize_raw_row(const dcraw_data *h, const dcraw_data *dark,
+                                const int rgbWB[4],
+                                dcraw_image_type *const rows[3],
+                                dcraw_image_type *out, int row)
+    {
+        const int w = h->raw.width, height = h->raw.height;
+        const int black = dark ? MAX(h->black - dark->black, 0) : h->black;
+        const int wb[4] = { rgbWB[0], rgbWB[1], rgbWB[2],
+                            h->colors == 3 ? rgbWB[1] : rgbWB[3]
+                          };
+        const dcraw_image_type *in = rows[1];
+        const dcraw_image_type *dk = dark ? dark->raw.image + row * w : NULL;
+
+        for (int col = 0; col < w; col++) {
+            for (int cc = 0; cc < 4; cc++) {
+                gint64 pixel = in[col][cc];
+                if (dark && dk[col][cc] <= dark->thresholds[cc]) {
+                    pixel = MAX(pixel - dk[col][cc], 0);
+                } else if (dark) {
+                    /* The four neighbours, mirrored at the
+                     * first and last pixel and at the top and bottom */
+                    const dcraw_image_type *above = row > 0 ? rows[0] : rows[2];
+                    const dcraw_image_type *below = row < height - 1 ? rows[2] : rows[0];
+                    int left = col > 0 ? in[col - 1][cc] - dk[col - 1][cc] :
+                               row > 0 ? rows[0][w - 1][cc] - dk[-1][cc] :
+                               in[1][cc] - dk[1][cc];
+                    int right = col < w - 1 ? in[col + 1][cc] - dk[col + 1][cc] :
+                                row < height - 1 ? rows[2][0][cc] - dk[w][cc] :
+                                in[w - 2][cc] - dk[w - 2][cc];
+                    int up = above[col][cc] -
+                             dk[row > 0 ? col - w : col + w][cc];
+                    int down = below[col][cc] -
+                               dk[row < height - 1 ? col + w : col - w][cc];
+                    pixel = (MAX(left, 0) + MAX(right, 0) + MAX(up, 0) +
+                             MAX(down, 0)) / 4;
+                }
+                gint64 p = (pixel - black) * wb[cc] / 0x10000;
+                out[col][cc] = MIN(MAX(p, 0), 0xFFFF);
             }
         }
     }
 
     int dcraw_finalize_interpolate(dcraw_image_data *f, dcraw_data *h,
-                                   int interpolation, int smoothing)
+                                   int interpolation, int smoothing,
+                                   int smoothingBuffered)
     {
         DCRaw *d = (DCRaw *)h->dcraw;
         int fujiWidth, i, r, c, cl;
@@ -959,7 +1087,8 @@ start:
 
         /* It might be better to report an error here: */
         /* (dcraw also forbids AHD for Fuji rotated images) */
-        if (h->filters == 9 && interpolation != dcraw_bilinear_interpolation)
+        if (h->filters == 9 && interpolation != dcraw_bilinear_interpolation
+                && interpolation != dcraw_draft_interpolation)
             interpolation = dcraw_xtrans_interpolation;
         if (interpolation == dcraw_ahd_interpolation && h->colors > 3)
             interpolation = dcraw_vng_interpolation;
@@ -978,12 +1107,14 @@ start:
         int smoothPasses = 1;
         if (interpolation == dcraw_bilinear_interpolation && (h->filters == 1 || h->filters > 1000))
             lin_interpolate_INDI(f->image, ff, f->width, f->height, cl, d, h);
+        else if (interpolation == dcraw_draft_interpolation && (h->filters == 1 || h->filters > 1000))
+            draft_interpolate_INDI(f->image, ff, f->width, f->height, cl, d, h);
 #ifdef ENABLE_INTERP_NONE
         else if (interpolation == dcraw_none_interpolation)
             smoothing = 0;
 #endif
         else if (interpolation == dcraw_vng_interpolation || h->colors > 3)
-            vng_interpolate_INDI(f->image, ff, f->width, f->height, cl, 0xFFFF, d, h);
+            vng_interpolate_INDI(f->image, ff, f->width, f->height, cl, d, h);
         else if (interpolation == dcraw_ppg_interpolation && h->filters > 1000)
             ppg_interpolate_INDI(f->image, ff, f->width, f->height, cl, d, h);
 
@@ -991,13 +1122,18 @@ start:
             xtrans_interpolate_INDI(f->image, h->filters, f->width, f->height,
                                     h->colors, h->rgb_cam, d, h, 3);
             smoothPasses = 3;
+        } else if (interpolation == dcraw_draft_interpolation && h->filters == 9) {
+            /* Only the four main directions of the first pass */
+            xtrans_interpolate_INDI(f->image, h->filters, f->width, f->height,
+                                    h->colors, h->rgb_cam, d, h, 1);
         } else if (interpolation == dcraw_ahd_interpolation) {
             ahd_interpolate_INDI(f->image, ff, f->width, f->height, cl,
                                  h->rgb_cam, d, h);
             smoothPasses = 3;
         }
         if (smoothing)
-            color_smooth(f->image, f->width, f->height, smoothPasses);
+            color_smooth(f->image, f->width, f->height, smoothPasses,
+                         smoothingBuffered);
 
         if (cl == 4 && h->colors == 3) {
             for (i = 0; i < f->height * f->width; i++)
@@ -1015,6 +1151,13 @@ start:
         DCRaw *d = (DCRaw *)h->dcraw;
         g_free(h->raw.image);
         delete d;
+        if (g_atomic_int_dec_and_test(&dcraw_open_images))
+            dcraw_release_buffers();
+    }
+
+    void dcraw_release_buffers()
+    {
+        scratch_release_INDI();
     }
 
     char *ufraw_message(int code, char *message, ...);
@@ -54,7 +54,8 @@ typedef struct {
 enum { dcraw_ahd_interpolation,
        dcraw_vng_interpolation, dcraw_four_color_interpolation,
        dcraw_ppg_interpolation, dcraw_bilinear_interpolation,
-       dcraw_xtrans_interpolation, dcraw_none_interpolation
+       dcraw_xtrans_interpolation, dcraw_none_interpolation,
+       dcraw_draft_interpolation
      };
 enum { unknown_thumb_type, jpeg_thumb_type, ppm_thumb_type };
 int dcraw_open(dcraw_data *h, char *filename);
@@ -65,13 +66,22 @@ int dcraw_finalize_shrink(dcraw_image_data *f, dcraw_data *h,
 int dcraw_image_resize(dcraw_image_data *image, int size);
 int dcraw_image_stretch(dcraw_image_data *image, double pixel_aspect);
 int dcraw_flip_image(dcraw_image_data *image, int flip);
+int dcraw_flip_buffer(void *buffer, int depth, int *height, int *width,
+                      int flip);
 int dcraw_set_color_scale(dcraw_data *h, int useCameraWB);
 void dcraw_wavelet_denoise(dcraw_data *h, float threshold);
 void dcraw_wavelet_denoise_shrinked(dcraw_image_data *f, float threshold);
-void dcraw_finalize_raw(dcraw_data *h, dcraw_data *dark, int rgbWB[4]);
+void dcraw_finalize_raw(dcraw_data *h, dcraw_data *dark,
+                        const int rgbWB[4]);
+void dcraw_finalize_raw_row(const dcraw_data *h, const dcraw_data *dark,
+                            const int rgbWB[4],
+                            dcraw_image_type *const rows[3],
+                            dcraw_image_type *out, int row);
 int dcraw_finalize_interpolate(dcraw_image_data *f, dcraw_data *h,
-                               int interpolation, int smoothing);
+                               int interpolation, int smoothing,
+                               int smoothingBuffered);
 void dcraw_close(dcraw_data *h);
+void dcraw_release_buffers();
 void dcraw_image_dimensions(dcraw_data *raw, int flip, int shrink,
                             int *height, int *width);
 
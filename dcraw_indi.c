@@ -22,18 +22,25 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include <glib.h>
 #include <glib/gi18n.h> /*For _(String) definition - NKBJ*/
 #include "dcraw_api.h"
 #include "uf_progress.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #ifdef _OPENMP
 #include <omp.h>
 #define uf_omp_get_thread_num() omp_get_thread_num()
 #define uf_omp_get_num_threads() omp_get_num_threads()
+#define uf_omp_get_max_threads() omp_get_max_threads()
 #else
 #define uf_omp_get_thread_num() 0
 #define uf_omp_get_num_threads() 1
+#define uf_omp_get_max_threads() 1
 #endif
 
 #if !defined(ushort)
@@ -103,15 +110,137 @@ static void CLASS merror(void *ptr, char *where)
     g_error("Out of memory in %s\n", where);
 }
 
-static void CLASS hat_transform(float *temp, float *base, int st, int size, int sc)
+/* One level of the hat transform of a row, scaled by 1/4 into low */
+static void CLASS hat_transform_row(float *low, const float *base, int size,
+                                    int sc, const int simd)
 {
     int i;
     for (i = 0; i < sc; i++)
-        temp[i] = 2 * base[st * i] + base[st * (sc - i)] + base[st * (i + sc)];
+        low[i] = (2 * base[i] + base[sc - i] + base[i + sc]) * 0.25;
+#ifdef __SSE2__
+    const __m128 quarter = _mm_set1_ps(0.25);
+    for (; simd && i + sc + 4 <= size; i += 4) {
+        __m128 b = _mm_loadu_ps(base + i);
+        __m128 t = _mm_add_ps(_mm_add_ps(_mm_add_ps(b, b),
+                                         _mm_loadu_ps(base + i - sc)),
+                              _mm_loadu_ps(base + i + sc));
+        _mm_storeu_ps(low + i, _mm_mul_ps(t, quarter));
+    }
+#endif
     for (; i + sc < size; i++)
-        temp[i] = 2 * base[st * i] + base[st * (i - sc)] + base[st * (i + sc)];
+        low[i] = (2 * base[i] + base[i - sc] + base[i + sc]) * 0.25;
     for (; i < size; i++)
-        temp[i] = 2 * base[st * i] + base[st * (i - sc)] + base[st * (2 * size - 2 - (i + sc))];
+        low[i] = (2 * base[i] + base[i - sc] + base[2 * size - 2 - (i + sc)]) * 0.25;
+}
+
+/* Soft threshold of the detail high - low, added to sum unless it is NULL */
+static inline void wavelet_threshold(float *high, float low, float *sum,
+                                     float thold)
+{
+    float h = *high - low;
+    if	(h < -thold) h += thold;
+    else if (h >  thold) h -= thold;
+    else	 h = 0;
+    *high = h;
+    if (sum) *sum += h;
+}
+
+/* Vertical hat transform of 'cols' neighbouring columns of low, one row
+ * at a time so that each row of the block is read from memory once.
+ * The result is written back to low and the detail it leaves in high is
+ * thresholded in the same sweep. temp must hold size * cols floats. */
+static void hat_transform_block(float *temp, float *low, float *high,
+                                float *sum, int width, int size, int sc,
+                                int cols, float thold, const int simd)
+{
+    int i, j, up, down;
+    for (i = 0; i < size; i++) {
+        const float *b = low + i * width;
+        const float *u, *d;
+        float *t = temp + i * cols;
+        up = i < sc ? sc - i : i - sc;
+        down = i + sc < size ? i + sc : 2 * size - 2 - (i + sc);
+        u = low + up * width;
+        d = low + down * width;
+        j = 0;
+#ifdef __SSE2__
+        for (; simd && j + 4 <= cols; j += 4) {
+            __m128 v = _mm_loadu_ps(b + j);
+            _mm_storeu_ps(t + j, _mm_add_ps(_mm_add_ps(_mm_add_ps(v, v),
+                                                       _mm_loadu_ps(u + j)),
+                                            _mm_loadu_ps(d + j)));
+        }
+#endif
+        for (; j < cols; j++)
+            t[j] = 2 * b[j] + u[j] + d[j];
+    }
+    for (i = 0; i < size; i++) {
+        float *l = low + i * width, *h = high + i * width;
+        float *s = sum ? sum + i * width : NULL;
+        const float *t = temp + i * cols;
+        j = 0;
+#ifdef __SSE2__
+        const __m128 quarter = _mm_set1_ps(0.25), th = _mm_set1_ps(thold);
+        const __m128 nth = _mm_set1_ps(-thold);
+        for (; simd && j + 4 <= cols; j += 4) {
+            __m128 lv = _mm_mul_ps(_mm_loadu_ps(t + j), quarter);
+            __m128 hv = _mm_sub_ps(_mm_loadu_ps(h + j), lv);
+            hv = _mm_or_ps(_mm_and_ps(_mm_cmplt_ps(hv, nth), _mm_add_ps(hv, th)),
+                           _mm_and_ps(_mm_cmpgt_ps(hv, th), _mm_sub_ps(hv, th)));
+            _mm_storeu_ps(l + j, lv);
+            _mm_storeu_ps(h + j, hv);
+            if (s) _mm_storeu_ps(s + j, _mm_add_ps(_mm_loadu_ps(s + j), hv));
+        }
+#endif
+        for (; j < cols; j++) {
+            l[j] = t[j] * 0.25;
+            wavelet_threshold(h + j, l[j], s ? s + j : NULL, thold);
+        }
+    }
+}
+
+/* Rows of context around a strip. Each of the five levels reaches 1 << lev
+ * rows further, so the rows of the strip itself come out the same as if
+ * the whole image was transformed. */
+#define WAVELET_MARGIN 32
+#define WAVELET_BLOCK 64	/* Columns of a vertical hat transform block */
+
+/* Denoise rows top to bottom of color c into out. fimg must hold three
+ * planes of the strip and its margins, temp must hold WAVELET_BLOCK
+ * columns of them. simd is FALSE to keep the scalar loops. */
+static void wavelet_denoise_strip(ushort(*image)[4], ushort *out,
+                                  float *fimg, float *temp, const int c,
+                                  const int top, const int bottom,
+                                  const int iheight, const int iwidth,
+                                  const float threshold, const int simd)
+{
+    static const float noise[] =
+    { 0.8002, 0.2735, 0.1202, 0.0585, 0.0291, 0.0152, 0.0080, 0.0044 };
+    const int y0 = MAX(top - WAVELET_MARGIN, 0);
+    const int rows = MIN(bottom + WAVELET_MARGIN, iheight) - y0;
+    const int size = rows * iwidth;
+    float thold;
+    int lev, hpass, lpass, row, col, i;
+
+    for (i = 0; i < size; i++)
+        fimg[i] = 256 * sqrt(image[y0 * iwidth + i][c] /*<< scale*/);
+    for (hpass = lev = 0; lev < 5; lev++) {
+        progress(PROGRESS_WAVELET_DENOISE, 1);
+        lpass = size * ((lev & 1) + 1);
+        thold = threshold * noise[lev];
+        for (row = 0; row < rows; row++)
+            hat_transform_row(fimg + lpass + row * iwidth,
+                              fimg + hpass + row * iwidth, iwidth, 1 << lev,
+                              simd);
+        for (col = 0; col < iwidth; col += WAVELET_BLOCK)
+            hat_transform_block(temp, fimg + lpass + col, fimg + hpass + col,
+                                hpass ? fimg + col : NULL, iwidth, rows,
+                                1 << lev, MIN(WAVELET_BLOCK, iwidth - col),
+                                thold, simd);
+        hpass = lpass;
+    }
+    for (i = (top - y0) * iwidth; i < (bottom - y0) * iwidth; i++)
+        out[y0 * iwidth + i] = CLIP(SQR(fimg[i] + fimg[lpass + i]) / 0x10000);
 }
 
 void CLASS wavelet_denoise_INDI(ushort(*image)[4], const int black,
@@ -121,61 +250,55 @@ void CLASS wavelet_denoise_INDI(ushort(*image)[4], const int black,
                                 const float pre_mul[4], const float threshold,
                                 const unsigned filters)
 {
-    float *fimg = 0, thold, mul[2], avg, diff;
-    int size, lev, hpass, lpass, row, col, nc, c, i, wlast;
-    ushort *window[4];
-    static const float noise[] =
-    { 0.8002, 0.2735, 0.1202, 0.0585, 0.0291, 0.0152, 0.0080, 0.0044 };
+    float *fimg, *temp, thold, mul[2], avg, diff;
+    int size, strip, strips, rows, row, col, nc, c, i, wlast;
+    ushort *window[4], *out;
+    const int simd = g_getenv("UFRAW_NO_SIMD") == NULL;
 
 //  dcraw_message (dcraw, DCRAW_VERBOSE,_("Wavelet denoising...\n")); /*UF*/
 
     /* Scaling is done somewhere else - NKBJ*/
     size = iheight * iwidth;
-    float temp[iheight + iwidth];
     if ((nc = colors) == 3 && filters) nc++;
-    progress(PROGRESS_WAVELET_DENOISE, -nc * 5);
+    /* The colors are denoised one after the other, each in strips of rows
+     * that are shared among the threads. This keeps the memory to a few
+     * strips instead of three copies of the image per color. */
+    strip = LIM(iheight / (2 * uf_omp_get_max_threads()), 128, 384);
+    if (iheight <= strip + 2 * WAVELET_MARGIN)
+        strip = iheight;
+    strips = (iheight + strip - 1) / strip;
+    rows = MIN(strip + 2 * WAVELET_MARGIN, iheight);
+    out = (ushort *) malloc(size * sizeof * out);
+    merror(out, "wavelet_denoise()");
+    progress(PROGRESS_WAVELET_DENOISE, -nc * strips * 5);
 #ifdef _OPENMP
-#if defined(__sun) && !defined(__GNUC__)	/* Fix bug #3205673 - NKBJ */
-    #pragma omp parallel for				\
-    shared(nc,image,size,noise)				\
-    private(c,i,hpass,lev,lpass,row,col,thold,fimg,temp)
-#else
-    #pragma omp parallel for				\
-    shared(nc,image,size)				\
-    private(c,i,hpass,lev,lpass,row,col,thold,fimg,temp)
+    #pragma omp parallel				\
+    default(shared)					\
+    private(c,i,fimg,temp)
 #endif
+    {
+        fimg = (float *) malloc(rows * iwidth * 3 * sizeof * fimg);
+        merror(fimg, "wavelet_denoise()");
+        temp = (float *) malloc(rows * WAVELET_BLOCK * sizeof * temp);
+        merror(temp, "wavelet_denoise()");
+        FORC(nc) {			/* denoise R,G1,B,G3 individually */
+#ifdef _OPENMP
+            #pragma omp for schedule(dynamic)
 #endif
-    FORC(nc) {			/* denoise R,G1,B,G3 individually */
-        fimg = (float *) malloc(size * 3 * sizeof * fimg);
-        for (i = 0; i < size; i++)
-            fimg[i] = 256 * sqrt(image[i][c] /*<< scale*/);
-        for (hpass = lev = 0; lev < 5; lev++) {
-            progress(PROGRESS_WAVELET_DENOISE, 1);
-            lpass = size * ((lev & 1) + 1);
-            for (row = 0; row < iheight; row++) {
-                hat_transform(temp, fimg + hpass + row * iwidth, 1, iwidth, 1 << lev);
-                for (col = 0; col < iwidth; col++)
-                    fimg[lpass + row * iwidth + col] = temp[col] * 0.25;
-            }
-            for (col = 0; col < iwidth; col++) {
-                hat_transform(temp, fimg + lpass + col, iwidth, iheight, 1 << lev);
-                for (row = 0; row < iheight; row++)
-                    fimg[lpass + row * iwidth + col] = temp[row] * 0.25;
-            }
-            thold = threshold * noise[lev];
-            for (i = 0; i < size; i++) {
-                fimg[hpass + i] -= fimg[lpass + i];
-                if	(fimg[hpass + i] < -thold) fimg[hpass + i] += thold;
-                else if (fimg[hpass + i] >  thold) fimg[hpass + i] -= thold;
-                else	 fimg[hpass + i] = 0;
-                if (hpass) fimg[i] += fimg[hpass + i];
-            }
-            hpass = lpass;
+            for (i = 0; i < strips; i++)
+                wavelet_denoise_strip(image, out, fimg, temp, c, i * strip,
+                                      MIN((i + 1) * strip, iheight),
+                                      iheight, iwidth, threshold, simd);
+#ifdef _OPENMP
+            #pragma omp for
+#endif
+            for (i = 0; i < size; i++)
+                image[i][c] = out[i];
         }
-        for (i = 0; i < size; i++)
-            image[i][c] = CLIP(SQR(fimg[i] + fimg[lpass + i]) / 0x10000);
+        free(temp);
         free(fimg);
     }
+    free(out);
     if (filters && colors == 3) {  /* pull G1 and G3 closer together */
         for (row = 0; row < 2; row++)
             mul[row] = 0.125 * pre_mul[FC(row + 1, 0) | 1] / pre_mul[FC(row, 0) | 1];
@@ -276,16 +399,18 @@ void CLASS border_interpolate_INDI(const int height, const int width,
         }
 }
 
-void CLASS lin_interpolate_INDI(ushort(*image)[4], const unsigned filters,
-                                const int width, const int height, const int colors, void *dcraw, dcraw_data *h) /*UF*/
+/*
+ * Tables of lin_interpolate_row(). Besides the neighbours and weights,
+ * code[row][col][31] keeps the color of the pixel itself.
+ */
+static int lin_interpolate_code(int code[16][16][32], const unsigned filters,
+                                const int width, const int colors,
+                                dcraw_data *h)
 {
-    int code[16][16][32], size = 16, *ip, sum[4];
-    int f, c, i, x, y, row, col, shift, color;
-    ushort *pix;
+    int size = 16, *ip, sum[4];
+    int f, c, x, y, row, col, shift, color;
 
-    dcraw_message(dcraw, DCRAW_VERBOSE, _("Bilinear interpolation...\n")); /*UF*/
     if (filters == 9) size = 6;
-    border_interpolate_INDI(height, width, image, filters, colors, 1, h);
     for (row = 0; row < size; row++) {
         for (col = 0; col < size; col++) {
             ip = code[row][col] + 1;
@@ -307,24 +432,155 @@ void CLASS lin_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                 *ip++ = c;
                 *ip++ = 256 / sum[c];
             }
+            code[row][col][31] = f;
+        }
+    }
+    return size;
+}
+
+/*
+ * Interpolate the inner pixels of a row of image into out, which may be
+ * the same row of image. Only the sensor color of each pixel is read
+ * from image.
+ */
+static void lin_interpolate_row(ushort(*out)[4], ushort(*image)[4],
+                                int code[16][16][32], const int size,
+                                const int width, const int row,
+                                const int colors)
+{
+    int col, i, sum[4], *ip;
+    ushort *pix;
+
+    for (col = 1; col < width - 1; col++) {
+        pix = image[row * width + col];
+        ip = code[row % size][col % size];
+        memset(sum, 0, sizeof sum);
+        for (i = *ip++; i--; ip += 3)
+            sum[ip[2]] += pix[ip[0]] << ip[1];
+        for (i = colors; --i; ip += 2)
+            out[col][ip[0]] = sum[ip[0]] * ip[1] >> 8;
+        if (out != image + row * width) {
+            i = code[row % size][col % size][31];
+            out[col][i] = pix[i];
         }
     }
+}
+
+void CLASS lin_interpolate_INDI(ushort(*image)[4], const unsigned filters,
+                                const int width, const int height, const int colors, void *dcraw, dcraw_data *h) /*UF*/
+{
+    int code[16][16][32], size, row;
+
+    dcraw_message(dcraw, DCRAW_VERBOSE, _("Bilinear interpolation...\n")); /*UF*/
+    border_interpolate_INDI(height, width, image, filters, colors, 1, h);
+    size = lin_interpolate_code(code, filters, width, colors, h);
 #ifdef _OPENMP
-    #pragma omp parallel for default(shared) private(row,col,pix,ip,sum,i)
+    #pragma omp parallel for default(shared) private(row)
+#endif
+    for (row = 1; row < height - 1; row++)
+        lin_interpolate_row(image + row * width, image, code, size,
+                            width, row, colors);
+}
+
+/*
+ * Bilinear interpolation of two by two filter patterns for quick drafts.
+ * The pattern is fixed for a whole row, so each pair of pixels takes the
+ * same masks and shifts. The result is the same as lin_interpolate_INDI(),
+ * which is used for any other pattern, and when UFRAW_NO_SIMD is set in
+ * the environment.
+ */
+void CLASS draft_interpolate_INDI(ushort(*image)[4], const unsigned filters,
+                                  const int width, const int height,
+                                  const int colors, void *dcraw, dcraw_data *h)
+{
+#ifdef __SSE2__
+    /* Indexed by the parity of the row and of the first column of a pair */
+    ushort sensor[2][2][8], own[2][2][8];
+    unsigned wide[2][2][8];
+    int row, col, rp, cp, k, c, f, x, y, w;
+
+    if (colors != 3 || width < 4 || height < 3 ||
+            filters != (filters & 0xff) * 0x01010101 ||
+            g_getenv("UFRAW_NO_SIMD") != NULL)
+        goto fallback;
+    for (rp = 0; rp < 2; rp++)
+        for (cp = 0; cp < 2; cp++)
+            for (k = 0; k < 2; k++) {
+                f = FC(rp, cp + k);
+                FORC4 {
+                    sensor[rp][cp][k * 4 + c] = c == f ? 0xFFFF : 0;
+                    own[rp][cp][k * 4 + c] = c == f || c >= colors ? 0xFFFF : 0;
+                    /* Weight of the neighbours, orthogonal ones count twice */
+                    for (w = 0, y = -1; y <= 1; y++)
+                        for (x = -1; x <= 1; x++)
+                            if ((x || y) && FC(rp + y + 2, cp + k + x + 2) == c)
+                                w += 1 << ((y == 0) + (x == 0));
+                    if (!own[rp][cp][k * 4 + c] && w != 4 && w != 8)
+                        goto fallback;
+                    wide[rp][cp][k * 4 + c] = w == 8 ? 0xFFFFFFFF : 0;
+                }
+            }
+    dcraw_message(dcraw, DCRAW_VERBOSE, _("Bilinear interpolation...\n")); /*UF*/
+    border_interpolate_INDI(height, width, image, filters, colors, 1, h);
+#ifdef _OPENMP
+    #pragma omp parallel for default(shared) private(row,col,rp,cp)
 #endif
     for (row = 1; row < height - 1; row++) {
-        for (col = 1; col < width - 1; col++) {
-            pix = image[row * width + col];
-            ip = code[row % size][col % size];
-            memset(sum, 0, sizeof sum);
-            for (i = *ip++; i--; ip += 3)
-                sum[ip[2]] += pix[ip[0]] << ip[1];
-            for (i = colors; --i; ip += 2)
-                pix[ip[0]] = sum[ip[0]] * ip[1] >> 8;
+        rp = row & 1;
+        /* An odd number of inner columns ends with an overlapping pair */
+        for (col = 1; col < width - 1; col += 2) {
+            if (col == width - 2)
+                col = width - 3;
+            cp = col & 1;
+            ushort *pix = image[row * width + col];
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i mh = _mm_loadu_si128((__m128i *)sensor[rp][cp ^ 1]);
+            const __m128i mv = _mm_loadu_si128((__m128i *)sensor[rp ^ 1][cp]);
+            const __m128i md = _mm_loadu_si128((__m128i *)sensor[rp ^ 1][cp ^ 1]);
+            const __m128i mo = _mm_loadu_si128((__m128i *)own[rp][cp]);
+            const __m128i w0 = _mm_loadu_si128((__m128i *)wide[rp][cp]);
+            const __m128i w1 = _mm_loadu_si128((__m128i *)(wide[rp][cp] + 4));
+            __m128i v[8], orth[2], diag[2], sum[2];
+            v[0] = _mm_and_si128(mh, _mm_loadu_si128((__m128i *)(pix - 4)));
+            v[1] = _mm_and_si128(mh, _mm_loadu_si128((__m128i *)(pix + 4)));
+            v[2] = _mm_and_si128(mv, _mm_loadu_si128((__m128i *)(pix - 4 * width)));
+            v[3] = _mm_and_si128(mv, _mm_loadu_si128((__m128i *)(pix + 4 * width)));
+            v[4] = _mm_and_si128(md, _mm_loadu_si128((__m128i *)(pix - 4 * width - 4)));
+            v[5] = _mm_and_si128(md, _mm_loadu_si128((__m128i *)(pix - 4 * width + 4)));
+            v[6] = _mm_and_si128(md, _mm_loadu_si128((__m128i *)(pix + 4 * width - 4)));
+            v[7] = _mm_and_si128(md, _mm_loadu_si128((__m128i *)(pix + 4 * width + 4)));
+            orth[0] = orth[1] = diag[0] = diag[1] = zero;
+            for (k = 0; k < 4; k++) {
+                orth[0] = _mm_add_epi32(orth[0], _mm_unpacklo_epi16(v[k], zero));
+                orth[1] = _mm_add_epi32(orth[1], _mm_unpackhi_epi16(v[k], zero));
+                diag[0] = _mm_add_epi32(diag[0], _mm_unpacklo_epi16(v[k + 4], zero));
+                diag[1] = _mm_add_epi32(diag[1], _mm_unpackhi_epi16(v[k + 4], zero));
+            }
+            sum[0] = _mm_add_epi32(_mm_slli_epi32(orth[0], 1), diag[0]);
+            sum[1] = _mm_add_epi32(_mm_slli_epi32(orth[1], 1), diag[1]);
+            /* Divide by the weight of 4 or 8 */
+            sum[0] = _mm_or_si128(_mm_and_si128(w0, _mm_srli_epi32(sum[0], 3)),
+                                  _mm_andnot_si128(w0, _mm_srli_epi32(sum[0], 2)));
+            sum[1] = _mm_or_si128(_mm_and_si128(w1, _mm_srli_epi32(sum[1], 3)),
+                                  _mm_andnot_si128(w1, _mm_srli_epi32(sum[1], 2)));
+            /* There is no unsigned saturation of 32 bits in SSE2 */
+            const __m128i bias = _mm_set1_epi32(0x8000);
+            __m128i out = _mm_xor_si128(_mm_set1_epi16((short)0x8000),
+                                        _mm_packs_epi32(_mm_sub_epi32(sum[0], bias),
+                                                _mm_sub_epi32(sum[1], bias)));
+            out = _mm_or_si128(_mm_and_si128(mo, _mm_loadu_si128((__m128i *)pix)),
+                               _mm_andnot_si128(mo, out));
+            _mm_storeu_si128((__m128i *)pix, out);
         }
     }
+    return;
+fallback:
+#endif /* __SSE2__ */
+    lin_interpolate_INDI(image, filters, width, height, colors, dcraw, h);
 }
 
+#define VNG_CHUNK 16	/* Rows interpolated by a thread at a time */
+
 /*
    This algorithm is officially called:
 
@@ -362,15 +618,16 @@ void CLASS vng_interpolate_INDI(ushort(*image)[4], const unsigned filters,
         +1, -1, +1, +1, 0, 0x88, +1, +0, +1, +2, 0, 0x08, +1, +0, +2, -1, 0, 0x40,
         +1, +0, +2, +1, 0, 0x10
     }, chood[] = { -1, -1, -1, 0, -1, +1, 0, +1, +1, +1, +1, 0, +1, -1, 0, -1 };
-    ushort(*brow[4])[4], *pix;
+    ushort(*buf)[4], (*out)[4], *pix;
     int prow = 8, pcol = 2, *ip, *code[16][16], gval[8], gmin, gmax, sum[4];
     int row, col, x, y, x1, x2, y1, y2, t, weight, grads, color, diag;
     int g, diff, thold, num, c;
-    ushort rowtmp[4][width * 4];
+    int lin_code[16][16][32], lin_size, chunk, top, bottom;
 
-    lin_interpolate_INDI(image, filters, width, height, colors, dcraw, h); /*UF*/
     dcraw_message(dcraw, DCRAW_VERBOSE, _("VNG interpolation...\n")); /*UF*/
 
+    border_interpolate_INDI(height, width, image, filters, colors, 1, h);
+    lin_size = lin_interpolate_code(lin_code, filters, width, colors, h);
     if (filters == 1) prow = pcol = 16;
     if (filters == 9) prow = pcol =  6;
     int *ipalloc = ip = (int *) calloc(prow * pcol, 1280);
@@ -408,75 +665,209 @@ void CLASS vng_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                     *ip++ = 0;
             }
         }
+    /* The rows are handed out in chunks. Each chunk is first interpolated
+     * bilinearly into a buffer, together with two rows above and below it.
+     * VNG only writes the colors that the sensor did not measure, which
+     * the bilinear interpolation of the other chunks never reads. */
     progress(PROGRESS_INTERPOLATE, -height);
 #ifdef _OPENMP
     #pragma omp parallel				\
-    shared(image,code,prow,pcol,h)			\
-    private(row,col,g,brow,rowtmp,pix,ip,gval,diff,gmin,gmax,thold,sum,color,num,c,t)
+    default(shared)					\
+    private(chunk,top,bottom,row,col,g,buf,out,pix,ip,gval,diff,gmin,gmax,thold,sum,color,num,c,t)
 #endif
     {
-        int slice = (height - 4) / uf_omp_get_num_threads();
-        int start_row = 2 + slice * uf_omp_get_thread_num();
-        int end_row = MIN(start_row + slice, height - 2);
-        for (row = start_row; row < end_row; row++) { /* Do VNG interpolation */
-            progress(PROGRESS_INTERPOLATE, 1);
-            for (g = 0; g < 4; g++)
-                brow[g] = &rowtmp[(row + g - 2) % 4];
-            for (col = 2; col < width - 2; col++) {
-                pix = image[row * width + col];
-                ip = code[row % prow][col % pcol];
-                memset(gval, 0, sizeof gval);
-                while ((g = ip[0]) != INT_MAX) { /* Calculate gradients */
-                    diff = ABS(pix[g] - pix[ip[1]]) << ip[2];
-                    gval[ip[3]] += diff;
-                    ip += 5;
-                    if ((g = ip[-1]) == -1) continue;
-                    gval[g] += diff;
-                    while ((g = *ip++) != -1)
-                        gval[g] += diff;
-                }
-                ip++;
-                gmin = gmax = gval[0]; /* Choose a threshold */
-                for (g = 1; g < 8; g++) {
-                    if (gmin > gval[g]) gmin = gval[g];
-                    if (gmax < gval[g]) gmax = gval[g];
-                }
-                if (gmax == 0) {
-                    memcpy(brow[2][col], pix, sizeof * image);
+        buf = (ushort(*)[4]) calloc((VNG_CHUNK + 4) * width, sizeof * image);
+        merror(buf, "vng_interpolate()");
+#ifdef _OPENMP
+        #pragma omp for schedule(dynamic)
+#endif
+        for (chunk = 0; chunk < (height - 2 + VNG_CHUNK - 1) / VNG_CHUNK; chunk++) {
+            top = 1 + chunk * VNG_CHUNK;
+            bottom = MIN(top + VNG_CHUNK, height - 1);
+            for (row = top - 2; row < bottom + 2; row++) {
+                if (row < 0 || row >= height)
+                    continue;
+                out = buf + (row - top + 2) * width;
+                if (row == 0 || row == height - 1) {
+                    memcpy(out, image + row * width, width * sizeof * image);
                     continue;
                 }
-                thold = gmin + (gmax >> 1);
-                memset(sum, 0, sizeof sum);
-                color = fcol_INDI(filters, row, col, h->top_margin, h->left_margin, h->xtrans);
-                for (num = g = 0; g < 8; g++, ip += 2) { /* Average the neighbors */
-                    if (gval[g] <= thold) {
-                        FORCC
-                        if (c == color && ip[1])
-                            sum[c] += (pix[c] + pix[ip[1]]) >> 1;
-                        else
-                            sum[c] += pix[ip[0] + c];
-                        num++;
+                memcpy(out[0], image[row * width], sizeof * image);
+                memcpy(out[width - 1], image[row * width + width - 1], sizeof * image);
+                lin_interpolate_row(out, image, lin_code, lin_size, width, row, colors);
+            }
+            for (row = top; row < bottom; row++) {
+                progress(PROGRESS_INTERPOLATE, 1);
+                out = image + row * width;
+                for (col = 1; col < width - 1; col++) { /* Do VNG interpolation */
+                    pix = buf[(row - top + 2) * width + col];
+                    color = fcol_INDI(filters, row, col, h->top_margin, h->left_margin, h->xtrans);
+                    if (row == 1 || row == height - 2 || col == 1 || col == width - 2) {
+                        FORCC if (c != color) out[col][c] = pix[c];
+                        continue;
+                    }
+                    ip = code[row % prow][col % pcol];
+                    memset(gval, 0, sizeof gval);
+                    while ((g = ip[0]) != INT_MAX) { /* Calculate gradients */
+                        diff = ABS(pix[g] - pix[ip[1]]) << ip[2];
+                        gval[ip[3]] += diff;
+                        ip += 5;
+                        if ((g = ip[-1]) == -1) continue;
+                        gval[g] += diff;
+                        while ((g = *ip++) != -1)
+                            gval[g] += diff;
+                    }
+                    ip++;
+                    gmin = gmax = gval[0]; /* Choose a threshold */
+                    for (g = 1; g < 8; g++) {
+                        if (gmin > gval[g]) gmin = gval[g];
+                        if (gmax < gval[g]) gmax = gval[g];
+                    }
+                    if (gmax == 0) {
+                        FORCC if (c != color) out[col][c] = pix[c];
+                        continue;
+                    }
+                    thold = gmin + (gmax >> 1);
+                    memset(sum, 0, sizeof sum);
+                    for (num = g = 0; g < 8; g++, ip += 2) { /* Average the neighbors */
+                        if (gval[g] <= thold) {
+                            FORCC
+                            if (c == color && ip[1])
+                                sum[c] += (pix[c] + pix[ip[1]]) >> 1;
+                            else
+                                sum[c] += pix[ip[0] + c];
+                            num++;
+                        }
+                    }
+                    FORCC {				/* Save to image */
+                        if (c == color) continue;
+                        t = pix[color] + (sum[c] - sum[color]) / num;
+                        out[col][c] = CLIP(t);
                     }
-                }
-                FORCC {				/* Save to buffer */
-                    t = pix[color];
-                    if (c != color)
-                        t += (sum[c] - sum[color]) / num;
-                    brow[2][col][c] = CLIP(t);
                 }
             }
-            /* Write buffer to image */
-            if ((row > start_row + 1) || (row == height - 2))
-                memcpy(image[(row - 2)*width + 2], brow[0] + 2, (width - 4)*sizeof * image);
-            if (row == height - 2) {
-                memcpy(image[(row - 1)*width + 2], brow[1] + 2, (width - 4)*sizeof * image);
-                break;
-            }
         }
+        free(buf);
     }
     free(ipalloc);
 }
 
+#ifdef __SSE2__
+/*
+ * SSE2 helpers of the PPG interpolation, which works on every other pixel
+ * of a row. A vector holds one channel of four such pixels as 32 bits
+ * integers, so that the results are those of the scalar code.
+ */
+#define PPG_LOAD4(p, ch) \
+    _mm_setr_epi32((p)[0][ch], (p)[2][ch], (p)[4][ch], (p)[6][ch])
+
+static inline __m128i ppg_abs(__m128i a)
+{
+    __m128i s = _mm_srai_epi32(a, 31);
+    return _mm_sub_epi32(_mm_xor_si128(a, s), s);
+}
+
+/* mask ? a : b */
+static inline __m128i ppg_select(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+/* LIM(x, lo, hi) */
+static inline __m128i ppg_lim(__m128i x, __m128i lo, __m128i hi)
+{
+    x = ppg_select(_mm_cmpgt_epi32(x, hi), hi, x);
+    return ppg_select(_mm_cmplt_epi32(x, lo), lo, x);
+}
+
+static inline void ppg_store4(ushort(*p)[4], const int ch, __m128i v)
+{
+    int out[4];
+    _mm_storeu_si128((__m128i *)out, v);
+    p[0][ch] = out[0];
+    p[2][ch] = out[1];
+    p[4][ch] = out[2];
+    p[6][ch] = out[3];
+}
+
+/* Green of four pixels of color c */
+static void ppg_green_sse2(ushort(*pix)[4], const int width, const int c)
+{
+    const int dir[2] = { 1, width };
+    __m128i guess[2], diff[2], lo[2], hi[2], m;
+    int i, d;
+
+    for (i = 0; i < 2; i++) {
+        d = dir[i];
+        __m128i gm = PPG_LOAD4(pix - d, 1), gp = PPG_LOAD4(pix + d, 1);
+        __m128i c0 = PPG_LOAD4(pix, c);
+        __m128i cm = PPG_LOAD4(pix - 2 * d, c), cp = PPG_LOAD4(pix + 2 * d, c);
+        __m128i t;
+        guess[i] = _mm_sub_epi32(_mm_sub_epi32(
+                                     _mm_slli_epi32(_mm_add_epi32(_mm_add_epi32(gm, c0), gp), 1),
+                                     cm), cp);
+        t = _mm_add_epi32(_mm_add_epi32(ppg_abs(_mm_sub_epi32(cm, c0)),
+                                        ppg_abs(_mm_sub_epi32(cp, c0))),
+                          ppg_abs(_mm_sub_epi32(gm, gp)));
+        diff[i] = _mm_add_epi32(t, _mm_slli_epi32(t, 1));
+        t = _mm_add_epi32(ppg_abs(_mm_sub_epi32(PPG_LOAD4(pix + 3 * d, 1), gp)),
+                          ppg_abs(_mm_sub_epi32(PPG_LOAD4(pix - 3 * d, 1), gm)));
+        diff[i] = _mm_add_epi32(diff[i], _mm_slli_epi32(t, 1));
+        m = _mm_cmplt_epi32(gp, gm);
+        lo[i] = ppg_select(m, gp, gm);
+        hi[i] = ppg_select(m, gm, gp);
+    }
+    m = _mm_cmpgt_epi32(diff[0], diff[1]);
+    ppg_store4(pix, 1, ppg_lim(_mm_srai_epi32(ppg_select(m, guess[1], guess[0]), 2),
+                               ppg_select(m, lo[1], lo[0]),
+                               ppg_select(m, hi[1], hi[0])));
+}
+
+/* Red and blue of four green pixels, c is the color of the left neighbour */
+static void ppg_green_rb_sse2(ushort(*pix)[4], const int width, int c)
+{
+    const __m128i zero = _mm_setzero_si128(), max = _mm_set1_epi32(65535);
+    const __m128i g0 = _mm_slli_epi32(PPG_LOAD4(pix, 1), 1);
+    const int dir[2] = { 1, width };
+    int i, d;
+
+    for (i = 0; i < 2; c = 2 - c, i++) {
+        d = dir[i];
+        __m128i v = _mm_add_epi32(_mm_add_epi32(PPG_LOAD4(pix - d, c),
+                                                PPG_LOAD4(pix + d, c)), g0);
+        v = _mm_sub_epi32(_mm_sub_epi32(v, PPG_LOAD4(pix - d, 1)),
+                          PPG_LOAD4(pix + d, 1));
+        ppg_store4(pix, c, ppg_lim(_mm_srai_epi32(v, 1), zero, max));
+    }
+}
+
+/* Color c of four pixels of color 2 - c */
+static void ppg_cross_sse2(ushort(*pix)[4], const int width, const int c)
+{
+    const __m128i zero = _mm_setzero_si128(), max = _mm_set1_epi32(65535);
+    const __m128i g0 = PPG_LOAD4(pix, 1);
+    const int dir[2] = { width + 1, width - 1 };
+    __m128i guess[2], diff[2], v;
+    int i, d;
+
+    for (i = 0; i < 2; i++) {
+        d = dir[i];
+        __m128i cm = PPG_LOAD4(pix - d, c), cp = PPG_LOAD4(pix + d, c);
+        __m128i gm = PPG_LOAD4(pix - d, 1), gp = PPG_LOAD4(pix + d, 1);
+        diff[i] = _mm_add_epi32(_mm_add_epi32(ppg_abs(_mm_sub_epi32(cm, cp)),
+                                              ppg_abs(_mm_sub_epi32(gm, g0))),
+                                ppg_abs(_mm_sub_epi32(gp, g0)));
+        guess[i] = _mm_add_epi32(_mm_add_epi32(cm, cp), _mm_slli_epi32(g0, 1));
+        guess[i] = _mm_sub_epi32(_mm_sub_epi32(guess[i], gm), gp);
+    }
+    v = _mm_srai_epi32(ppg_select(_mm_cmpgt_epi32(diff[0], diff[1]),
+                                  guess[1], guess[0]), 1);
+    v = ppg_select(_mm_cmpeq_epi32(diff[0], diff[1]),
+                   _mm_srai_epi32(_mm_add_epi32(guess[0], guess[1]), 2), v);
+    ppg_store4(pix, c, ppg_lim(v, zero, max));
+}
+#endif /* __SSE2__ */
+
 /*
    Patterned Pixel Grouping Interpolation by Alain Desbiolles
 */
@@ -485,16 +876,19 @@ void CLASS ppg_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                                 const int colors, void *dcraw, dcraw_data *h)
 {
     int dir[5] = { 1, width, -1, -width, 1 };
-    int row, col, diff[2] = { 0, 0 }, guess[2], c, d, i;
+    int row, col, diff[2], guess[2], c, d, i;
     ushort(*pix)[4];
+#ifdef __SSE2__
+    const int simd = g_getenv("UFRAW_NO_SIMD") == NULL;
+#endif
 
     border_interpolate_INDI(height, width, image, filters, colors, 3, h);
     dcraw_message(dcraw, DCRAW_VERBOSE, _("PPG interpolation...\n")); /*UF*/
 
 #ifdef _OPENMP
     #pragma omp parallel				\
-    shared(image,dir,diff)				\
-    private(row,col,i,d,c,pix,guess)
+    shared(image,dir)					\
+    private(row,col,i,d,c,pix,guess,diff)
 #endif
     {
         /*  Fill in the green layer with gradients and pattern recognition: */
@@ -502,7 +896,13 @@ void CLASS ppg_interpolate_INDI(ushort(*image)[4], const unsigned filters,
         #pragma omp for
 #endif
         for (row = 3; row < height - 3; row++) {
-            for (col = 3 + (FC(row, 3) & 1), c = FC(row, col); col < width - 3; col += 2) {
+            col = 3 + (FC(row, 3) & 1);
+            c = FC(row, col);
+#ifdef __SSE2__
+            for (; simd && col + 6 < width - 3; col += 8)
+                ppg_green_sse2(image + row * width + col, width, c);
+#endif
+            for (; col < width - 3; col += 2) {
                 pix = image + row * width + col;
                 for (i = 0; (d = dir[i]) > 0; i++) {
                     guess[i] = (pix[-d][1] + pix[0][c] + pix[d][1]) * 2
@@ -522,7 +922,13 @@ void CLASS ppg_interpolate_INDI(ushort(*image)[4], const unsigned filters,
         #pragma omp for
 #endif
         for (row = 1; row < height - 1; row++) {
-            for (col = 1 + (FC(row, 2) & 1), c = FC(row, col + 1); col < width - 1; col += 2) {
+            col = 1 + (FC(row, 2) & 1);
+#ifdef __SSE2__
+            for (; simd && col + 6 < width - 1; col += 8)
+                ppg_green_rb_sse2(image + row * width + col, width,
+                                  FC(row, col + 1));
+#endif
+            for (c = FC(row, col + 1); col < width - 1; col += 2) {
                 pix = image + row * width + col;
                 for (i = 0; (d = dir[i]) > 0; c = 2 - c, i++)
                     pix[0][c] = CLIP((pix[-d][c] + pix[d][c] + 2 * pix[0][1]
@@ -534,7 +940,13 @@ void CLASS ppg_interpolate_INDI(ushort(*image)[4], const unsigned filters,
         #pragma omp for
 #endif
         for (row = 1; row < height - 1; row++) {
-            for (col = 1 + (FC(row, 1) & 1), c = 2 - FC(row, col); col < width - 1; col += 2) {
+            col = 1 + (FC(row, 1) & 1);
+            c = 2 - FC(row, col);
+#ifdef __SSE2__
+            for (; simd && col + 6 < width - 1; col += 8)
+                ppg_cross_sse2(image + row * width + col, width, c);
+#endif
+            for (; col < width - 1; col += 2) {
                 pix = image + row * width + col;
                 for (i = 0; (d = dir[i] + dir[i + 1]) > 0; i++) {
                     diff[i] = ABS(pix[-d][c] - pix[d][c]) +
@@ -552,39 +964,629 @@ void CLASS ppg_interpolate_INDI(ushort(*image)[4], const unsigned filters,
     }
 }
 
-void CLASS cielab_INDI(ushort rgb[3], short lab[3], const int colors,
-                       const float rgb_cam[3][4])
+static float cielab_cbrt[0x10000];
+
+static gpointer cielab_cbrt_init(gpointer data)
 {
-    int c, i, j, k;
-    float r, xyz[3];
-    static float cbrt[0x10000], xyz_cam[3][4];
-
-    if (!rgb) {
-        for (i = 0; i < 0x10000; i++) {
-            r = i / 65535.0;
-            cbrt[i] = r > 0.008856 ? pow(r, (float)(1 / 3.0)) : 7.787 * r + 16 / 116.0;
-        }
-        for (i = 0; i < 3; i++)
-            for (j = 0; j < colors; j++)
-                for (xyz_cam[i][j] = k = 0; k < 3; k++)
-                    xyz_cam[i][j] += xyz_rgb[i][k] * rgb_cam[k][j] / d65_white[i];
-        return;
+    int i;
+    float r;
+
+    (void)data;
+    for (i = 0; i < 0x10000; i++) {
+        r = i / 65535.0;
+        cielab_cbrt[i] = r > 0.008856 ? pow(r, (float)(1 / 3.0)) : 7.787 * r + 16 / 116.0;
     }
+    return NULL;
+}
+
+/* The cube root table is shared and filled once, the camera to XYZ matrix
+ * belongs to the caller, so that several images can be converted at once. */
+static void cielab_init_INDI(float xyz_cam[3][4], const int colors,
+                             const float rgb_cam[3][4])
+{
+    static GOnce cbrt_once = G_ONCE_INIT;
+    int i, j, k;
+
+    g_once(&cbrt_once, cielab_cbrt_init, NULL);
+    for (i = 0; i < 3; i++)
+        for (j = 0; j < colors; j++)
+            for (xyz_cam[i][j] = k = 0; k < 3; k++)
+                xyz_cam[i][j] += xyz_rgb[i][k] * rgb_cam[k][j] / d65_white[i];
+}
+
+void CLASS cielab_INDI(ushort rgb[3], short lab[3], const int colors,
+                       /*const*/ float xyz_cam[3][4])
+{
+    int c;
+    float xyz[3];
+
     xyz[0] = xyz[1] = xyz[2] = 0.5;
     FORCC {
         xyz[0] += xyz_cam[0][c] * rgb[c];
         xyz[1] += xyz_cam[1][c] * rgb[c];
         xyz[2] += xyz_cam[2][c] * rgb[c];
     }
-    xyz[0] = cbrt[CLIP((int) xyz[0])];
-    xyz[1] = cbrt[CLIP((int) xyz[1])];
-    xyz[2] = cbrt[CLIP((int) xyz[2])];
+    xyz[0] = cielab_cbrt[CLIP((int) xyz[0])];
+    xyz[1] = cielab_cbrt[CLIP((int) xyz[1])];
+    xyz[2] = cielab_cbrt[CLIP((int) xyz[2])];
     lab[0] = 64 * (116 * xyz[1] - 16);
     lab[1] = 64 * 500 * (xyz[0] - xyz[1]);
     lab[2] = 64 * 200 * (xyz[1] - xyz[2]);
 }
 
-#define TS 512		/* Tile Size */
+#define TS 512		/* Largest tile size, and row stride of the tile buffers */
+
+/*
+ * Tile sizes of the AHD and X-Trans interpolations. A tile is made as
+ * large as its share of the L2 cache allows. UFRAW_TILE_SIZE=n forces a
+ * size of n, and UFRAW_TILE_SIZE=tune times each candidate size on the
+ * first images and keeps the fastest one. Tuning is only done for AHD,
+ * whose output does not depend on the tile size. X-Trans tiles read back
+ * pixels of the tile before them, so they keep the cache based size.
+ */
+typedef struct {
+    int size;		/* 0 until chosen, -1 while tuning */
+    int next;		/* Candidate being timed */
+    int best_size;
+    double best;	/* Seconds per pixel of best_size */
+} tile_tuner;
+
+static const int tile_candidates[] = { 128, 192, 256, 320, 384, 448, 512 };
+#define TILE_CANDIDATES (int)(sizeof tile_candidates / sizeof *tile_candidates)
+
+G_LOCK_DEFINE_STATIC(tile_tuner);
+
+static int tile_size_INDI(tile_tuner *tuner, const int pixel_bytes,
+                          const int overlap, const int tunable)
+{
+    const char *env;
+    long cache = 0;
+    int ts;
+
+    G_LOCK(tile_tuner);
+    if (tuner->size == 0) {
+        env = g_getenv("UFRAW_TILE_SIZE");
+        if (env != NULL && strcmp(env, "tune") == 0 && tunable) {
+            tuner->size = -1;
+        } else if (env != NULL && atoi(env) > 0) {
+            tuner->size = LIM(atoi(env), 4 * overlap, TS);
+        } else {
+#ifdef _SC_LEVEL2_CACHE_SIZE
+            cache = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+            if (cache <= 0)
+                cache = 1 << 20;
+            /* Small tiles would redo too much of their overlap */
+            ts = (int)sqrt(cache / pixel_bytes) & ~15;
+            tuner->size = LIM(ts, MAX(128, 16 * overlap), TS);
+        }
+    }
+    ts = tuner->size > 0 ? tuner->size : tile_candidates[tuner->next];
+    G_UNLOCK(tile_tuner);
+    return ts;
+}
+
+static void tile_time_INDI(tile_tuner *tuner, const int ts,
+                           const double seconds, const int pixels)
+{
+    double t = seconds / MAX(pixels, 1);
+
+    G_LOCK(tile_tuner);
+    if (tuner->size < 0 && ts == tile_candidates[tuner->next]) {
+        if (tuner->next == 0 || t < tuner->best) {
+            tuner->best = t;
+            tuner->best_size = ts;
+        }
+        if (++tuner->next == TILE_CANDIDATES)
+            tuner->size = tuner->best_size;
+    }
+    G_UNLOCK(tile_tuner);
+}
+
+/*
+ * The scratch buffers of the tiles take several megabytes per thread.
+ * They are kept for the next interpolation instead of being freed, up to
+ * one buffer for each thread of the team, until scratch_release_INDI().
+ */
+G_LOCK_DEFINE_STATIC(scratch_pool);
+static GSList *scratch_pool = NULL;
+
+#define SCRATCH_HEADER 16	/* Keeps the size and the malloc() alignment */
+
+static char *scratch_get_INDI(const size_t size, char *where)
+{
+    char *buffer = NULL;
+
+    G_LOCK(scratch_pool);
+    if (scratch_pool != NULL) {
+        buffer = scratch_pool->data;
+        scratch_pool = g_slist_delete_link(scratch_pool, scratch_pool);
+    }
+    G_UNLOCK(scratch_pool);
+    if (buffer != NULL && *(size_t *)buffer < size) {
+        free(buffer);
+        buffer = NULL;
+    }
+    if (buffer == NULL) {
+        buffer = (char *) malloc(SCRATCH_HEADER + size);
+        merror(buffer, where);
+        *(size_t *)buffer = size;
+    }
+    return buffer + SCRATCH_HEADER;
+}
+
+static void scratch_put_INDI(char *buffer)
+{
+    buffer -= SCRATCH_HEADER;
+    G_LOCK(scratch_pool);
+    if ((int)g_slist_length(scratch_pool) < uf_omp_get_num_threads()) {
+        scratch_pool = g_slist_prepend(scratch_pool, buffer);
+        buffer = NULL;
+    }
+    G_UNLOCK(scratch_pool);
+    free(buffer);
+}
+
+void CLASS scratch_release_INDI()
+{
+    G_LOCK(scratch_pool);
+    while (scratch_pool != NULL) {
+        free(scratch_pool->data);
+        scratch_pool = g_slist_delete_link(scratch_pool, scratch_pool);
+    }
+    G_UNLOCK(scratch_pool);
+}
+
+/*
+ * Row kernels of the AHD and X-Trans interpolations. The SSE4.1 and AVX2
+ * versions are selected at run time by the CPU features and give the same
+ * results as the scalar ones: the integer maths wraps the same way and the
+ * floating point operations are done in the same order, without fused
+ * multiply-add. Pixels that do not fill a whole vector are left to the
+ * scalar kernels.
+ */
+
+/* Interpolate green horizontally and vertically at every other pixel */
+static void ahd_green_row(ushort(*pix)[4], const int width, const int c,
+                          ushort(*rix0)[3], ushort(*rix1)[3], int count)
+{
+    int val;
+    for (; count > 0; count--, pix += 2, rix0 += 2, rix1 += 2) {
+        val = ((pix[-1][1] + pix[0][c] + pix[1][1]) * 2
+               - pix[-2][c] - pix[2][c]) >> 2;
+        rix0[0][1] = ULIM(val, pix[-1][1], pix[1][1]);
+        val = ((pix[-width][1] + pix[0][c] + pix[width][1]) * 2
+               - pix[-2 * width][c] - pix[2 * width][c]) >> 2;
+        rix1[0][1] = ULIM(val, pix[-width][1], pix[width][1]);
+    }
+}
+
+static void cielab_row(ushort(*rix)[3], short(*lix)[3], int count,
+                           const int colors, float xyz_cam[3][4])
+{
+    for (; count > 0; count--, rix++, lix++)
+        cielab_INDI(rix[0], lix[0], colors, xyz_cam);
+}
+
+/* Count the neighbours of each pixel that are as homogenous as the
+ * closest ones in the Lab images of both directions */
+static void ahd_homogeneity_row(short(*lix0)[3], short(*lix1)[3],
+                                char *homo0, char *homo1, int count)
+{
+    static const int dir[4] = { -1, 1, -TS, TS };
+    unsigned ldiff[2][4], abdiff[2][4], leps, abeps;
+    short(*lix)[3];
+    int d, i;
+
+    for (; count > 0; count--, lix0++, lix1++, homo0++, homo1++) {
+        for (d = 0; d < 2; d++) {
+            lix = d ? lix1 : lix0;
+            for (i = 0; i < 4; i++) {
+                ldiff[d][i] = ABS(lix[0][0] - lix[dir[i]][0]);
+                abdiff[d][i] = SQR(lix[0][1] - lix[dir[i]][1])
+                               + SQR(lix[0][2] - lix[dir[i]][2]);
+            }
+        }
+        leps = MIN(MAX(ldiff[0][0], ldiff[0][1]),
+                   MAX(ldiff[1][2], ldiff[1][3]));
+        abeps = MIN(MAX(abdiff[0][0], abdiff[0][1]),
+                    MAX(abdiff[1][2], abdiff[1][3]));
+        for (d = 0; d < 2; d++)
+            for (i = 0; i < 4; i++)
+                if (ldiff[d][i] <= leps && abdiff[d][i] <= abeps)
+                    (d ? homo1 : homo0)[0]++;
+    }
+}
+
+/* Count the neighbours of each pixel whose derivative in a direction is
+ * within eight times the smallest derivative of the pixel. The planes of
+ * drv and homo are TS * TS apart. */
+static void xtrans_homogeneity_row(const float *drv, char *homo,
+                                   const int ndir, int count)
+{
+    float tr;
+    int d, v, h;
+
+    for (; count > 0; count--, drv++, homo++) {
+        for (tr = FLT_MAX, d = 0; d < ndir; d++)
+            if (tr > drv[d * TS * TS])
+                tr = drv[d * TS * TS];
+        tr *= 8;
+        for (d = 0; d < ndir; d++)
+            for (v = -1; v <= 1; v++)
+                for (h = -1; h <= 1; h++)
+                    if (drv[d * TS * TS + v * TS + h] <= tr)
+                        homo[d * TS * TS]++;
+    }
+}
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(UFRAW_NO_SIMD)
+#define TILE_SIMD
+#include <immintrin.h>
+
+/* Load the ushort at p[0], p[step], p[2 * step] and p[3 * step] */
+#define AHD_LOAD4(p, step) \
+    _mm_setr_epi32((p)[0], (p)[step], (p)[2 * (step)], (p)[3 * (step)])
+
+__attribute__((target("sse4.1")))
+static void ahd_green_row_sse41(ushort(*pix)[4], const int width,
+                                const int c, ushort(*rix0)[3],
+                                ushort(*rix1)[3], int count)
+{
+    const ushort *p = pix[0];
+    const int w = 4 * width;
+    int k;
+    for (; count >= 4; count -= 4, p += 32, rix0 += 8, rix1 += 8) {
+        __m128i center = AHD_LOAD4(p + c, 8);
+        __m128i lo = AHD_LOAD4(p - 4 + 1, 8), hi = AHD_LOAD4(p + 4 + 1, 8);
+        __m128i val = _mm_sub_epi32(_mm_slli_epi32(
+                                        _mm_add_epi32(_mm_add_epi32(lo, center), hi), 1),
+                                    _mm_add_epi32(AHD_LOAD4(p - 8 + c, 8),
+                                                  AHD_LOAD4(p + 8 + c, 8)));
+        val = _mm_srai_epi32(val, 2);
+        __m128i h = _mm_max_epi32(_mm_min_epi32(val, _mm_max_epi32(lo, hi)),
+                                  _mm_min_epi32(lo, hi));
+        lo = AHD_LOAD4(p - w + 1, 8);
+        hi = AHD_LOAD4(p + w + 1, 8);
+        val = _mm_sub_epi32(_mm_slli_epi32(
+                                _mm_add_epi32(_mm_add_epi32(lo, center), hi), 1),
+                            _mm_add_epi32(AHD_LOAD4(p - 2 * w + c, 8),
+                                          AHD_LOAD4(p + 2 * w + c, 8)));
+        val = _mm_srai_epi32(val, 2);
+        __m128i v = _mm_max_epi32(_mm_min_epi32(val, _mm_max_epi32(lo, hi)),
+                                  _mm_min_epi32(lo, hi));
+        int out[2][4];
+        _mm_storeu_si128((__m128i *)out[0], h);
+        _mm_storeu_si128((__m128i *)out[1], v);
+        for (k = 0; k < 4; k++) {
+            rix0[2 * k][1] = out[0][k];
+            rix1[2 * k][1] = out[1][k];
+        }
+    }
+    ahd_green_row((ushort(*)[4])p, width, c, rix0, rix1, count);
+}
+
+__attribute__((target("sse4.1")))
+static void cielab_row_sse41(ushort(*rix)[3], short(*lix)[3], int count,
+                                 const int colors, float xyz_cam[3][4])
+{
+    const __m128i zero = _mm_setzero_si128(), max = _mm_set1_epi32(65535);
+    __m128 xyz[3];
+    int i, k;
+    for (; count >= 4; count -= 4, rix += 4, lix += 4) {
+        const ushort *p = rix[0];
+        __m128 rgb[3] = {
+            _mm_cvtepi32_ps(AHD_LOAD4(p, 3)),
+            _mm_cvtepi32_ps(AHD_LOAD4(p + 1, 3)),
+            _mm_cvtepi32_ps(AHD_LOAD4(p + 2, 3))
+        };
+        for (i = 0; i < 3; i++) {
+            xyz[i] = _mm_set1_ps(0.5);
+            xyz[i] = _mm_add_ps(xyz[i], _mm_mul_ps(_mm_set1_ps(xyz_cam[i][0]), rgb[0]));
+            xyz[i] = _mm_add_ps(xyz[i], _mm_mul_ps(_mm_set1_ps(xyz_cam[i][1]), rgb[1]));
+            xyz[i] = _mm_add_ps(xyz[i], _mm_mul_ps(_mm_set1_ps(xyz_cam[i][2]), rgb[2]));
+            int idx[4];
+            _mm_storeu_si128((__m128i *)idx, _mm_min_epi32(_mm_max_epi32(
+                                 _mm_cvttps_epi32(xyz[i]), zero), max));
+            xyz[i] = _mm_setr_ps(cielab_cbrt[idx[0]], cielab_cbrt[idx[1]],
+                                 cielab_cbrt[idx[2]], cielab_cbrt[idx[3]]);
+        }
+        int lab[3][4];
+        _mm_storeu_si128((__m128i *)lab[0], _mm_cvttps_epi32(_mm_mul_ps(
+                             _mm_set1_ps(64), _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(116), xyz[1]),
+                                     _mm_set1_ps(16)))));
+        _mm_storeu_si128((__m128i *)lab[1], _mm_cvttps_epi32(_mm_mul_ps(
+                             _mm_set1_ps(64 * 500), _mm_sub_ps(xyz[0], xyz[1]))));
+        _mm_storeu_si128((__m128i *)lab[2], _mm_cvttps_epi32(_mm_mul_ps(
+                             _mm_set1_ps(64 * 200), _mm_sub_ps(xyz[1], xyz[2]))));
+        for (k = 0; k < 4; k++) {
+            lix[k][0] = lab[0][k];
+            lix[k][1] = lab[1][k];
+            lix[k][2] = lab[2][k];
+        }
+    }
+    cielab_row(rix, lix, count, colors, xyz_cam);
+}
+
+/* Sign extend the short at p[0], p[3], p[6] and p[9] */
+#define AHD_LOAD_LAB4(p) \
+    _mm_setr_epi32((p)[0], (p)[3], (p)[6], (p)[9])
+
+/* a <= b for unsigned 32 bit lanes */
+#define AHD_LE_EPU32(a, b) _mm_cmpeq_epi32(_mm_max_epu32(a, b), b)
+
+__attribute__((target("sse4.1")))
+static void ahd_homogeneity_row_sse41(short(*lix0)[3], short(*lix1)[3],
+                                      char *homo0, char *homo1, int count)
+{
+    static const int dir[4] = { -1, 1, -TS, TS };
+    __m128i ldiff[2][4], abdiff[2][4], leps, abeps, homo[2];
+    int d, i, k;
+    for (; count >= 4; count -= 4, lix0 += 4, lix1 += 4, homo0 += 4, homo1 += 4) {
+        for (d = 0; d < 2; d++) {
+            const short *p = (d ? lix1 : lix0)[0];
+            __m128i l = AHD_LOAD_LAB4(p), a = AHD_LOAD_LAB4(p + 1),
+                    b = AHD_LOAD_LAB4(p + 2);
+            for (i = 0; i < 4; i++) {
+                const short *q = p + 3 * dir[i];
+                __m128i da = _mm_sub_epi32(a, AHD_LOAD_LAB4(q + 1));
+                __m128i db = _mm_sub_epi32(b, AHD_LOAD_LAB4(q + 2));
+                ldiff[d][i] = _mm_abs_epi32(_mm_sub_epi32(l, AHD_LOAD_LAB4(q)));
+                abdiff[d][i] = _mm_add_epi32(_mm_mullo_epi32(da, da),
+                                             _mm_mullo_epi32(db, db));
+            }
+        }
+        leps = _mm_min_epu32(_mm_max_epu32(ldiff[0][0], ldiff[0][1]),
+                             _mm_max_epu32(ldiff[1][2], ldiff[1][3]));
+        abeps = _mm_min_epu32(_mm_max_epu32(abdiff[0][0], abdiff[0][1]),
+                              _mm_max_epu32(abdiff[1][2], abdiff[1][3]));
+        for (d = 0; d < 2; d++) {
+            homo[d] = _mm_setzero_si128();
+            for (i = 0; i < 4; i++)
+                homo[d] = _mm_sub_epi32(homo[d], _mm_and_si128(
+                                            AHD_LE_EPU32(ldiff[d][i], leps),
+                                            AHD_LE_EPU32(abdiff[d][i], abeps)));
+        }
+        int out[2][4];
+        _mm_storeu_si128((__m128i *)out[0], homo[0]);
+        _mm_storeu_si128((__m128i *)out[1], homo[1]);
+        for (k = 0; k < 4; k++) {
+            homo0[k] += out[0][k];
+            homo1[k] += out[1][k];
+        }
+    }
+    ahd_homogeneity_row(lix0, lix1, homo0, homo1, count);
+}
+
+__attribute__((target("sse4.1")))
+static void xtrans_homogeneity_row_sse41(const float *drv, char *homo,
+        const int ndir, int count)
+{
+    __m128 tr;
+    __m128i hm;
+    int d, v, h, k, out[4];
+
+    for (; count >= 4; count -= 4, drv += 4, homo += 4) {
+        tr = _mm_set1_ps(FLT_MAX);
+        for (d = 0; d < ndir; d++)
+            tr = _mm_min_ps(_mm_loadu_ps(drv + d * TS * TS), tr);
+        tr = _mm_mul_ps(tr, _mm_set1_ps(8));
+        for (d = 0; d < ndir; d++) {
+            hm = _mm_setzero_si128();
+            for (v = -1; v <= 1; v++)
+                for (h = -1; h <= 1; h++)
+                    hm = _mm_sub_epi32(hm, _mm_castps_si128(_mm_cmple_ps(
+                                           _mm_loadu_ps(drv + d * TS * TS + v * TS + h), tr)));
+            _mm_storeu_si128((__m128i *)out, hm);
+            for (k = 0; k < 4; k++)
+                homo[d * TS * TS + k] += out[k];
+        }
+    }
+    xtrans_homogeneity_row(drv, homo, ndir, count);
+}
+
+/* Gather the 16 bit values at p[idx] into 32 bit lanes. The gathers read
+ * two bytes past each value, which the callers keep inside their buffers. */
+#define AHD_GATHER_U16(p, idx) _mm256_and_si256(_mm256_set1_epi32(0xFFFF), \
+        _mm256_i32gather_epi32((const int *)(const void *)(p), idx, 2))
+#define AHD_GATHER_S16(p, idx) _mm256_srai_epi32(_mm256_slli_epi32( \
+        _mm256_i32gather_epi32((const int *)(const void *)(p), idx, 2), 16), 16)
+
+__attribute__((target("avx2")))
+static void ahd_green_row_avx2(ushort(*pix)[4], const int width,
+                               const int c, ushort(*rix0)[3],
+                               ushort(*rix1)[3], int count)
+{
+    const ushort *p = pix[0];
+    const int w = 4 * width;
+    const __m256i idx = _mm256_setr_epi32(0, 8, 16, 24, 32, 40, 48, 56);
+    int k;
+    for (; count >= 8; count -= 8, p += 64, rix0 += 16, rix1 += 16) {
+        __m256i center = AHD_GATHER_U16(p + c, idx);
+        __m256i lo = AHD_GATHER_U16(p - 4 + 1, idx);
+        __m256i hi = AHD_GATHER_U16(p + 4 + 1, idx);
+        __m256i val = _mm256_sub_epi32(_mm256_slli_epi32(_mm256_add_epi32(
+                                           _mm256_add_epi32(lo, center), hi), 1),
+                                       _mm256_add_epi32(AHD_GATHER_U16(p - 8 + c, idx),
+                                               AHD_GATHER_U16(p + 8 + c, idx)));
+        val = _mm256_srai_epi32(val, 2);
+        __m256i h = _mm256_max_epi32(_mm256_min_epi32(val, _mm256_max_epi32(lo, hi)),
+                                     _mm256_min_epi32(lo, hi));
+        lo = AHD_GATHER_U16(p - w + 1, idx);
+        hi = AHD_GATHER_U16(p + w + 1, idx);
+        val = _mm256_sub_epi32(_mm256_slli_epi32(_mm256_add_epi32(
+                                   _mm256_add_epi32(lo, center), hi), 1),
+                               _mm256_add_epi32(AHD_GATHER_U16(p - 2 * w + c, idx),
+                                       AHD_GATHER_U16(p + 2 * w + c, idx)));
+        val = _mm256_srai_epi32(val, 2);
+        __m256i v = _mm256_max_epi32(_mm256_min_epi32(val, _mm256_max_epi32(lo, hi)),
+                                     _mm256_min_epi32(lo, hi));
+        int out[2][8];
+        _mm256_storeu_si256((__m256i *)out[0], h);
+        _mm256_storeu_si256((__m256i *)out[1], v);
+        for (k = 0; k < 8; k++) {
+            rix0[2 * k][1] = out[0][k];
+            rix1[2 * k][1] = out[1][k];
+        }
+    }
+    ahd_green_row((ushort(*)[4])p, width, c, rix0, rix1, count);
+}
+
+__attribute__((target("avx2")))
+static void cielab_row_avx2(ushort(*rix)[3], short(*lix)[3], int count,
+                                const int colors, float xyz_cam[3][4])
+{
+    const __m256i zero = _mm256_setzero_si256(), max = _mm256_set1_epi32(65535);
+    const __m256i idx = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+    __m256 xyz[3];
+    int i, k;
+    for (; count >= 8; count -= 8, rix += 8, lix += 8) {
+        const ushort *p = rix[0];
+        __m256 rgb[3] = {
+            _mm256_cvtepi32_ps(AHD_GATHER_U16(p, idx)),
+            _mm256_cvtepi32_ps(AHD_GATHER_U16(p + 1, idx)),
+            _mm256_cvtepi32_ps(AHD_GATHER_U16(p + 2, idx))
+        };
+        for (i = 0; i < 3; i++) {
+            xyz[i] = _mm256_set1_ps(0.5);
+            xyz[i] = _mm256_add_ps(xyz[i], _mm256_mul_ps(_mm256_set1_ps(xyz_cam[i][0]), rgb[0]));
+            xyz[i] = _mm256_add_ps(xyz[i], _mm256_mul_ps(_mm256_set1_ps(xyz_cam[i][1]), rgb[1]));
+            xyz[i] = _mm256_add_ps(xyz[i], _mm256_mul_ps(_mm256_set1_ps(xyz_cam[i][2]), rgb[2]));
+            xyz[i] = _mm256_i32gather_ps(cielab_cbrt, _mm256_min_epi32(_mm256_max_epi32(
+                                             _mm256_cvttps_epi32(xyz[i]), zero), max), 4);
+        }
+        int lab[3][8];
+        _mm256_storeu_si256((__m256i *)lab[0], _mm256_cvttps_epi32(_mm256_mul_ps(
+                                _mm256_set1_ps(64), _mm256_sub_ps(_mm256_mul_ps(
+                                        _mm256_set1_ps(116), xyz[1]), _mm256_set1_ps(16)))));
+        _mm256_storeu_si256((__m256i *)lab[1], _mm256_cvttps_epi32(_mm256_mul_ps(
+                                _mm256_set1_ps(64 * 500), _mm256_sub_ps(xyz[0], xyz[1]))));
+        _mm256_storeu_si256((__m256i *)lab[2], _mm256_cvttps_epi32(_mm256_mul_ps(
+                                _mm256_set1_ps(64 * 200), _mm256_sub_ps(xyz[1], xyz[2]))));
+        for (k = 0; k < 8; k++) {
+            lix[k][0] = lab[0][k];
+            lix[k][1] = lab[1][k];
+            lix[k][2] = lab[2][k];
+        }
+    }
+    cielab_row(rix, lix, count, colors, xyz_cam);
+}
+
+/* a <= b for unsigned 32 bit lanes */
+#define AHD_LE_EPU32_256(a, b) _mm256_cmpeq_epi32(_mm256_max_epu32(a, b), b)
+
+__attribute__((target("avx2")))
+static void ahd_homogeneity_row_avx2(short(*lix0)[3], short(*lix1)[3],
+                                     char *homo0, char *homo1, int count)
+{
+    static const int dir[4] = { -1, 1, -TS, TS };
+    const __m256i idx = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+    __m256i ldiff[2][4], abdiff[2][4], leps, abeps, homo[2];
+    int d, i, k;
+    for (; count >= 8; count -= 8, lix0 += 8, lix1 += 8, homo0 += 8, homo1 += 8) {
+        for (d = 0; d < 2; d++) {
+            const short *p = (d ? lix1 : lix0)[0];
+            __m256i l = AHD_GATHER_S16(p, idx), a = AHD_GATHER_S16(p + 1, idx),
+                    b = AHD_GATHER_S16(p + 2, idx);
+            for (i = 0; i < 4; i++) {
+                const short *q = p + 3 * dir[i];
+                __m256i da = _mm256_sub_epi32(a, AHD_GATHER_S16(q + 1, idx));
+                __m256i db = _mm256_sub_epi32(b, AHD_GATHER_S16(q + 2, idx));
+                ldiff[d][i] = _mm256_abs_epi32(_mm256_sub_epi32(l,
+                                               AHD_GATHER_S16(q, idx)));
+                abdiff[d][i] = _mm256_add_epi32(_mm256_mullo_epi32(da, da),
+                                                _mm256_mullo_epi32(db, db));
+            }
+        }
+        leps = _mm256_min_epu32(_mm256_max_epu32(ldiff[0][0], ldiff[0][1]),
+                                _mm256_max_epu32(ldiff[1][2], ldiff[1][3]));
+        abeps = _mm256_min_epu32(_mm256_max_epu32(abdiff[0][0], abdiff[0][1]),
+                                 _mm256_max_epu32(abdiff[1][2], abdiff[1][3]));
+        for (d = 0; d < 2; d++) {
+            homo[d] = _mm256_setzero_si256();
+            for (i = 0; i < 4; i++)
+                homo[d] = _mm256_sub_epi32(homo[d], _mm256_and_si256(
+                                               AHD_LE_EPU32_256(ldiff[d][i], leps),
+                                               AHD_LE_EPU32_256(abdiff[d][i], abeps)));
+        }
+        int out[2][8];
+        _mm256_storeu_si256((__m256i *)out[0], homo[0]);
+        _mm256_storeu_si256((__m256i *)out[1], homo[1]);
+        for (k = 0; k < 8; k++) {
+            homo0[k] += out[0][k];
+            homo1[k] += out[1][k];
+        }
+    }
+    ahd_homogeneity_row(lix0, lix1, homo0, homo1, count);
+}
+__attribute__((target("avx2")))
+static void xtrans_homogeneity_row_avx2(const float *drv, char *homo,
+                                        const int ndir, int count)
+{
+    __m256 tr;
+    __m256i hm;
+    int d, v, h, k, out[8];
+
+    for (; count >= 8; count -= 8, drv += 8, homo += 8) {
+        tr = _mm256_set1_ps(FLT_MAX);
+        for (d = 0; d < ndir; d++)
+            tr = _mm256_min_ps(_mm256_loadu_ps(drv + d * TS * TS), tr);
+        tr = _mm256_mul_ps(tr, _mm256_set1_ps(8));
+        for (d = 0; d < ndir; d++) {
+            hm = _mm256_setzero_si256();
+            for (v = -1; v <= 1; v++)
+                for (h = -1; h <= 1; h++)
+                    hm = _mm256_sub_epi32(hm, _mm256_castps_si256(_mm256_cmp_ps(
+                                              _mm256_loadu_ps(drv + d * TS * TS + v * TS + h),
+                                              tr, _CMP_LE_OQ)));
+            _mm256_storeu_si256((__m256i *)out, hm);
+            for (k = 0; k < 8; k++)
+                homo[d * TS * TS + k] += out[k];
+        }
+    }
+    xtrans_homogeneity_row(drv, homo, ndir, count);
+}
+#endif /* __x86_64__ */
+
+typedef struct {
+    void (*green_row)(ushort(*pix)[4], const int width, const int c,
+                      ushort(*rix0)[3], ushort(*rix1)[3], int count);
+    void (*cielab_row)(ushort(*rix)[3], short(*lix)[3], int count,
+                       const int colors, float xyz_cam[3][4]);
+    void (*homogeneity_row)(short(*lix0)[3], short(*lix1)[3],
+                            char *homo0, char *homo1, int count);
+    void (*xtrans_homogeneity_row)(const float *drv, char *homo,
+                                   const int ndir, int count);
+} tile_kernels;
+
+static void tile_kernels_init(tile_kernels *k, const int colors)
+{
+    k->green_row = ahd_green_row;
+    k->cielab_row = cielab_row;
+    k->homogeneity_row = ahd_homogeneity_row;
+    k->xtrans_homogeneity_row = xtrans_homogeneity_row;
+#ifdef TILE_SIMD
+    /* The vector Lab conversion assumes three colors. UFRAW_NO_SIMD in
+     * the environment keeps the plain C kernels. */
+    if (colors != 3 || g_getenv("UFRAW_NO_SIMD") != NULL)
+        return;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        k->green_row = ahd_green_row_avx2;
+        k->cielab_row = cielab_row_avx2;
+        k->homogeneity_row = ahd_homogeneity_row_avx2;
+        k->xtrans_homogeneity_row = xtrans_homogeneity_row_avx2;
+    } else if (__builtin_cpu_supports("sse4.1")) {
+        k->green_row = ahd_green_row_sse41;
+        k->cielab_row = cielab_row_sse41;
+        k->homogeneity_row = ahd_homogeneity_row_sse41;
+        k->xtrans_homogeneity_row = xtrans_homogeneity_row_sse41;
+    }
+#else
+    (void)colors;
+#endif
+}
+
 /*
    Frank Markesteijn's algorithm for Fuji X-Trans sensors
  */
@@ -604,13 +1606,21 @@ void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
     ushort min, max, sgrow = 0, sgcol = 0;
     ushort(*rgb)[TS][TS][3], (*rix)[3], (*pix)[4];
     short(*lab)    [TS][3], (*lix)[3];
-    float(*drv)[TS][TS], diff[6], tr;
+    float(*drv)[TS][TS], diff[6];
     char(*homo)[TS][TS], *buffer;
+    float xyz_cam[3][4];
+    static tile_tuner tuner;
+    tile_kernels kernels;
+    GTimer *timer;
+    int ts;
 
     dcraw_message(dcraw, DCRAW_VERBOSE, _("%d-pass X-Trans interpolation...\n"), passes); /*NKBJ*/
 
-    cielab_INDI(0, 0, colors, rgb_cam);
+    cielab_init_INDI(xyz_cam, colors, rgb_cam);
+    tile_kernels_init(&kernels, colors);
     ndir = 4 << (passes > 1);
+    ts = tile_size_INDI(&tuner, ndir * 11 + 6, 16, FALSE);
+    timer = g_timer_new();
 
     /* Map a green hexagon around each non-green pixel and vice versa:      */
     for (row = 0; row < 3; row++)
@@ -660,11 +1670,10 @@ void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
 #ifdef _OPENMP
     #pragma omp parallel				\
     default(shared)					\
-    private(top, left, row, col, pix, mrow, mcol, hex, color, c, pass, rix, val, d, f, g, h, i, diff, lix, tr, avg, v, buffer, rgb, lab, drv, homo, hm, max)
+    private(top, left, row, col, pix, mrow, mcol, hex, color, c, pass, rix, val, d, f, g, h, i, diff, lix, avg, v, buffer, rgb, lab, drv, homo, hm, max)
 #endif
     {
-        buffer = (char *) malloc(TS * TS * (ndir * 11 + 6));
-        merror(buffer, "xtrans_interpolate()");
+        buffer = scratch_get_INDI(TS * TS * (ndir * 11 + 6), "xtrans_interpolate()");
         rgb  = (ushort(*)[TS][TS][3]) buffer;
         lab  = (short(*)    [TS][3])(buffer + TS * TS * (ndir * 6));
         drv  = (float(*)[TS][TS])(buffer + TS * TS * (ndir * 6 + 6));
@@ -676,15 +1685,15 @@ void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
         #pragma omp for
 #endif
 
-        for (top = 3; top < height - 19; top += TS - 16) {
-            progress(PROGRESS_INTERPOLATE, TS - 16);
-            for (left = 3; left < width - 19; left += TS - 16) {
-                mrow = MIN(top + TS, height - 3);
-                mcol = MIN(left + TS, width - 3);
+        for (top = 3; top < height - 19; top += ts - 16) {
+            progress(PROGRESS_INTERPOLATE, ts - 16);
+            for (left = 3; left < width - 19; left += ts - 16) {
+                mrow = MIN(top + ts, height - 3);
+                mcol = MIN(left + ts, width - 3);
                 for (row = top; row < mrow; row++)
                     for (col = left; col < mcol; col++)
                         memcpy(rgb[0][row - top][col - left], image[row * width + col], 6);
-                FORC3 memcpy(rgb[c + 1], rgb[0], sizeof * rgb);
+                FORC3 memcpy(rgb[c + 1], rgb[0], ts * sizeof **rgb);
 
                 /* Interpolate green horizontally, vertically, and along both diagonals: */
                 for (row = top; row < mrow; row++)
@@ -705,7 +1714,8 @@ void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
 
                 for (pass = 0; pass < passes; pass++) {
                     if (pass == 1)
-                        memcpy(rgb += 4, buffer, 4 * sizeof * rgb);
+                        for (rgb += 4, d = 0; d < 4; d++)
+                            memcpy(rgb[d], rgb[d - 4], ts * sizeof **rgb);
 
                     /* Recalculate green from interpolated values of closer pixels: */
                     if (pass) {
@@ -786,9 +1796,9 @@ void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
 
                 /* Convert to CIELab and differentiate in all directions:       */
                 for (d = 0; d < ndir; d++) {
-                    for (row = 2; row < mrow - 2; row++)
-                        for (col = 2; col < mcol - 2; col++)
-                            cielab_INDI(rgb[d][row][col], lab[row][col], colors, rgb_cam);
+                    for (row = 2; row < mrow - 2 && mcol > 4; row++)
+                        kernels.cielab_row(&rgb[d][row][2], &lab[row][2],
+                                           mcol - 4, colors, xyz_cam);
                     for (f = dir[d & 3], row = 3; row < mrow - 3; row++)
                         for (col = 3; col < mcol - 3; col++) {
                             lix = &lab[row][col];
@@ -800,23 +1810,15 @@ void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                 }
 
                 /* Build homogeneity maps from the derivatives:                 */
-                memset(homo, 0, ndir * TS * TS);
-                for (row = 4; row < mrow - 4; row++)
-                    for (col = 4; col < mcol - 4; col++) {
-                        for (tr = FLT_MAX, d = 0; d < ndir; d++)
-                            if (tr > drv[d][row][col])
-                                tr = drv[d][row][col];
-                        tr *= 8;
-                        for (d = 0; d < ndir; d++)
-                            for (v = -1; v <= 1; v++)
-                                for (h = -1; h <= 1; h++)
-                                    if (drv[d][row + v][col + h] <= tr)
-                                        homo[d][row][col]++;
-                    }
+                for (d = 0; d < ndir; d++)
+                    memset(homo[d], 0, ts * sizeof **homo);
+                for (row = 4; row < mrow - 4 && mcol > 8; row++)
+                    kernels.xtrans_homogeneity_row(&drv[0][row][4], &homo[0][row][4],
+                                                   ndir, mcol - 8);
 
                 /* Average the most homogenous pixels for the final result:     */
-                if (height - top < TS + 4) mrow = height - top + 2;
-                if (width - left < TS + 4) mcol = width - left + 2;
+                if (height - top < ts + 4) mrow = height - top + 2;
+                if (width - left < ts + 4) mcol = width - left + 2;
                 for (row = MIN(top, 8); row < mrow - 8; row++)
                     for (col = MIN(left, 8); col < mcol - 8; col++) {
                         for (d = 0; d < ndir; d++)
@@ -839,8 +1841,10 @@ void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                     }
             }
         }
-        free(buffer);
+        scratch_put_INDI(buffer);
     } /* _OPENMP */
+    tile_time_INDI(&tuner, ts, g_timer_elapsed(timer, NULL), width * height);
+    g_timer_destroy(timer);
     border_interpolate_INDI(height, width, image, filters, colors, 8, hh);
 }
 
@@ -854,24 +1858,30 @@ void CLASS ahd_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                                 void *dcraw, dcraw_data *h)
 {
     int i, j, top, left, row, col, tr, tc, c, d, val, hm[2];
-    static const int dir[4] = { -1, 1, -TS, TS };
-    unsigned ldiff[2][4], abdiff[2][4], leps, abeps;
     ushort(*rgb)[TS][TS][3], (*rix)[3], (*pix)[4];
-    short(*lab)[TS][TS][3], (*lix)[3];
+    short(*lab)[TS][TS][3];
     char(*homo)[TS][TS], *buffer;
+    float xyz_cam[3][4];
+    tile_kernels kernels;
+    static tile_tuner tuner;
+    GTimer *timer;
+    int ts;
 
     dcraw_message(dcraw, DCRAW_VERBOSE, _("AHD interpolation...\n")); /*UF*/
 
+    cielab_init_INDI(xyz_cam, colors, rgb_cam);
+    tile_kernels_init(&kernels, colors);
+    ts = tile_size_INDI(&tuner, 26, 6, TRUE);
+    timer = g_timer_new();
+
 #ifdef _OPENMP
     #pragma omp parallel				\
     default(shared)					\
-    private(top, left, row, col, pix, rix, lix, c, val, d, tc, tr, i, j, ldiff, abdiff, leps, abeps, hm, buffer, rgb, lab, homo)
+    private(top, left, row, col, pix, rix, c, val, d, tc, tr, i, j, hm, buffer, rgb, lab, homo)
 #endif
     {
-        cielab_INDI(0, 0, colors, rgb_cam);
         border_interpolate_INDI(height, width, image, filters, colors, 5, h);
-        buffer = (char *) malloc(26 * TS * TS);
-        merror(buffer, "ahd_interpolate()");
+        buffer = scratch_get_INDI(26 * TS * TS, "ahd_interpolate()");
         rgb  = (ushort(*)[TS][TS][3]) buffer;
         lab  = (short(*)[TS][TS][3])(buffer + 12 * TS * TS);
         homo = (char(*)[TS][TS])(buffer + 24 * TS * TS);
@@ -880,30 +1890,27 @@ void CLASS ahd_interpolate_INDI(ushort(*image)[4], const unsigned filters,
 #ifdef _OPENMP
         #pragma omp for
 #endif
-        for (top = 2; top < height - 5; top += TS - 6) {
-            progress(PROGRESS_INTERPOLATE, TS - 6);
-            for (left = 2; left < width - 5; left += TS - 6) {
+        for (top = 2; top < height - 5; top += ts - 6) {
+            progress(PROGRESS_INTERPOLATE, ts - 6);
+            for (left = 2; left < width - 5; left += ts - 6) {
 
                 /*  Interpolate green horizontally and vertically: */
-                for (row = top; row < top + TS && row < height - 2; row++) {
+                for (row = top; row < top + ts && row < height - 2; row++) {
                     col = left + (FC(row, left) & 1);
-                    for (c = FC(row, col); col < left + TS && col < width - 2; col += 2) {
-                        pix = image + row * width + col;
-                        val = ((pix[-1][1] + pix[0][c] + pix[1][1]) * 2
-                               - pix[-2][c] - pix[2][c]) >> 2;
-                        rgb[0][row - top][col - left][1] = ULIM(val, pix[-1][1], pix[1][1]);
-                        val = ((pix[-width][1] + pix[0][c] + pix[width][1]) * 2
-                               - pix[-2 * width][c] - pix[2 * width][c]) >> 2;
-                        rgb[1][row - top][col - left][1] = ULIM(val, pix[-width][1], pix[width][1]);
-                    }
+                    c = FC(row, col);
+                    tc = MIN(left + ts, width - 2);
+                    if (col < tc)
+                        kernels.green_row(image + row * width + col, width, c,
+                                          &rgb[0][row - top][col - left],
+                                          &rgb[1][row - top][col - left],
+                                          (tc - col + 1) / 2);
                 }
                 /*  Interpolate red and blue, and convert to CIELab: */
                 for (d = 0; d < 2; d++)
-                    for (row = top + 1; row < top + TS - 1 && row < height - 3; row++)
-                        for (col = left + 1; col < left + TS - 1 && col < width - 3; col++) {
+                    for (row = top + 1; row < top + ts - 1 && row < height - 3; row++) {
+                        for (col = left + 1; col < left + ts - 1 && col < width - 3; col++) {
                             pix = image + row * width + col;
                             rix = &rgb[d][row - top][col - left];
-                            lix = &lab[d][row - top][col - left];
                             if ((c = 2 - FC(row, col)) == 1) {
                                 c = FC(row + 1, col);
                                 val = pix[0][1] + ((pix[-1][2 - c] + pix[1][2 - c]
@@ -919,36 +1926,28 @@ void CLASS ahd_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                             rix[0][c] = CLIP(val);
                             c = FC(row, col);
                             rix[0][c] = pix[0][c];
-                            cielab_INDI(rix[0], lix[0], colors, rgb_cam);
                         }
+                        /* Red and blue only depend on green, so each row
+                         * can be converted once it is complete. */
+                        tr = row - top;
+                        if (col > left + 1)
+                            kernels.cielab_row(&rgb[d][tr][1], &lab[d][tr][1],
+                                               col - left - 1, colors, xyz_cam);
+                    }
                 /*  Build homogeneity maps from the CIELab images: */
-                memset(homo, 0, 2 * TS * TS);
-                for (row = top + 2; row < top + TS - 2 && row < height - 4; row++) {
+                FORC(2) memset(homo[c], 0, ts * sizeof **homo);
+                for (row = top + 2; row < top + ts - 2 && row < height - 4; row++) {
                     tr = row - top;
-                    for (col = left + 2; col < left + TS - 2 && col < width - 4; col++) {
-                        tc = col - left;
-                        for (d = 0; d < 2; d++) {
-                            lix = &lab[d][tr][tc];
-                            for (i = 0; i < 4; i++) {
-                                ldiff[d][i] = ABS(lix[0][0] - lix[dir[i]][0]);
-                                abdiff[d][i] = SQR(lix[0][1] - lix[dir[i]][1])
-                                               + SQR(lix[0][2] - lix[dir[i]][2]);
-                            }
-                        }
-                        leps = MIN(MAX(ldiff[0][0], ldiff[0][1]),
-                                   MAX(ldiff[1][2], ldiff[1][3]));
-                        abeps = MIN(MAX(abdiff[0][0], abdiff[0][1]),
-                                    MAX(abdiff[1][2], abdiff[1][3]));
-                        for (d = 0; d < 2; d++)
-                            for (i = 0; i < 4; i++)
-                                if (ldiff[d][i] <= leps && abdiff[d][i] <= abeps)
-                                    homo[d][tr][tc]++;
-                    }
+                    tc = MIN(left + ts - 2, width - 4) - left;
+                    if (tc > 2)
+                        kernels.homogeneity_row(&lab[0][tr][2], &lab[1][tr][2],
+                                                &homo[0][tr][2], &homo[1][tr][2],
+                                                tc - 2);
                 }
                 /*  Combine the most homogenous pixels for the final result: */
-                for (row = top + 3; row < top + TS - 3 && row < height - 5; row++) {
+                for (row = top + 3; row < top + ts - 3 && row < height - 5; row++) {
                     tr = row - top;
-                    for (col = left + 3; col < left + TS - 3 && col < width - 5; col++) {
+                    for (col = left + 3; col < left + ts - 3 && col < width - 5; col++) {
                         tc = col - left;
                         for (d = 0; d < 2; d++)
                             for (hm[d] = 0, i = tr - 1; i <= tr + 1; i++)
@@ -963,8 +1962,10 @@ void CLASS ahd_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                 }
             }
         }
-        free(buffer);
+        scratch_put_INDI(buffer);
     } /* _OPENMP */
+    tile_time_INDI(&tuner, ts, g_timer_elapsed(timer, NULL), width * height);
+    g_timer_destroy(timer);
 }
 #undef TS
 
@@ -1010,6 +2011,132 @@ static inline int median9(int *p)
 #undef PIX_SWAP
 #undef PIX_SORT
 
+/* Median filter of the R-G (color 0) or B-G (color 2) differences over
+ * count pixels of a row, added back to G. up, mid and down hold the
+ * differences of the row above, of this row and of the row below before
+ * this pass, aligned with pix, so the result does not depend on the order
+ * of the pixels.
+ *
+ * To perform the filter on green, it would need to be the average
+ * (median(G-R)+median(G-B)+R+B)/2 */
+static void color_smooth_row(ushort(*pix)[4], const int *up, const int *mid,
+                             const int *down, const int color, int count)
+{
+    int pArray[9];
+    int result;
+
+    for (; count > 0; count--, pix++, up++, mid++, down++) {
+        pArray[0] = mid[1];
+        pArray[1] = up[1];
+        pArray[2] = up[0];
+        pArray[3] = up[-1];
+        pArray[4] = mid[-1];
+        pArray[5] = down[-1];
+        pArray[6] = down[0];
+        pArray[7] = down[1];
+        pArray[8] = mid[0];
+        median9(pArray);
+        result = pArray[4] + pix[0][1];
+        pix[0][color] = DTOP(result);
+    }
+}
+
+#ifdef TILE_SIMD
+/* The sorting network of median9(), for vectors of differences */
+#define MEDIAN9_NETWORK(SORT, p) { \
+    SORT(p[1], p[2]) SORT(p[4], p[5]) SORT(p[7], p[8]) \
+    SORT(p[0], p[1]) SORT(p[3], p[4]) SORT(p[6], p[7]) \
+    SORT(p[1], p[2]) SORT(p[4], p[5]) SORT(p[7], p[8]) \
+    SORT(p[0], p[3]) SORT(p[5], p[8]) SORT(p[4], p[7]) \
+    SORT(p[3], p[6]) SORT(p[1], p[4]) SORT(p[2], p[5]) \
+    SORT(p[4], p[7]) SORT(p[4], p[2]) SORT(p[6], p[4]) \
+    SORT(p[4], p[2]) }
+
+#define SMOOTH_SORT_SSE41(a, b) \
+    { __m128i t = _mm_min_epi32(a, b); b = _mm_max_epi32(a, b); a = t; }
+#define SMOOTH_SORT_AVX2(a, b) \
+    { __m256i t = _mm256_min_epi32(a, b); b = _mm256_max_epi32(a, b); a = t; }
+
+__attribute__((target("sse4.1")))
+static void color_smooth_row_sse41(ushort(*pix)[4], const int *up,
+                                   const int *mid, const int *down,
+                                   const int color, int count)
+{
+    ushort out[8];
+    int k;
+    for (; count >= 4; count -= 4, pix += 4, up += 4, mid += 4,
+            down += 4) {
+        __m128i p[9];
+        p[0] = _mm_loadu_si128((const __m128i *)(mid + 1));
+        p[1] = _mm_loadu_si128((const __m128i *)(up + 1));
+        p[2] = _mm_loadu_si128((const __m128i *)up);
+        p[3] = _mm_loadu_si128((const __m128i *)(up - 1));
+        p[4] = _mm_loadu_si128((const __m128i *)(mid - 1));
+        p[5] = _mm_loadu_si128((const __m128i *)(down - 1));
+        p[6] = _mm_loadu_si128((const __m128i *)down);
+        p[7] = _mm_loadu_si128((const __m128i *)(down + 1));
+        p[8] = _mm_loadu_si128((const __m128i *)mid);
+        MEDIAN9_NETWORK(SMOOTH_SORT_SSE41, p);
+        /* packus saturates to 0..65535 like DTOP() */
+        _mm_storeu_si128((__m128i *)out, _mm_packus_epi32(
+                             _mm_add_epi32(p[4], AHD_LOAD4(pix[0] + 1, 4)),
+                             _mm_setzero_si128()));
+        for (k = 0; k < 4; k++)
+            pix[k][color] = out[k];
+    }
+    color_smooth_row(pix, up, mid, down, color, count);
+}
+
+__attribute__((target("avx2")))
+static void color_smooth_row_avx2(ushort(*pix)[4], const int *up,
+                                  const int *mid, const int *down,
+                                  const int color, int count)
+{
+    ushort out[16];
+    int k;
+    for (; count >= 8; count -= 8, pix += 8, up += 8, mid += 8,
+            down += 8) {
+        __m256i p[9];
+        p[0] = _mm256_loadu_si256((const __m256i *)(mid + 1));
+        p[1] = _mm256_loadu_si256((const __m256i *)(up + 1));
+        p[2] = _mm256_loadu_si256((const __m256i *)up);
+        p[3] = _mm256_loadu_si256((const __m256i *)(up - 1));
+        p[4] = _mm256_loadu_si256((const __m256i *)(mid - 1));
+        p[5] = _mm256_loadu_si256((const __m256i *)(down - 1));
+        p[6] = _mm256_loadu_si256((const __m256i *)down);
+        p[7] = _mm256_loadu_si256((const __m256i *)(down + 1));
+        p[8] = _mm256_loadu_si256((const __m256i *)mid);
+        MEDIAN9_NETWORK(SMOOTH_SORT_AVX2, p);
+        __m256i g = _mm256_setr_epi32(pix[0][1], pix[1][1], pix[2][1],
+                                      pix[3][1], pix[4][1], pix[5][1],
+                                      pix[6][1], pix[7][1]);
+        /* packus works within 128 bit lanes, out is 0-3, x, 4-7, x */
+        _mm256_storeu_si256((__m256i *)out, _mm256_packus_epi32(
+                                _mm256_add_epi32(p[4], g),
+                                _mm256_setzero_si256()));
+        for (k = 0; k < 4; k++) {
+            pix[k][color] = out[k];
+            pix[k + 4][color] = out[k + 8];
+        }
+    }
+    color_smooth_row(pix, up, mid, down, color, count);
+}
+
+#undef SMOOTH_SORT_AVX2
+#undef SMOOTH_SORT_SSE41
+#undef MEDIAN9_NETWORK
+#endif /* TILE_SIMD */
+
+/* The R-G and B-G differences of a row, width apart in diff */
+static void color_smooth_diff(ushort(*pix)[4], int *diff, const int width)
+{
+    int i;
+    for (i = 0; i < width; i++) {
+        diff[i] = pix[i][0] - pix[i][1];
+        diff[width + i] = pix[i][2] - pix[i][1];
+    }
+}
+
 // Just making this function inline speeds up ahd_interpolate_INDI() up to 15%
 static inline ushort eahd_median(int row, int col, int color,
                                  ushort(*image)[4], const int width)
@@ -1043,8 +2170,13 @@ static inline ushort eahd_median(int row, int col, int color,
 
 // Add the color smoothing from Kimmel as suggested in the AHD paper
 // Algorithm updated by Michael Goertz
+//
+// In place, each median sees the neighbours above it already smoothed,
+// and under OpenMP the result depends on how the rows are shared. When
+// buffered, each pass reads the differences of the image before it, so
+// the result is the same in any order and for any number of threads.
 void CLASS color_smooth(ushort(*image)[4], const int width, const int height,
-                        const int passes)
+                        const int passes, const int buffered)
 {
     int row, col;
     int row_start = 2;
@@ -1053,23 +2185,90 @@ void CLASS color_smooth(ushort(*image)[4], const int width, const int height,
     int col_stop  = width - 2;
     //interate through all the colors
     int count;
-
     ushort *mpix;
+    void (*smooth_row)(ushort(*pix)[4], const int *up, const int *mid,
+                       const int *down, const int color, int count) =
+                           color_smooth_row;
 
-    for (count = 0; count < passes; count++) {
-        //perform 3 iterations - seems to be a commonly settled upon number of iterations
+    if (!buffered) {
+        for (count = 0; count < passes; count++) {
+            //perform 3 iterations - seems to be a commonly settled upon number of iterations
+#ifdef _OPENMP
+            #pragma omp parallel for default(shared) private(row,col,mpix)
+#endif
+            for (row = row_start; row < row_stop; row++) {
+                for (col = col_start; col < col_stop; col++) {
+                    //calculate the median only over the red and blue
+                    //calculating over green seems to offer very little additional quality
+                    mpix = image[row * width + col];
+                    mpix[0] = eahd_median(row, col, 0, image, width);
+                    mpix[2] = eahd_median(row, col, 2, image, width);
+                }
+            }
+        }
+        return;
+    }
+#ifdef TILE_SIMD
+    if (g_getenv("UFRAW_NO_SIMD") == NULL) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            smooth_row = color_smooth_row_avx2;
+        else if (__builtin_cpu_supports("sse4.1"))
+            smooth_row = color_smooth_row_sse41;
+    }
+#endif
+    if (col_stop <= col_start) return;
+    /* Each thread smooths a block of rows. It keeps the differences of the
+     * last three rows in a ring, and those of the rows next to its block,
+     * which other threads change, are taken before any row is smoothed. */
 #ifdef _OPENMP
-        #pragma omp parallel for default(shared) private(row,col,mpix)
+    #pragma omp parallel default(shared) private(row,count)
 #endif
-        for (row = row_start; row < row_stop; row++) {
-            for (col = col_start; col < col_stop; col++) {
+    {
+        const int threads = uf_omp_get_num_threads();
+        const int thread = uf_omp_get_thread_num();
+        const int first = row_start + (row_stop - row_start) * thread / threads;
+        const int last = row_start + (row_stop - row_start) * (thread + 1) / threads;
+        int *ring[3], *above, *below, *up, *mid, *down;
+        int *buffer = (int *) malloc(5 * 2 * width * sizeof * buffer);
+        merror(buffer, "color_smooth()");
+        for (row = 0; row < 3; row++)
+            ring[row] = buffer + 2 * width * row;
+        above = buffer + 2 * width * 3;
+        below = buffer + 2 * width * 4;
+        for (count = 0; count < passes; count++) {
+            if (first < last) {
+                color_smooth_diff(image + (first - 1) * width, above, width);
+                color_smooth_diff(image + last * width, below, width);
+            }
+#ifdef _OPENMP
+            #pragma omp barrier
+#endif
+            for (row = first; row < last; row++) {
+                up = row == first ? above : ring[(row - 1) % 3];
+                mid = ring[row % 3];
+                if (row == first)
+                    color_smooth_diff(image + row * width, mid, width);
+                if (row + 1 == last) {
+                    down = below;
+                } else {
+                    down = ring[(row + 1) % 3];
+                    color_smooth_diff(image + (row + 1) * width, down, width);
+                }
                 //calculate the median only over the red and blue
                 //calculating over green seems to offer very little additional quality
-                mpix = image[row * width + col];
-                mpix[0] = eahd_median(row, col, 0, image, width);
-                mpix[2] = eahd_median(row, col, 2, image, width);
+                smooth_row(image + row * width + col_start, up + col_start,
+                           mid + col_start, down + col_start, 0,
+                           col_stop - col_start);
+                smooth_row(image + row * width + col_start,
+                           up + width + col_start, mid + width + col_start,
+                           down + width + col_start, 2, col_stop - col_start);
             }
+#ifdef _OPENMP
+            #pragma omp barrier
+#endif
         }
+        free(buffer);
     }
 }
 
@@ -1120,49 +2319,141 @@ void CLASS fuji_rotate_INDI(ushort(**image_p)[4], int *height_p,
     *image_p = image;
 }
 
+#define FLIP_BLOCK 32	/* Pixels on the side of a transpose block */
+
+/* Copy or swap a pixel of up to 8 bytes. The constant sizes let the
+ * compiler turn the memcpy() into plain moves. */
+static inline void flip_copy_pixel(guint8 *dst, const guint8 *src,
+                                   const int depth)
+{
+    switch (depth) {
+        case 8:
+            memcpy(dst, src, 8);
+            break;
+        case 6:
+            memcpy(dst, src, 6);
+            break;
+        case 4:
+            memcpy(dst, src, 4);
+            break;
+        default:
+            memcpy(dst, src, depth);
+    }
+}
+
+static inline void flip_swap_pixel(guint8 *a, guint8 *b, const int depth)
+{
+    guint8 hold[8];
+    flip_copy_pixel(hold, a, depth);
+    flip_copy_pixel(a, b, depth);
+    flip_copy_pixel(b, hold, depth);
+}
+
+/* Horizontal and vertical flips, in place, swapping whole rows */
+static void flip_rows(guint8 *buffer, const int depth, const int height,
+                      const int width, const int flip)
+{
+    const int rowstride = width * depth;
+    const int rows = flip & 2 ? (height + 1) / 2 : height;
+    int row, col;
+
+#ifdef _OPENMP
+    #pragma omp parallel for default(shared) private(row,col) \
+    if (height * width > 0x10000)
+#endif
+    for (row = 0; row < rows; row++) {
+        guint8 *a = buffer + row * rowstride;
+        guint8 *b = flip & 2 ? buffer + (height - 1 - row) * rowstride : a;
+        if (!(flip & 1)) {
+            if (a != b)
+                for (col = 0; col < width; col++)
+                    flip_swap_pixel(a + col * depth, b + col * depth, depth);
+        } else {
+            for (col = 0; col < (a == b ? width / 2 : width); col++)
+                flip_swap_pixel(a + col * depth,
+                                b + (width - 1 - col) * depth, depth);
+        }
+    }
+}
+
+/* Transpose a square image in place, swapping pairs of blocks */
+static void flip_transpose_square(guint8 *buffer, const int depth,
+                                  const int size)
+{
+    const int rowstride = size * depth;
+    int top, left, row, col;
+
+#ifdef _OPENMP
+    #pragma omp parallel for default(shared) private(top,left,row,col) \
+    schedule(dynamic) if (size * size > 0x10000)
+#endif
+    for (top = 0; top < size; top += FLIP_BLOCK)
+        for (left = top; left < size; left += FLIP_BLOCK)
+            for (row = top; row < MIN(top + FLIP_BLOCK, size); row++)
+                for (col = MAX(left, row + 1);
+                        col < MIN(left + FLIP_BLOCK, size); col++)
+                    flip_swap_pixel(buffer + row * rowstride + col * depth,
+                                    buffer + col * rowstride + row * depth,
+                                    depth);
+}
+
+/* Flip a height x width image of pixels of 'depth' bytes, as described
+ * by the flip bits of dcraw. The transpose is done in blocks so that the
+ * columns it reads stay in the cache. Everything except transposing a
+ * non square image is done in place, that one goes through a copy. */
+void CLASS flip_buffer_INDI(void *buffer, const int depth, int *height_p,
+                            int *width_p, const int flip)
+{
+    guint8 *image = buffer, *src;
+    int height = *height_p, width = *width_p;
+    int top, left, row, col, srow, scol;
+
+    if (!(flip & 4)) {
+        if (flip & 3)
+            flip_rows(image, depth, height, width, flip);
+        return;
+    }
+    if (height == width) {
+        /* Transposing first turns the flips of the rows into flips of
+         * the columns and the other way around */
+        flip_transpose_square(image, depth, width);
+        if (flip & 3)
+            flip_rows(image, depth, height, width,
+                      (flip & 1) << 1 | (flip & 2) >> 1);
+        return;
+    }
+    src = (guint8 *) malloc((size_t) height * width * depth);
+    merror(src, "flip_image()");
+    memcpy(src, image, (size_t) height * width * depth);
+    /* Row 'row' of the result is column 'row' of the source */
+#ifdef _OPENMP
+    #pragma omp parallel for default(shared) \
+    private(top,left,row,col,srow,scol) if (height * width > 0x10000)
+#endif
+    for (top = 0; top < width; top += FLIP_BLOCK)
+        for (left = 0; left < height; left += FLIP_BLOCK)
+            for (row = top; row < MIN(top + FLIP_BLOCK, width); row++) {
+                scol = flip & 1 ? width - 1 - row : row;
+                for (col = left; col < MIN(left + FLIP_BLOCK, height); col++) {
+                    srow = flip & 2 ? height - 1 - col : col;
+                    flip_copy_pixel(image + ((size_t) row * height + col) * depth,
+                                    src + ((size_t) srow * width + scol) * depth,
+                                    depth);
+                }
+            }
+    free(src);
+    *height_p = width;
+    *width_p = height;
+}
+
+#undef FLIP_BLOCK
+
 void CLASS flip_image_INDI(ushort(*image)[4], int *height_p, int *width_p,
                            /*const*/ int flip) /*UF*/
 {
-    unsigned *flag;
-    int size, base, dest, next, row, col;
-    gint64 *img, hold;
-    int height = *height_p, width = *width_p;/* INDI - UF*/
-
 //  Message is suppressed because error handling is not enabled here.
 //  dcraw_message (dcraw, DCRAW_VERBOSE,_("Flipping image %c:%c:%c...\n"),
 //      flip & 1 ? 'H':'0', flip & 2 ? 'V':'0', flip & 4 ? 'T':'0'); /*UF*/
 
-    img = (gint64 *) image;
-    size = height * width;
-    flag = calloc((size + 31) >> 5, sizeof * flag);
-    merror(flag, "flip_image()");
-    for (base = 0; base < size; base++) {
-        if (flag[base >> 5] & (1 << (base & 31)))
-            continue;
-        dest = base;
-        hold = img[base];
-        while (1) {
-            if (flip & 4) {
-                row = dest % height;
-                col = dest / height;
-            } else {
-                row = dest / width;
-                col = dest % width;
-            }
-            if (flip & 2)
-                row = height - 1 - row;
-            if (flip & 1)
-                col = width - 1 - col;
-            next = row * width + col;
-            if (next == base) break;
-            flag[next >> 5] |= 1 << (next & 31);
-            img[dest] = img[next];
-            dest = next;
-        }
-        img[dest] = hold;
-    }
-    free(flag);
-    if (flip & 4) SWAP(height, width);
-    *height_p = height; /* INDI - UF*/
-    *width_p = width;
+    flip_buffer_INDI(image, sizeof * image, height_p, width_p, flip);
 }
@@ -0,0 +1,139 @@
+/*
+ * UFRaw - Unidentified Flying Raw converter for digital camera images
+ *
+ * decode-stress.c - Load raw files from several threads at once and
+ * compare the result with a load done by a single thread.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * usage: decode-stress [raw-file...]
+ * Two synthetic DNG files, one of them made of lossless JPEG tiles, are
+ * always checked. Raw files given on the command line or listed in the
+ * UFRAW_TEST_FILES environment variable are checked as well.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "ufraw.h"
+#include "dcraw_api.h"
+#include "synthetic-dng.h"
+#include <stdlib.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define STRESS_THREADS 8
+#define STRESS_ROUNDS 4
+
+char *ufraw_binary = "decode-stress";
+
+typedef struct {
+    char **files;
+    guint32 *hashes;
+    int fileCount;
+    gint failures;
+} stress_data;
+
+/* Load a file and return an FNV-1a hash of the raw image, or 0 on error */
+static guint32 load_hash(char *file)
+{
+    dcraw_data raw;
+    guint32 hash = 2166136261u;
+    guint8 *p, *end;
+
+    if (dcraw_open(&raw, file) != DCRAW_SUCCESS)
+        return 0;
+    if (dcraw_load_raw(&raw) != DCRAW_SUCCESS)
+        return 0;
+    p = (guint8 *)raw.raw.image;
+    end = p + (gsize)raw.raw.height * raw.raw.width * sizeof(dcraw_image_type);
+    for (; p < end; p++)
+        hash = (hash ^ *p) * 16777619u;
+    dcraw_close(&raw);
+    return hash | 1;
+}
+
+static void stress_thread(gpointer job, gpointer user_data)
+{
+    stress_data *stress = user_data;
+    int round = GPOINTER_TO_INT(job) - 1;
+    int i, n;
+
+    for (n = 0; n < stress->fileCount; n++) {
+        /* Every thread starts with a different file */
+        i = (n + round) % stress->fileCount;
+        if (load_hash(stress->files[i]) != stress->hashes[i]) {
+            g_printerr("%s: concurrent load differs\n", stress->files[i]);
+            g_atomic_int_inc(&stress->failures);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    stress_data stress;
+    GPtrArray *files = g_ptr_array_new();
+    GThreadPool *pool;
+    const char *env;
+    char **list;
+    int i, r;
+
+#if !GLIB_CHECK_VERSION(2,31,0)
+    g_thread_init(NULL);
+#endif
+    g_ptr_array_add(files, synthetic_dng_write(600, 400, 0));
+    g_ptr_array_add(files, synthetic_dng_write(1024, 768, 128));
+    for (i = 1; i < argc; i++)
+        g_ptr_array_add(files, g_strdup(argv[i]));
+    env = g_getenv("UFRAW_TEST_FILES");
+    if (env != NULL) {
+        list = g_strsplit(env, G_SEARCHPATH_SEPARATOR_S, -1);
+        for (i = 0; list[i] != NULL; i++)
+            if (list[i][0] != '\0')
+                g_ptr_array_add(files, g_strdup(list[i]));
+        g_strfreev(list);
+    }
+    stress.files = (char **)files->pdata;
+    stress.fileCount = files->len;
+    stress.hashes = g_new(guint32, stress.fileCount);
+    stress.failures = 0;
+
+    /* The reference load runs alone on a single thread */
+#ifdef _OPENMP
+    omp_set_num_threads(1);
+#endif
+    for (i = 0; i < stress.fileCount; i++) {
+        stress.hashes[i] = load_hash(stress.files[i]);
+        if (stress.hashes[i] == 0) {
+            g_printerr("%s: cannot be loaded\n", stress.files[i]);
+            stress.failures++;
+        }
+    }
+#ifdef _OPENMP
+    omp_set_num_threads(omp_get_num_procs());
+#endif
+    pool = g_thread_pool_new(stress_thread, &stress, STRESS_THREADS,
+                             FALSE, NULL);
+    for (r = 0; r < STRESS_THREADS * STRESS_ROUNDS; r++)
+        g_thread_pool_push(pool, GINT_TO_POINTER(r + 1), NULL);
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    for (i = 0; i < 2; i++)
+        g_unlink(stress.files[i]);
+    for (i = 0; i < stress.fileCount; i++)
+        g_free(stress.files[i]);
+    g_ptr_array_free(files, TRUE);
+    g_free(stress.hashes);
+    if (stress.failures > 0) {
+        g_printerr("%d loads failed\n", stress.failures);
+        return 1;
+    }
+    return 0;
+}
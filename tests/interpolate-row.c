@@ -0,0 +1,111 @@
+/*
+ * UFRaw - Unidentified Flying Raw converter for digital camera images
+ *
+ * interpolate-row.c - Compare the bilinear interpolation of a row of the
+ * transform phase with the one of single pixels.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Rows of random coordinates over a random image, some of them outside or
+ * near its border, and some with a fraction that rounds up to a whole
+ * pixel, are interpolated by ufraw_interpolate_row_linearly() and pixel
+ * by pixel by ufraw_interpolate_pixel_linearly(). This is done with the
+ * vector code and with UFRAW_NO_SIMD set. The pixels have to be identical.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "ufraw.h"
+#include <string.h>
+
+#define IMAGE_WIDTH 67
+#define IMAGE_HEIGHT 45
+#define ROW_WIDTH 1000
+#define ROWS 200
+
+char *ufraw_binary = "interpolate-row";
+
+/* A random coordinate from a little outside the image to its far side,
+ * a quarter of them with a fraction of at least 255.5/256 */
+static float random_coordinate(GRand *rand, int size)
+{
+    int whole = g_rand_int_range(rand, -3, size + 2);
+    if (g_rand_int_range(rand, 0, 4) == 0)
+        return whole + g_rand_double_range(rand, 255.5 / 256, 1.0);
+    return whole + g_rand_double(rand);
+}
+
+static int check_rows(GRand *rand, gboolean rgbg, int x0, int y0)
+{
+    ufraw_image_data image;
+    ufraw_image_type *row, pixel;
+    float *coord;
+    int colors = rgbg ? 4 : 3;
+    int i, n, c, differ = 0;
+
+    memset(&image, 0, sizeof(image));
+    image.width = IMAGE_WIDTH;
+    image.height = IMAGE_HEIGHT;
+    image.depth = sizeof(ufraw_image_type);
+    image.rowstride = image.width * image.depth;
+    image.rgbg = rgbg;
+    image.buffer = g_malloc(image.height * image.rowstride);
+    for (i = 0; i < image.width * image.height * 4; i++)
+        ((guint16 *)image.buffer)[i] = g_rand_int_range(rand, 0, 0x10000);
+    coord = g_new(float, 2 * ROW_WIDTH);
+    row = g_new(ufraw_image_type, ROW_WIDTH);
+    for (n = 0; n < ROWS; n++) {
+        for (i = 0; i < ROW_WIDTH; i++) {
+            coord[2 * i] = random_coordinate(rand, image.width) + x0;
+            coord[2 * i + 1] = random_coordinate(rand, image.height) + y0;
+        }
+        /* Whole rows inside the image, to keep the vector code busy */
+        if (n % 2 == 0)
+            for (i = 0; i < ROW_WIDTH; i++) {
+                coord[2 * i] = x0 + g_rand_double_range(rand, 0,
+                                                        image.width - 1);
+                coord[2 * i + 1] = y0 + g_rand_double_range(rand, 0,
+                                   image.height - 1);
+            }
+        ufraw_interpolate_row_linearly(&image, coord, ROW_WIDTH, x0, y0, row);
+        for (i = 0; i < ROW_WIDTH; i++) {
+            ufraw_interpolate_pixel_linearly(&image, coord[2 * i] - x0,
+                                             coord[2 * i + 1] - y0, &pixel, -1);
+            for (c = 0; c < colors; c++)
+                if (row[i][c] != pixel[c]) {
+                    if (differ++ < 10)
+                        g_printerr("%s rgbg %d at %.4f,%.4f color %d: "
+                                   "row %d, pixel %d\n",
+                                   g_getenv("UFRAW_NO_SIMD") ? "scalar" : "vector",
+                                   rgbg, coord[2 * i] - x0,
+                                   coord[2 * i + 1] - y0, c, row[i][c],
+                                   pixel[c]);
+                }
+        }
+    }
+    g_free(row);
+    g_free(coord);
+    g_free(image.buffer);
+    return differ > 0;
+}
+
+int main()
+{
+    GRand *rand = g_rand_new_with_seed(2016);
+    int failures = 0;
+
+    g_unsetenv("UFRAW_NO_SIMD");
+    failures += check_rows(rand, FALSE, 0, 0);
+    failures += check_rows(rand, TRUE, 13, 7);
+    g_setenv("UFRAW_NO_SIMD", "1", TRUE);
+    failures += check_rows(rand, FALSE, 0, 0);
+    failures += check_rows(rand, TRUE, 13, 7);
+    g_unsetenv("UFRAW_NO_SIMD");
+    g_rand_free(rand);
+    return failures > 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * UFRaw - Unidentified Flying Raw converter for digital camera images
+ *
+ * interpolate-simd.c - Compare the vector AHD, PPG and color smoothing
+ * kernels with the plain C ones.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Synthetic Bayer frames of a few sizes, including odd ones that leave
+ * row tails for the scalar code, are interpolated with AHD and PPG, once
+ * with the kernels picked for this CPU and once with UFRAW_NO_SIMD set.
+ * The output has to be identical. The draft interpolation has to give the
+ * same output as the bilinear one.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "ufraw.h"
+#include "dcraw_api.h"
+#include "synthetic-dng.h"
+#include <string.h>
+#include <glib/gstdio.h>
+
+char *ufraw_binary = "interpolate-simd";
+
+/* Interpolate a copy of the raw image */
+static dcraw_image_type *interpolate(dcraw_data *raw, int interpolation,
+                                     int smoothing, int *size)
+{
+    dcraw_data copy = *raw;
+    dcraw_image_data final;
+    gsize pixels = (gsize)raw->raw.height * raw->raw.width;
+
+    copy.raw.image = g_new(dcraw_image_type, pixels);
+    memcpy(copy.raw.image, raw->raw.image, pixels * sizeof(dcraw_image_type));
+    final.image = NULL;
+    /* Only the buffered color smoothing has vector kernels */
+    dcraw_finalize_interpolate(&final, &copy, interpolation, smoothing,
+                               smoothing);
+    g_free(copy.raw.image);
+    *size = final.width * final.height;
+    return final.image;
+}
+
+/* Report the pixels that differ between two interpolations, free both.
+ * Returns 1 if any pixel differs. */
+static int compare(const char *name, int width, int height, int smoothing,
+                   dcraw_image_type *image, dcraw_image_type *expected,
+                   int size)
+{
+    int i, differ;
+
+    for (i = 0, differ = 0; i < size; i++)
+        if (memcmp(image[i], expected[i], sizeof(dcraw_image_type)) != 0)
+            differ++;
+    if (differ > 0)
+        g_printerr("%s %dx%d smoothing %d: %d of %d pixels differ\n",
+                   name, width, height, smoothing, differ, size);
+    g_free(image);
+    g_free(expected);
+    return differ > 0;
+}
+
+static int check_size(int width, int height)
+{
+    /* Red and blue are scaled past the white point to get clipping */
+    int rgbWB[4] = { 0x50000, 0x40000, 0x60000, 0x40000 };
+    dcraw_image_type *vector, *scalar, *draft, *bilinear;
+    dcraw_data raw;
+    char *file = synthetic_dng_write(width, height, 0);
+    static const int interpolations[] = {
+        dcraw_ahd_interpolation, dcraw_ppg_interpolation
+    };
+    static const char *names[] = { "AHD", "PPG" };
+    int n, smoothing, size, failures = 0;
+
+    if (dcraw_open(&raw, file) != DCRAW_SUCCESS ||
+            dcraw_load_raw(&raw) != DCRAW_SUCCESS) {
+        g_printerr("%dx%d: cannot load %s\n", width, height, file);
+        g_unlink(file);
+        g_free(file);
+        return 1;
+    }
+    dcraw_finalize_raw(&raw, NULL, rgbWB);
+    for (n = 0; n < 2; n++)
+        for (smoothing = 0; smoothing <= 1; smoothing++) {
+            g_unsetenv("UFRAW_NO_SIMD");
+            vector = interpolate(&raw, interpolations[n], smoothing, &size);
+            g_setenv("UFRAW_NO_SIMD", "1", TRUE);
+            scalar = interpolate(&raw, interpolations[n], smoothing, &size);
+            failures += compare(names[n], width, height, smoothing,
+                                vector, scalar, size);
+        }
+    /* UFRAW_NO_SIMD makes the draft bilinear, so it is compared without */
+    g_unsetenv("UFRAW_NO_SIMD");
+    for (smoothing = 0; smoothing <= 1; smoothing++) {
+        draft = interpolate(&raw, dcraw_draft_interpolation, smoothing, &size);
+        bilinear = interpolate(&raw, dcraw_bilinear_interpolation, smoothing,
+                               &size);
+        failures += compare("Draft", width, height, smoothing, draft,
+                            bilinear, size);
+    }
+    dcraw_close(&raw);
+    g_unlink(file);
+    g_free(file);
+    return failures;
+}
+
+int main()
+{
+    int failures = 0;
+
+    failures += check_size(600, 400);
+    failures += check_size(1203, 907);
+    failures += check_size(2050, 1366);
+    g_unsetenv("UFRAW_NO_SIMD");
+    return failures > 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * UFRaw - Unidentified Flying Raw converter for digital camera images
+ *
+ * synthetic-dng.c - Write small DNG files with known content for the checks.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "synthetic-dng.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+/* Synthetic Bayer data with edges and some noise */
+static guint16 synthetic_pixel(int x, int y)
+{
+    guint32 noise = (x * 1103515245u + y * 12345u) >> 16 & 255;
+    int v = (x * 37 + y * 23) % 3000 + 600 + noise;
+    if ((x / 40 + y / 30) % 5 == 0)
+        v += 6000;
+    return MIN(v * (4 + (y & 1) * 2 + (x & 1)) / 4, 16383);
+}
+
+static void put_bits(GByteArray *out, guint32 *acc, int *nbits,
+                     guint32 value, int count)
+{
+    guint8 byte, zero = 0;
+    *acc = *acc << count | (value & ((1 << count) - 1));
+    *nbits += count;
+    while (*nbits >= 8) {
+        *nbits -= 8;
+        byte = *acc >> *nbits;
+        g_byte_array_append(out, &byte, 1);
+        if (byte == 0xff)
+            g_byte_array_append(out, &zero, 1);
+    }
+}
+
+/* Encode a tile as lossless JPEG with the left predictor. Every
+ * difference category gets a 5 bit code, which is simple and valid. */
+static void ljpeg_tile(GByteArray *out, int x0, int y0, int w, int h)
+{
+    static const guint8 soi[] = { 0xff, 0xd8 };
+    static const guint8 eoi[] = { 0xff, 0xd9 };
+    guint8 hdr[64];
+    guint32 acc = 0;
+    int nbits = 0, x, y, c, diff, pred;
+
+    g_byte_array_append(out, soi, sizeof soi);
+    /* SOF3: 14 bits precision, one component */
+    memcpy(hdr, "\xff\xc3\x00\x0b\x0e", 5);
+    hdr[5] = h >> 8, hdr[6] = h, hdr[7] = w >> 8, hdr[8] = w;
+    memcpy(hdr + 9, "\x01\x01\x11\x00", 4);
+    g_byte_array_append(out, hdr, 13);
+    /* DHT: table 0 with the 17 categories, all of length 5 */
+    memcpy(hdr, "\xff\xc4\x00\x24\x00", 5);
+    memset(hdr + 5, 0, 16);
+    hdr[5 + 4] = 17;
+    for (c = 0; c < 17; c++)
+        hdr[21 + c] = c;
+    g_byte_array_append(out, hdr, 38);
+    /* SOS: predictor 1 */
+    memcpy(hdr, "\xff\xda\x00\x08\x01\x01\x00\x01\x00\x00", 10);
+    g_byte_array_append(out, hdr, 10);
+    for (y = 0; y < h; y++)
+        for (x = 0; x < w; x++) {
+            if (x > 0)
+                pred = synthetic_pixel(x0 + x - 1, y0 + y);
+            else if (y > 0)
+                pred = synthetic_pixel(x0, y0 + y - 1);
+            else
+                pred = 1 << 13;
+            diff = synthetic_pixel(x0 + x, y0 + y) - pred;
+            for (c = 0; abs(diff) >> c; c++);
+            put_bits(out, &acc, &nbits, c, 5);
+            if (c > 0)
+                put_bits(out, &acc, &nbits, diff > 0 ? diff : diff + (1 << c) - 1, c);
+        }
+    if (nbits > 0)
+        put_bits(out, &acc, &nbits, 0xff, 8 - nbits);
+    g_byte_array_append(out, eoi, sizeof eoi);
+}
+
+static void put_tag(guint8 **p, int tag, int type, guint32 count, guint32 value)
+{
+    guint8 *e = *p;
+    e[0] = tag, e[1] = tag >> 8, e[2] = type, e[3] = 0;
+    e[4] = count, e[5] = count >> 8, e[6] = count >> 16, e[7] = count >> 24;
+    if (type == 3 && count == 1)
+        value &= 0xffff;
+    e[8] = value, e[9] = value >> 8, e[10] = value >> 16, e[11] = value >> 24;
+    *p += 12;
+}
+
+static void put_le32(GByteArray *out, guint offset, guint32 value)
+{
+    out->data[offset] = value;
+    out->data[offset + 1] = value >> 8;
+    out->data[offset + 2] = value >> 16;
+    out->data[offset + 3] = value >> 24;
+}
+
+/* Write a temporary DNG with a RGGB pattern, either uncompressed in one
+ * strip (tile == 0) or in lossless JPEG tiles of tile x tile pixels.
+ * Returns its path, which the caller should unlink and g_free(). */
+char *synthetic_dng_write(int width, int height, int tile)
+{
+    static const guint32 matrix[18] = { 6722, 10000, -635, 10000, -963, 10000,
+                                        -4287, 10000, 12460, 10000, 2028, 10000,
+                                        -908, 10000, 2162, 10000, 5668, 10000
+                                      };
+    GByteArray *out = g_byte_array_new();
+    guint8 ifd[2 + 20 * 12 + 4], *p = ifd + 2;
+    guint extra, offsets, counts, data, start, ntiles, t, x, y;
+    char *path;
+    int fd;
+
+    ntiles = tile ? ((width + tile - 1) / tile) * ((height + tile - 1) / tile) : 1;
+    g_byte_array_append(out, (const guint8 *)"II*\0\x08\0\0\0", 8);
+    g_byte_array_set_size(out, 8 + sizeof ifd);
+    extra = out->len;
+    g_byte_array_append(out, (const guint8 *)"Canon\0EOS 5D Mark III\0", 22);
+    for (t = 0; t < 18; t++) {
+        g_byte_array_set_size(out, out->len + 4);
+        put_le32(out, out->len - 4, matrix[t]);
+    }
+    offsets = out->len;
+    g_byte_array_set_size(out, out->len + 8 * ntiles);
+    counts = offsets + 4 * ntiles;
+    data = out->len;
+    if (tile == 0) {
+        for (y = 0; y < (guint)height; y++)
+            for (x = 0; x < (guint)width; x++) {
+                guint16 v = synthetic_pixel(x, y);
+                guint8 le[2] = { v & 0xff, v >> 8 };
+                g_byte_array_append(out, le, 2);
+            }
+        put_le32(out, offsets, data);
+        put_le32(out, counts, out->len - data);
+    } else {
+        for (t = 0, y = 0; y < (guint)height; y += tile)
+            for (x = 0; x < (guint)width; x += tile, t++) {
+                start = out->len;
+                ljpeg_tile(out, x, y, tile, tile);
+                put_le32(out, offsets + 4 * t, start);
+                put_le32(out, counts + 4 * t, out->len - start);
+            }
+    }
+    put_tag(&p, 254, 4, 1, 0);
+    put_tag(&p, 256, 4, 1, width);
+    put_tag(&p, 257, 4, 1, height);
+    put_tag(&p, 258, 3, 1, 16);
+    put_tag(&p, 259, 3, 1, tile ? 7 : 1);
+    put_tag(&p, 262, 3, 1, 32803);
+    put_tag(&p, 271, 2, 6, extra);
+    put_tag(&p, 272, 2, 16, extra + 6);
+    if (tile == 0) {
+        put_tag(&p, 273, 4, 1, data);
+        put_tag(&p, 277, 3, 1, 1);
+        put_tag(&p, 278, 4, 1, height);
+        put_tag(&p, 279, 4, 1, out->len - data);
+    } else {
+        put_tag(&p, 277, 3, 1, 1);
+        put_tag(&p, 322, 4, 1, tile);
+        put_tag(&p, 323, 4, 1, tile);
+        put_tag(&p, 324, 4, ntiles, offsets);
+        put_tag(&p, 325, 4, ntiles, counts);
+    }
+    put_tag(&p, 33421, 3, 2, 2 | 2 << 16);
+    put_tag(&p, 33422, 1, 4, 0x02010100);
+    put_tag(&p, 50706, 1, 4, 0x00000401);
+    put_tag(&p, 50717, 4, 1, 16383);
+    put_tag(&p, 50721, 10, 9, extra + 22);
+    put_tag(&p, 50778, 3, 1, 21);
+    ifd[0] = (p - ifd - 2) / 12, ifd[1] = 0;
+    memset(p, 0, 4);
+    memcpy(out->data + 8, ifd, p + 4 - ifd);
+
+    fd = g_file_open_tmp("ufraw-test-XXXXXX.dng", &path, NULL);
+    if (fd < 0 || write(fd, out->data, out->len) != (gssize)out->len) {
+        g_printerr("Cannot write a temporary DNG file\n");
+        exit(1);
+    }
+    close(fd);
+    g_byte_array_free(out, TRUE);
+    return path;
+}
@@ -0,0 +1,19 @@
+/*
+ * UFRaw - Unidentified Flying Raw converter for digital camera images
+ *
+ * synthetic-dng.h - Write small DNG files with known content for the checks.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _SYNTHETIC_DNG_H
+#define _SYNTHETIC_DNG_H
+
+#include <glib.h>
+
+char *synthetic_dng_write(int width, int height, int tile);
+
+#endif /*_SYNTHETIC_DNG_H*/
@@ -0,0 +1,113 @@
+/*
+ * UFRaw - Unidentified Flying Raw converter for digital camera images
+ *
+ * vng-bench.c - Time the VNG interpolation with 1 to 64 threads.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * usage: vng-bench [width height [max-threads]]
+ * A synthetic frame, 4000x3000 by default, is interpolated with twice as
+ * many threads each time, up to 64. The best of three runs is reported
+ * with its speedup over one thread. The output has to be the same for
+ * every thread count.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "ufraw.h"
+#include "dcraw_api.h"
+#include "synthetic-dng.h"
+#include <stdlib.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define BENCH_RUNS 3
+
+char *ufraw_binary = "vng-bench";
+
+/* Interpolate a copy of the raw image, return the time it took */
+static double interpolate(dcraw_data *raw, guint32 *hash)
+{
+    dcraw_data copy = *raw;
+    dcraw_image_data final;
+    gsize pixels = (gsize)raw->raw.height * raw->raw.width;
+    GTimer *timer;
+    guint8 *p, *end;
+    double seconds;
+
+    copy.raw.image = g_new(dcraw_image_type, pixels);
+    memcpy(copy.raw.image, raw->raw.image, pixels * sizeof(dcraw_image_type));
+    final.image = NULL;
+    timer = g_timer_new();
+    dcraw_finalize_interpolate(&final, &copy, dcraw_vng_interpolation, 0, 0);
+    seconds = g_timer_elapsed(timer, NULL);
+    g_timer_destroy(timer);
+    *hash = 2166136261u;
+    p = (guint8 *)final.image;
+    end = p + (gsize)final.width * final.height * sizeof(dcraw_image_type);
+    for (; p < end; p++)
+        *hash = (*hash ^ *p) * 16777619u;
+    g_free(copy.raw.image);
+    g_free(final.image);
+    return seconds;
+}
+
+int main(int argc, char **argv)
+{
+    int rgbWB[4] = { 0x40000, 0x40000, 0x40000, 0x40000 };
+    int width = argc > 2 ? atoi(argv[1]) : 4000;
+    int height = argc > 2 ? atoi(argv[2]) : 3000;
+    int maxThreads = argc > 3 ? atoi(argv[3]) : 64;
+    guint32 hash, firstHash = 0;
+    double best, seconds, single = 0;
+    dcraw_data raw;
+    char *file;
+    int threads, run, failures = 0;
+
+#if !GLIB_CHECK_VERSION(2,31,0)
+    g_thread_init(NULL);
+#endif
+    file = synthetic_dng_write(width, height, 0);
+    if (dcraw_open(&raw, file) != DCRAW_SUCCESS ||
+            dcraw_load_raw(&raw) != DCRAW_SUCCESS) {
+        g_printerr("Cannot load %s\n", file);
+        g_unlink(file);
+        return 1;
+    }
+    g_unlink(file);
+    g_free(file);
+    dcraw_finalize_raw(&raw, NULL, rgbWB);
+#ifndef _OPENMP
+    maxThreads = 1;
+#endif
+    g_print("VNG %dx%d\nthreads  seconds  speedup\n", width, height);
+    for (threads = 1; threads <= maxThreads; threads *= 2) {
+#ifdef _OPENMP
+        omp_set_num_threads(threads);
+#endif
+        best = G_MAXDOUBLE;
+        for (run = 0; run < BENCH_RUNS; run++) {
+            seconds = interpolate(&raw, &hash);
+            best = MIN(best, seconds);
+            if (firstHash == 0)
+                firstHash = hash;
+            if (hash != firstHash) {
+                g_printerr("%d threads: the output differs\n", threads);
+                failures++;
+            }
+        }
+        if (threads == 1)
+            single = best;
+        g_print("%7d %8.3f %8.2f\n", threads, best, single / best);
+    }
+    dcraw_close(&raw);
+    return failures > 0;
+}
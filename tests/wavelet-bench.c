@@ -0,0 +1,107 @@
+/*
+ * UFRaw - Unidentified Flying Raw converter for digital camera images
+ *
+ * wavelet-bench.c - Time the SSE2 and the scalar hat transforms of the
+ * wavelet denoising.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * usage: wavelet-bench [width height]
+ * A synthetic frame, 4000x3000 by default, is denoised on one thread,
+ * where the hat transforms take most of the time. It is done once with
+ * the SSE2 kernels and once with UFRAW_NO_SIMD set, which keeps the scalar
+ * loops. The best of three runs is reported. Both have to give the same
+ * output.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "ufraw.h"
+#include "dcraw_api.h"
+#include "synthetic-dng.h"
+#include <stdlib.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define BENCH_RUNS 3
+#define BENCH_THRESHOLD 100
+
+char *ufraw_binary = "wavelet-bench";
+
+/* Denoise a copy of the raw image, return the best time of BENCH_RUNS */
+static double denoise(dcraw_data *raw, guint32 *hash)
+{
+    dcraw_data copy = *raw;
+    gsize pixels = (gsize)raw->raw.height * raw->raw.width;
+    GTimer *timer;
+    guint8 *p, *end;
+    double seconds, best = G_MAXDOUBLE;
+    int run;
+
+    copy.raw.image = g_new(dcraw_image_type, pixels);
+    for (run = 0; run < BENCH_RUNS; run++) {
+        memcpy(copy.raw.image, raw->raw.image,
+               pixels * sizeof(dcraw_image_type));
+        timer = g_timer_new();
+        dcraw_wavelet_denoise(&copy, BENCH_THRESHOLD);
+        seconds = g_timer_elapsed(timer, NULL);
+        g_timer_destroy(timer);
+        best = MIN(best, seconds);
+    }
+    *hash = 2166136261u;
+    p = (guint8 *)copy.raw.image;
+    end = p + pixels * sizeof(dcraw_image_type);
+    for (; p < end; p++)
+        *hash = (*hash ^ *p) * 16777619u;
+    g_free(copy.raw.image);
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    int rgbWB[4] = { 0x40000, 0x40000, 0x40000, 0x40000 };
+    int width = argc > 2 ? atoi(argv[1]) : 4000;
+    int height = argc > 2 ? atoi(argv[2]) : 3000;
+    guint32 vectorHash, scalarHash;
+    double vector, scalar;
+    dcraw_data raw;
+    char *file;
+
+    file = synthetic_dng_write(width, height, 0);
+    if (dcraw_open(&raw, file) != DCRAW_SUCCESS ||
+            dcraw_load_raw(&raw) != DCRAW_SUCCESS) {
+        g_printerr("Cannot load %s\n", file);
+        g_unlink(file);
+        return 1;
+    }
+    g_unlink(file);
+    g_free(file);
+    dcraw_set_color_scale(&raw, TRUE);
+    dcraw_finalize_raw(&raw, NULL, rgbWB);
+#ifdef _OPENMP
+    omp_set_num_threads(1);
+#endif
+    g_unsetenv("UFRAW_NO_SIMD");
+    vector = denoise(&raw, &vectorHash);
+    g_setenv("UFRAW_NO_SIMD", "1", TRUE);
+    scalar = denoise(&raw, &scalarHash);
+    g_unsetenv("UFRAW_NO_SIMD");
+    dcraw_close(&raw);
+
+    g_print("Wavelet denoising %dx%d, one thread\n", width, height);
+    g_print("vector %8.3f s\nscalar %8.3f s\nspeedup %7.2f\n",
+            vector, scalar, scalar / vector);
+    if (vectorHash != scalarHash) {
+        g_printerr("The vector and the scalar output differ\n");
+        return 1;
+    }
+    return 0;
+}
@@ -14,16 +14,56 @@
 #include <stdlib.h>    /* for exit */
 #include <errno.h>     /* for errno */
 #include <string.h>
+#include <fcntl.h>
+#include <getopt.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 #include <glib/gi18n.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifndef _WIN32
+#include <signal.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
 static gboolean silentMessenger;
+/* More than one file in flight, nobody can answer the overwrite question */
+static gboolean batchJobs;
 char *ufraw_binary;
 
+/* The input files are read ahead by a helper thread, so that the disk
+ * (or the network share) is kept busy while the current files are being
+ * developed. 'next' is the index of the next file to be read ahead. */
+typedef struct {
+    GThreadPool *pool;
+    char **files;
+    int fileCount;
+    int next;
+} prefetch_data;
+
 int ufraw_batch_saver(ufraw_data *uf);
+static void ufraw_batch_prefetch_file(gpointer data, gpointer user_data);
+static void ufraw_batch_prefetch(prefetch_data *prefetch, int last);
+static int ufraw_batch_convert(char *argFile, conf_data *rc, conf_data *conf,
+                               conf_data *cmd, int fileIndex, int fileCount);
+static char *ufraw_batch_threads_init(conf_data *rc);
+static void ufraw_batch_threads_end(char *locale);
+#ifndef _WIN32
+static int ufraw_batch_serve(const char *path, int jobs, conf_data *rc);
+#endif
+#ifdef _OPENMP
+static int ufraw_batch_jobs(char **files, int fileCount, int jobs,
+                            int prefetchCount, prefetch_data *prefetch,
+                            conf_data *rc, conf_data *conf, conf_data *cmd);
+#endif
 
 int main(int argc, char **argv)
 {
-    ufraw_data *uf;
     conf_data rc, cmd, conf;
     int status;
     int exitCode = 0;
@@ -56,62 +96,487 @@ int main(int argc, char **argv)
     if (optInd == 0) exit(0);
     silentMessenger = cmd.silent;
 
+    if (strlen(cmd.serveSocket) > 0) {
+        if (optInd < argc) {
+            ufraw_message(UFRAW_ERROR,
+                          _("Input files cannot be given with --serve"));
+            exit(1);
+        }
+#ifdef _WIN32
+        ufraw_message(UFRAW_ERROR,
+                      _("The --serve option is not supported on this platform"));
+        exit(1);
+#else
+        /* The jobs bring their own messages and settings */
+        silentMessenger = FALSE;
+        exitCode = ufraw_batch_serve(cmd.serveSocket, cmd.jobs, &rc);
+        ufobject_delete(cmd.ufobject);
+        ufobject_delete(rc.ufobject);
+        exit(exitCode);
+#endif
+    }
+
     conf_file_load(&conf, cmd.inputFilename);
 
     if (optInd == argc) {
         ufraw_message(UFRAW_WARNING, _("No input file, nothing to do."));
     }
     int fileCount = argc - optInd;
+    int jobs = MIN(cmd.jobs, fileCount);
+    /* Files written to stdout cannot be interleaved */
+    if (!strcmp(cmd.outputFilename, "-"))
+        jobs = 1;
+    prefetch_data prefetch = { NULL, argv + optInd, fileCount, jobs };
+    if (cmd.prefetch > 0 && fileCount > jobs)
+        prefetch.pool = g_thread_pool_new(ufraw_batch_prefetch_file, NULL,
+                                          1, FALSE, NULL);
+#ifdef _OPENMP
+    if (jobs > 1) {
+        exitCode = ufraw_batch_jobs(argv + optInd, fileCount, jobs,
+                                    cmd.prefetch, &prefetch, &rc, &conf, &cmd);
+        optInd = argc;
+    }
+#else
+    if (jobs > 1)
+        ufraw_message(UFRAW_WARNING,
+                      _("ufraw was built without OpenMP support, "
+                        "converting one file at a time."));
+#endif
     int fileIndex = 1;
     for (; optInd < argc; optInd++, fileIndex++) {
-        argFile = uf_win32_locale_to_utf8(argv[optInd]);
-        uf = ufraw_open(argFile);
+        ufraw_batch_prefetch(&prefetch, fileIndex + cmd.prefetch);
+        status = ufraw_batch_convert(argv[optInd], &rc, &conf, &cmd,
+                                     fileIndex, fileCount);
+        if (status < 0) exit(1);
+        exitCode |= status;
+    }
+    if (prefetch.pool != NULL)
+        g_thread_pool_free(prefetch.pool, TRUE, FALSE);
+//    ufraw_close(cmd.darkframe);
+    ufobject_delete(cmd.ufobject);
+    ufobject_delete(rc.ufobject);
+    ufraw_release_buffers();
+    exit(exitCode);
+}
+
+static void ufraw_batch_prefetch_file(gpointer data, gpointer user_data)
+{
+    char *filename = data;
+    (void)user_data;
+#ifdef HAVE_POSIX_FADVISE
+    /* Let the kernel schedule the read, it also reads ahead over NFS */
+    int fd = g_open(filename, O_RDONLY, 0);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+#else
+    /* Read the file to bring it into the system's file cache */
+    FILE *in = g_fopen(filename, "rb");
+    if (in != NULL) {
+        char *buffer = g_new(char, 0x10000);
+        while (fread(buffer, 1, 0x10000, in) == 0x10000);
+        g_free(buffer);
+        fclose(in);
+    }
+#endif
+    g_free(filename);
+}
+
+/* Queue the input files up to (not including) index 'last' for reading */
+static void ufraw_batch_prefetch(prefetch_data *prefetch, int last)
+{
+    if (prefetch->pool == NULL)
+        return;
+    for (; prefetch->next < MIN(last, prefetch->fileCount); prefetch->next++) {
+        char *argFile = uf_win32_locale_to_utf8(prefetch->files[prefetch->next]);
+        g_thread_pool_push(prefetch->pool, g_strdup(argFile), NULL);
         uf_win32_locale_free(argFile);
-        if (uf == NULL) {
+    }
+}
+
+/* Convert one file. Returns 0 on success, 1 if the file failed and -1 if
+ * the configuration is wrong and the batch should stop. */
+static int ufraw_batch_convert(char *argFile, conf_data *rc, conf_data *conf,
+                               conf_data *cmd, int fileIndex, int fileCount)
+{
+    ufraw_data *uf;
+    int status;
+
+    argFile = uf_win32_locale_to_utf8(argFile);
+    uf = ufraw_open(argFile);
+    uf_win32_locale_free(argFile);
+    if (uf == NULL) {
+        ufraw_message(UFRAW_REPORT, NULL);
+        return 1;
+    }
+    status = ufraw_config(uf, rc, conf, cmd);
+    if (uf->conf && uf->conf->createID == only_id && cmd->createID == -1)
+        uf->conf->createID = no_id;
+    if (status == UFRAW_ERROR) {
+        ufraw_close_darkframe(uf->conf);
+        ufraw_close(uf);
+        g_free(uf);
+        return -1;
+    }
+    if (ufraw_load_raw(uf) != UFRAW_SUCCESS) {
+        ufraw_close_darkframe(uf->conf);
+        ufraw_close(uf);
+        g_free(uf);
+        return 1;
+    }
+    char stat[max_name];
+    if (fileCount > 1)
+        g_snprintf(stat, max_name, "[%d/%d]", fileIndex, fileCount);
+    else
+        stat[0] = '\0';
+    ufraw_message(UFRAW_MESSAGE, _("Loaded %s %s"), uf->filename, stat);
+    status = ufraw_batch_saver(uf);
+    if (status == UFRAW_SUCCESS || status == UFRAW_WARNING) {
+        if (uf->conf->createID != only_id)
+            ufraw_message(UFRAW_MESSAGE, _("Saved %s %s"),
+                          uf->conf->outputFilename, stat);
+        status = 0;
+    } else {
+        status = 1;
+    }
+    ufraw_close_darkframe(uf->conf);
+    ufraw_close(uf);
+    g_free(uf);
+    return status;
+}
+
+/* Prepare for converting files in more than one thread. Returns the
+ * locale to give to ufraw_batch_threads_end() once the threads are done. */
+static char *ufraw_batch_threads_init(conf_data *rc)
+{
+    batchJobs = TRUE;
+    /* uf_set_locale_C() changes the locale of the whole process, so it is
+     * done once here, and the calls in the threads find nothing to change. */
+    char *locale = uf_set_locale_C();
+    /* ufraw_config() would set these on every call */
+    if (rc->autoExposure == enabled_state) rc->autoExposure = apply_state;
+    if (rc->autoBlack == enabled_state) rc->autoBlack = apply_state;
+    return locale;
+}
+
+static void ufraw_batch_threads_end(char *locale)
+{
+    batchJobs = FALSE;
+    uf_reset_locale(locale);
+}
+
+#ifndef _WIN32
+/* A job has to arrive within SERVE_TIMEOUT seconds of the connection, and
+ * its command line cannot be longer than SERVE_MAX_REQUEST bytes */
+#define SERVE_TIMEOUT 10
+#define SERVE_MAX_REQUEST 65536
+
+typedef struct {
+    conf_data *rc;
+    int threads;
+} serve_data;
+
+typedef struct {
+    int fd;
+    int argc;
+    char **argv;
+} serve_job;
+
+/* getopt_long() keeps its state in global variables */
+G_LOCK_DEFINE_STATIC(ufraw_batch_args);
+
+/* Run the command line of one job, the same way main() does.
+ * Returns the exit code of the job. */
+static int ufraw_batch_serve_job(int argc, char **argv, conf_data *rc,
+                                 gboolean *silent)
+{
+    conf_data *jobRc = g_new(conf_data, 1);
+    conf_data *cmd = g_new(conf_data, 1);
+    conf_data *conf = g_new(conf_data, 1);
+    int exitCode = 0, status;
+
+    /* ufraw_process_args() loads curve files into the rc */
+    *jobRc = *rc;
+    conf->ufobject = NULL;
+    G_LOCK(ufraw_batch_args);
+    optind = 0;
+    int optInd = ufraw_process_args(&argc, &argv, cmd, jobRc);
+    G_UNLOCK(ufraw_batch_args);
+    *silent = optInd > 0 && cmd->silent;
+    if (optInd < 0) {
+        exitCode = 1;
+    } else if (optInd > 0) {
+        if (strlen(cmd->serveSocket) > 0 || cmd->jobs != 1) {
+            ufraw_message(UFRAW_ERROR,
+                          _("The --serve and --jobs options are not valid in a job"));
+            optInd = argc;
             exitCode = 1;
-            ufraw_message(UFRAW_REPORT, NULL);
+        }
+        conf_file_load(conf, cmd->inputFilename);
+        if (optInd == argc && exitCode == 0)
+            ufraw_message(UFRAW_WARNING, _("No input file, nothing to do."));
+        int fileIndex = 1, fileCount = argc - optInd;
+        for (; optInd < argc; optInd++, fileIndex++) {
+            status = ufraw_batch_convert(argv[optInd], jobRc, conf, cmd,
+                                         fileIndex, fileCount);
+            if (status < 0) {
+                exitCode = 1;
+                break;
+            }
+            exitCode |= status;
+        }
+    }
+    ufobject_delete(cmd->ufobject);
+    ufobject_delete(conf->ufobject);
+    g_free(jobRc);
+    g_free(cmd);
+    g_free(conf);
+    return exitCode;
+}
+
+/* Add the command line argument 'line' to 'args'. Returns FALSE if it is
+ * the empty line that ends the job. */
+static gboolean ufraw_batch_serve_arg(GPtrArray *args, char *line, gsize end)
+{
+    if (end > 0 && line[end - 1] == '\r')
+        end--;
+    if (end == 0)
+        return FALSE;
+    g_ptr_array_add(args, g_strndup(line, end));
+    return TRUE;
+}
+
+/* Read the command line of one job from the connection 'fd', one argument
+ * per line up to an empty line or the end of the connection. Returns the
+ * NULL terminated arguments, or NULL if the job is not complete within
+ * SERVE_TIMEOUT seconds or is too long. */
+static char **ufraw_batch_serve_read(int fd, int *argc)
+{
+    GPtrArray *args = g_ptr_array_new();
+    GString *request = g_string_new(NULL);
+    GTimer *timer = g_timer_new();
+    struct pollfd pfd;
+    gboolean done = FALSE;
+    gsize start = 0;
+    char buffer[4096], *line, *newline, **argv;
+    int timeout, ready;
+    ssize_t count;
+
+    g_ptr_array_add(args, g_strdup(ufraw_binary));
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (!done && request->len <= SERVE_MAX_REQUEST) {
+        timeout = (SERVE_TIMEOUT - g_timer_elapsed(timer, NULL)) * 1000;
+        if (timeout <= 0)
+            break;
+        ready = poll(&pfd, 1, timeout);
+        if (ready < 0 && errno == EINTR)
             continue;
+        if (ready <= 0)
+            break;
+        count = read(fd, buffer, sizeof(buffer));
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+            break;
+        if (count == 0) {
+            /* The end of the connection also ends the job */
+            if (start < request->len)
+                ufraw_batch_serve_arg(args, request->str + start,
+                                      request->len - start);
+            done = TRUE;
+            break;
         }
-        status = ufraw_config(uf, &rc, &conf, &cmd);
-        if (uf->conf && uf->conf->createID == only_id && cmd.createID == -1)
-            uf->conf->createID = no_id;
-        if (status == UFRAW_ERROR) {
-            exitCode = 1;
-            ufraw_close_darkframe(uf->conf);
-            ufraw_close(uf);
-            g_free(uf);
-            exit(1);
+        g_string_append_len(request, buffer, count);
+        while (!done && (newline = memchr(request->str + start, '\n',
+                                          request->len - start)) != NULL) {
+            line = request->str + start;
+            start = newline + 1 - request->str;
+            done = !ufraw_batch_serve_arg(args, line, newline - line);
         }
-        if (ufraw_load_raw(uf) != UFRAW_SUCCESS) {
-            exitCode = 1;
-            ufraw_close_darkframe(uf->conf);
-            ufraw_close(uf);
-            g_free(uf);
+    }
+    g_timer_destroy(timer);
+    g_string_free(request, TRUE);
+    *argc = args->len;
+    g_ptr_array_add(args, NULL);
+    argv = (char **)g_ptr_array_free(args, FALSE);
+    if (!done) {
+        g_strfreev(argv);
+        return NULL;
+    }
+    return argv;
+}
+
+/* Run one job read by ufraw_batch_serve() and send back its messages
+ * followed by its status. */
+static void ufraw_batch_serve_connection(gpointer data, gpointer user_data)
+{
+    serve_job *job = data;
+    serve_data *serve = user_data;
+    GIOChannel *channel = g_io_channel_unix_new(job->fd);
+    gboolean silent;
+
+    g_io_channel_set_encoding(channel, NULL, NULL);
+    g_io_channel_set_close_on_unref(channel, TRUE);
+#ifdef _OPENMP
+    omp_set_num_threads(serve->threads);
+#endif
+    ufraw_message_thread_begin(TRUE);
+    int status = ufraw_batch_serve_job(job->argc, job->argv, serve->rc,
+                                       &silent);
+    char *text = ufraw_message_thread_end();
+    char *reply = g_strdup_printf("%sSTATUS %d\n",
+                                  text == NULL || silent ? "" : text, status);
+    g_io_channel_write_chars(channel, reply, -1, NULL, NULL);
+    g_io_channel_flush(channel, NULL);
+    g_io_channel_unref(channel);
+    g_free(reply);
+    g_free(text);
+    g_strfreev(job->argv);
+    g_free(job);
+}
+
+/* Keep the resources loaded and convert the jobs sent to the Unix domain
+ * socket 'path', up to 'jobs' of them at a time. The socket is only open to
+ * the user running the server, since a job can write any file that user
+ * can. Only returns on error. */
+static int ufraw_batch_serve(const char *path, int jobs, conf_data *rc)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    serve_data serve;
+    serve_job *job;
+    GThreadPool *pool;
+    mode_t mask;
+    char *locale, **argv;
+    int sock, fd, argc, status;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        ufraw_message(UFRAW_ERROR, _("Socket name '%s' is too long"), path);
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    g_strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+    /* Remove the socket left by a previous server, but no other file */
+    if (g_lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        g_unlink(path);
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    mask = umask(077);
+    status = sock < 0 ? -1 : bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (status < 0 || listen(sock, 16) < 0) {
+        ufraw_message(UFRAW_ERROR, _("Cannot listen on '%s': %s"),
+                      path, g_strerror(errno));
+        if (sock >= 0) close(sock);
+        return 1;
+    }
+    /* A client that went away should not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    locale = ufraw_batch_threads_init(rc);
+    serve.rc = rc;
+#ifdef _OPENMP
+    serve.threads = MAX(omp_get_max_threads() / jobs, 1);
+#else
+    serve.threads = 1;
+#endif
+    pool = g_thread_pool_new(ufraw_batch_serve_connection, &serve,
+                             jobs, FALSE, NULL);
+    ufraw_message(UFRAW_MESSAGE, _("Waiting for jobs on %s"), path);
+    while (1) {
+        fd = accept(sock, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                break;
             continue;
         }
-        char stat[max_name];
-        if (fileCount > 1)
-            g_snprintf(stat, max_name, "[%d/%d]", fileIndex, fileCount);
-        else
-            stat[0] = '\0';
-        ufraw_message(UFRAW_MESSAGE, _("Loaded %s %s"), uf->filename, stat);
-        status = ufraw_batch_saver(uf);
-        if (status == UFRAW_SUCCESS || status == UFRAW_WARNING) {
-            if (uf->conf->createID != only_id)
-                ufraw_message(UFRAW_MESSAGE, _("Saved %s %s"),
-                              uf->conf->outputFilename, stat);
-        } else {
-            exitCode = 1;
+        /* Only complete jobs go to the pool, so that connections which
+         * send nothing cannot hold its threads */
+        argv = ufraw_batch_serve_read(fd, &argc);
+        if (argv == NULL) {
+            ufraw_message(UFRAW_WARNING,
+                          _("Dropped a connection that sent no complete job"));
+            close(fd);
+            continue;
         }
-        ufraw_close_darkframe(uf->conf);
-        ufraw_close(uf);
-        g_free(uf);
+        job = g_new(serve_job, 1);
+        job->fd = fd;
+        job->argc = argc;
+        job->argv = argv;
+        g_thread_pool_push(pool, job, NULL);
     }
-//    ufraw_close(cmd.darkframe);
-    ufobject_delete(cmd.ufobject);
-    ufobject_delete(rc.ufobject);
-    exit(exitCode);
+    ufraw_message(UFRAW_ERROR, _("Cannot accept jobs on '%s': %s"),
+                  path, g_strerror(errno));
+    g_thread_pool_free(pool, FALSE, TRUE);
+    ufraw_batch_threads_end(locale);
+    close(sock);
+    g_unlink(path);
+    return 1;
 }
+#endif
+
+#ifdef _OPENMP
+/* Convert the files with up to 'jobs' of them in flight. The OpenMP threads
+ * are divided between the files being converted, and the messages of every
+ * file are printed once all the files before it are done. */
+static int ufraw_batch_jobs(char **files, int fileCount, int jobs,
+                            int prefetchCount, prefetch_data *prefetch,
+                            conf_data *rc, conf_data *conf, conf_data *cmd)
+{
+    char **output = g_new0(char *, fileCount);
+    gboolean *done = g_new0(gboolean, fileCount);
+    int threads = omp_get_max_threads();
+    int started = 0, running = 0, printed = 0;
+    gboolean aborted = FALSE;
+    int exitCode = 0;
+    char *locale;
+    int i;
+
+    locale = ufraw_batch_threads_init(rc);
+    omp_set_max_active_levels(2);
+
+    #pragma omp parallel for schedule(dynamic) num_threads(jobs) \
+    reduction(|:exitCode)
+    for (i = 0; i < fileCount; i++) {
+        int status = 1, inFlight;
+        gboolean skip;
+        #pragma omp critical(ufraw_batch)
+        {
+            started++;
+            running++;
+            inFlight = MIN(jobs, running + fileCount - started);
+            skip = aborted;
+            if (!skip)
+                ufraw_batch_prefetch(prefetch, i + jobs + prefetchCount);
+        }
+        omp_set_num_threads(MAX(threads / inFlight, 1));
+        ufraw_message_thread_begin(TRUE);
+        if (!skip)
+            status = ufraw_batch_convert(files[i], rc, conf, cmd,
+                                         i + 1, fileCount);
+        char *text = ufraw_message_thread_end();
+        #pragma omp critical(ufraw_batch)
+        {
+            running--;
+            if (status < 0) aborted = TRUE;
+            output[i] = text;
+            done[i] = TRUE;
+            for (; printed < fileCount && done[printed]; printed++) {
+                if (output[printed] != NULL)
+                    g_printerr("%s", output[printed]);
+                g_free(output[printed]);
+            }
+        }
+        exitCode |= status != 0;
+    }
+    ufraw_batch_threads_end(locale);
+    g_free(output);
+    g_free(done);
+    return exitCode;
+}
+#endif
 
 int ufraw_batch_saver(ufraw_data *uf)
 {
@@ -123,7 +588,12 @@ int ufraw_batch_saver(ufraw_data *uf)
         gchar *yChar = g_utf8_strdown(_("y"), -1);
         /* First letter of the word 'no' for the y/n question */
         gchar *nChar = g_utf8_strup(_("n"), -1);
-        if (!silentMessenger) {
+        ans[0] = '\0';
+        if (batchJobs) {
+            ufraw_message(UFRAW_WARNING,
+                          _("%s exists, use --overwrite to replace it."),
+                          uf->conf->outputFilename);
+        } else if (!silentMessenger) {
             g_printerr(_("%s: overwrite '%s'?"), ufraw_binary,
                        uf->conf->outputFilename);
             g_printerr(" [%s/%s] ", yChar, nChar);
@@ -78,6 +78,21 @@ int main(int argc, char **argv)
                       _("The --embedded-image option is only valid with 'ufraw-batch'"));
         optInd = -1;
     }
+    if (cmd.jobs != 1) {
+        ufraw_message(UFRAW_ERROR,
+                      _("The --jobs option is only valid with 'ufraw-batch'"));
+        optInd = -1;
+    }
+    if (cmd.prefetch != conf_default.prefetch) {
+        ufraw_message(UFRAW_ERROR,
+                      _("The --prefetch option is only valid with 'ufraw-batch'"));
+        optInd = -1;
+    }
+    if (strlen(cmd.serveSocket) > 0) {
+        ufraw_message(UFRAW_ERROR,
+                      _("The --serve option is only valid with 'ufraw-batch'"));
+        optInd = -1;
+    }
     if (optInd < 0) {
 #ifndef _WIN32
         gdk_threads_leave();
@@ -148,6 +163,7 @@ int main(int argc, char **argv)
 //    ufraw_close(cmd.darkframe);
     ufobject_delete(cmd.ufobject);
     ufobject_delete(rc.ufobject);
+    ufraw_release_buffers();
 #ifndef _WIN32
     gdk_threads_leave();
 #endif
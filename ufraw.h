@@ -115,8 +115,8 @@ enum { linear_histogram, log_histogram };
  * in dcraw_api.h. */
 enum { ahd_interpolation, vng_interpolation, four_color_interpolation,
        ppg_interpolation, bilinear_interpolation, xtrans_interpolation,
-       none_interpolation, half_interpolation, obsolete_eahd_interpolation,
-       num_interpolations
+       none_interpolation, draft_interpolation, half_interpolation,
+       obsolete_eahd_interpolation, num_interpolations
      };
 enum { no_id, also_id, only_id, send_id };
 enum { manual_curve, linear_curve, custom_curve, camera_curve };
@@ -177,6 +177,7 @@ typedef struct {
     void *colorTransform;
     void *working2displayTransform;
     void *rgbtolabTransform;
+    void *lut; /* 3D LUT of the whole develop() chain, or NULL */
     double saturation;
 #ifdef UFRAW_CONTRAST
     double contrast;
@@ -263,6 +264,7 @@ typedef struct {
     Intent intent[profile_types];
     int interpolation;
     int smoothing;
+    gboolean smoothingBuffered; /* Smooth each pass from a copy of the last */
     char darkframeFile[max_path];
     struct ufraw_struct *darkframe;
     int CropX1, CropY1, CropX2, CropY2;
@@ -286,6 +288,7 @@ typedef struct {
     int shrink, size;
     gboolean overwrite, losslessCompress, embeddedImage, noExit;
     gboolean rotate;
+    gboolean developLUT; /* Develop through a 3D LUT (see developer_prepare) */
 
     /* GUI settings */
     double Zoom;
@@ -301,6 +304,9 @@ typedef struct {
     char curvePath[max_path];
     char profilePath[max_path];
     gboolean silent;
+    int jobs;
+    int prefetch;
+    char serveSocket[max_path];
     char remoteGimpCommand[max_path];
 
     /* EXIF data */
@@ -316,15 +322,25 @@ typedef struct {
     char real_make[max_name], real_model[max_name];
 } conf_data;
 
+/* Default size of the subareas of ufraw_image_data, the environment
+ * variable UFRAW_SUBAREA_SIZE overrides it */
+#define UFRAW_DEFAULT_SUBAREA_SIZE 256
+
+typedef enum { ufraw_tile_dirty, ufraw_tile_busy, ufraw_tile_valid }
+ufraw_tile_state;
+
 typedef struct {
     guint8 *buffer;
     int height, width, depth, rowstride;
-    /* This bit field marks valid pieces of the image with 1's.
-       The variable contains a fixed 4x8 matrix of bits, every bit containing
-       the validity of the respective subarea of the whole image. The subarea
-       sizes are determined by dividing the width by 4 and height by 8.
-       This field must always contain at least 32 bits. */
-    guint32 valid;
+    /* The image is divided into a grid of tilesX x tilesY subareas of
+       tileSize x tileSize pixels, numbered row by row. 'tiles' holds the
+       ufraw_tile_state of each subarea and 'valid' counts the valid ones.
+       Both are changed atomically, so threads can claim subareas to
+       convert. The grid follows the image size, the tile size can be
+       changed before the first conversion. */
+    int tileSize, tilesX, tilesY;
+    gint *tiles;
+    gint valid;
     gboolean rgbg;
     gboolean invalidate_event;
 } ufraw_image_data;
@@ -338,6 +354,12 @@ typedef struct ufraw_struct {
     int autoCropHeight, autoCropWidth;
     gboolean LoadingID; /* Indication that we are loading an ID file */
     gboolean WBDirty;
+    /* The transform phase is rendered row by row while saving */
+    gboolean streamTransform;
+    /* While saving, the first phase may only hold the part of the image
+     * needed for the crop. This is its place in the whole image, or it
+     * has a zero width if the whole image is held. */
+    UFRectangle firstRegion;
     float rgb_cam[3][4];
     ufraw_image_data Images[ufraw_phases_num];
     ufraw_image_data thumb;
@@ -363,6 +385,11 @@ typedef struct ufraw_struct {
     int modFlags; /* postprocessing operations (LF_MODIFY_XXX) */
     struct lfModifier *TCAmodifier;
     struct lfModifier *modifier;
+    /* What the modifiers are made of, see ufraw_lensfun.cc */
+    char *TCAmodifierKey;
+    char *modifierKey;
+    /* The source coordinates of the transform phase, see ufraw_ufraw.c */
+    struct ufraw_coord_map *transformMap;
 #endif /* HAVE_LENSFUN */
     int hotpixels;
     gboolean mark_hotpixels;
@@ -391,12 +418,18 @@ int ufraw_load_raw(ufraw_data *uf);
 int ufraw_load_darkframe(ufraw_data *uf);
 void ufraw_developer_prepare(ufraw_data *uf, DeveloperMode mode);
 int ufraw_convert_image(ufraw_data *uf);
+int ufraw_convert_image_for_saving(ufraw_data *uf);
+void ufraw_convert_image_transform_area(ufraw_data *uf, UFRectangle *area,
+                                        guint8 *dest, int rowstride);
 ufraw_image_data *ufraw_get_image(ufraw_data *uf, UFRawPhase phase,
                                   gboolean bufferok);
 ufraw_image_data *ufraw_convert_image_area(ufraw_data *uf, unsigned saidx,
         UFRawPhase phase);
+void ufraw_convert_image_first_tiles(ufraw_data *uf, unsigned saidx);
+void ufraw_convert_image_subareas(ufraw_data *uf, UFRawPhase phase);
 void ufraw_close_darkframe(conf_data *uf);
 void ufraw_close(ufraw_data *uf);
+void ufraw_release_buffers();
 void ufraw_flip_orientation(ufraw_data *uf, int flip);
 void ufraw_flip_image(ufraw_data *uf, int flip);
 void ufraw_invalidate_layer(ufraw_data *uf, UFRawPhase phase);
@@ -416,10 +449,19 @@ void ufraw_unnormalize_rotation(ufraw_data *uf);
 void ufraw_get_image_dimensions(ufraw_data *uf);
 /* Get scaled crop coordinates in final image coordinates */
 void ufraw_get_scaled_crop(ufraw_data *uf, UFRectangle *crop);
+/* Bilinear interpolation of the transform phase */
+void ufraw_interpolate_pixel_linearly(ufraw_image_data *image, float x,
+                                      float y, ufraw_image_type *dst, int color);
+void ufraw_interpolate_row_linearly(ufraw_image_data *image,
+                                    const float *coord, int width, int x0, int y0, ufraw_image_type *dst);
 
 UFRectangle ufraw_image_get_subarea_rectangle(ufraw_image_data *img,
         unsigned saidx);
 unsigned ufraw_img_get_subarea_idx(ufraw_image_data *img, int x, int y);
+int ufraw_image_subareas(ufraw_image_data *img);
+gboolean ufraw_image_subarea_dirty(ufraw_image_data *img, unsigned saidx);
+gboolean ufraw_image_subarea_valid(ufraw_image_data *img, unsigned saidx);
+gboolean ufraw_image_valid(ufraw_image_data *img);
 
 /* prototypes for functions in ufraw_message.c */
 char *ufraw_get_message(ufraw_data *uf);
@@ -434,6 +476,8 @@ int ufraw_is_error(ufraw_data *uf);
 // Old error handling, should be removed after being fully implemented.
 char *ufraw_message(int code, const char *format, ...);
 void ufraw_batch_messenger(char *message);
+void ufraw_message_thread_begin(gboolean capture);
+char *ufraw_message_thread_end();
 
 /* prototypes for functions in ufraw_preview.c */
 int ufraw_preview(ufraw_data *uf, conf_data *rc, int plugin,
@@ -88,6 +88,7 @@ const conf_data conf_default = {
     },
     { 0, 0, 0 }, /* intent */
     ahd_interpolation, 0, /* interpolation, smoothing */
+    FALSE, /* smoothingBuffered */
     "", NULL, /* darkframeFile, darkframe */
     -1, -1, -1, -1, /* Crop X1,Y1,X2,Y2 */
     0.0, /* aspectRatio */
@@ -117,6 +118,7 @@ const conf_data conf_default = {
     FALSE, /* load embedded preview image */
     FALSE, /* noExit */
     TRUE, /* rotate to camera's setting */
+    FALSE, /* developLUT */
 
     /* GUI settings */
     25.0, TRUE, /* Zoom, LockAspect */
@@ -133,6 +135,9 @@ const conf_data conf_default = {
     0, /* number of helper lines to draw */
     "", "", /* curvePath, profilePath */
     FALSE, /* silent */
+    1, /* jobs */
+    2, /* prefetch */
+    "", /* serveSocket */
 #ifdef _WIN32
     "gimp-win-remote gimp-2.8.exe", /* remoteGimpCommand */
 #elif HAVE_GIMP_2_4
@@ -153,8 +158,8 @@ const conf_data conf_default = {
 };
 
 static const char *interpolationNames[] = {
-    "ahd", "vng", "four-color", "ppg", "bilinear", "xtrans", "none", "half",
-    "eahd", NULL
+    "ahd", "vng", "four-color", "ppg", "bilinear", "xtrans", "none", "draft",
+    "half", "eahd", NULL
 };
 static const char *restoreDetailsNames[] =
 { "clip", "lch", "hsv", NULL };
@@ -634,6 +639,8 @@ static void conf_parse_text(GMarkupParseContext *context, const gchar *text,
     }
     if (!strcmp("ColorSmoothing", element))
         sscanf(temp, "%d", &c->smoothing);
+    if (!strcmp("ColorSmoothingBuffered", element))
+        sscanf(temp, "%d", &c->smoothingBuffered);
     if (!strcmp("RawExpander", element))
         sscanf(temp, "%d", &c->expander[raw_expander]);
     if (!strcmp("LiveExpander", element))
@@ -1012,6 +1019,10 @@ int conf_save(conf_data *c, char *IDFilename, char **confBuffer)
     if (c->smoothing != conf_default.smoothing)
         buf = uf_markup_buf(buf, "<ColorSmoothing>%d</ColorSmoothing>\n",
                             c->smoothing);
+    if (c->smoothingBuffered != conf_default.smoothingBuffered)
+        buf = uf_markup_buf(buf,
+                            "<ColorSmoothingBuffered>%d</ColorSmoothingBuffered>\n",
+                            c->smoothingBuffered);
     UFObject *image;
     if (ufobject_name(c->ufobject) == ufRawImage)
         image = c->ufobject;
@@ -1327,6 +1338,7 @@ void conf_copy_image(conf_data *dst, const conf_data *src)
 
     dst->interpolation = src->interpolation;
     dst->smoothing = src->smoothing;
+    dst->smoothingBuffered = src->smoothingBuffered;
     /* make and model are 'part of' ChanMul,
      * since on different make and model ChanMul are meaningless */
     g_strlcpy(dst->make, src->make, max_name);
@@ -1482,6 +1494,7 @@ void conf_copy_save(conf_data *dst, const conf_data *src)
     dst->losslessCompress = src->losslessCompress;
     dst->embeddedImage = src->embeddedImage;
     dst->noExit = src->noExit;
+    dst->developLUT = src->developLUT;
 }
 
 int conf_set_cmd(conf_data *conf, const conf_data *cmd)
@@ -1500,6 +1513,7 @@ int conf_set_cmd(conf_data *conf, const conf_data *cmd)
     if (cmd->embedExif != -1) conf->embedExif = cmd->embedExif;
     if (cmd->embeddedImage != -1) conf->embeddedImage = cmd->embeddedImage;
     if (cmd->noExit != -1) conf->noExit = cmd->noExit;
+    if (cmd->developLUT != -1) conf->developLUT = cmd->developLUT;
     if (cmd->rotate != -1) conf->rotate = cmd->rotate;
     if (cmd->rotationAngle != NULLF) conf->rotationAngle = cmd->rotationAngle;
     if (cmd->autoCrop != -1)
@@ -1561,6 +1575,8 @@ int conf_set_cmd(conf_data *conf, const conf_data *cmd)
         conf->autoBlack = disabled_state;
     }
     if (cmd->smoothing != -1) conf->smoothing = cmd->smoothing;
+    if (cmd->smoothingBuffered != -1)
+        conf->smoothingBuffered = cmd->smoothingBuffered;
     if (cmd->interpolation >= 0) conf->interpolation = cmd->interpolation;
     if (cmd->interpolation == obsolete_eahd_interpolation) {
         conf->interpolation = ahd_interpolation;
@@ -1661,9 +1677,13 @@ char *helpText[] = {
     "                      Auto exposure or exposure correction in EV (default 0).\n"),
     N_("--black-point=auto|BLACK\n"
     "                      Auto black-point or black-point value (default 0).\n"),
-    N_("--interpolation=ahd|vng|four-color|ppg|bilinear\n"
+    N_("--interpolation=ahd|vng|four-color|ppg|bilinear|draft\n"
     "                      Interpolation algorithm to use (default ahd).\n"),
     N_("--color-smoothing     Apply color smoothing.\n"),
+    N_("--color-smoothing-buffered\n"
+    "                      Apply color smoothing, each pass to a copy of the\n"
+    "                      previous one. The result does not depend on the number\n"
+    "                      of threads, and saving may convert the image in bands.\n"),
     N_("--grayscale=none|lightness|luminance|value|mixer\n"
     "                      Grayscale conversion algorithm to use (default none).\n"),
     N_("--grayscale-mixer=RED,GREEN,BLUE\n"
@@ -1681,6 +1701,10 @@ char *helpText[] = {
     N_("--compression=VALUE   JPEG compression (0-100, default 85).\n"),
     N_("--[no]exif            Embed EXIF in output (default embed EXIF).\n"),
     N_("--[no]zip             Enable [disable] TIFF zip compression (default nozip).\n"),
+    N_("--develop-lut         Develop the unclipped pixels through a 3D lookup table\n"
+    "                      of the color pipeline. This is faster, but only an\n"
+    "                      approximation. Its color difference from the exact\n"
+    "                      pipeline is reported in batch mode.\n"),
     N_("--embedded-image      Extract the preview image embedded in the raw file\n"
     "                      instead of converting the raw image. This option\n"
     "                      is only valid with 'ufraw-batch'.\n"),
@@ -1703,6 +1727,20 @@ char *helpText[] = {
     N_("--maximize-window     Force window to be maximized.\n"),
     N_("--silent              Do not display any messages during conversion. This\n"
     "                      option is only valid with 'ufraw-batch'.\n"),
+    N_("--jobs=N              Convert up to N files at the same time, sharing the\n"
+    "                      processor threads between them (default 1). This\n"
+    "                      option is only valid with 'ufraw-batch'.\n"),
+    N_("--prefetch=K          Read the next K input files in the background while\n"
+    "                      converting (default 2, 0 to disable). This option is\n"
+    "                      only valid with 'ufraw-batch'.\n"),
+    N_("--serve=SOCKET        Wait for conversion jobs on the Unix domain socket\n"
+    "                      SOCKET. A job is the command line of one ufraw-batch\n"
+    "                      run, one argument per line, ended by an empty line.\n"
+    "                      The reply is the conversion messages followed by the\n"
+    "                      line 'STATUS n' with the exit code of the job. Up to\n"
+    "                      --jobs jobs run at the same time. Only the user\n"
+    "                      running the server can connect to SOCKET. This option\n"
+    "                      is only valid with 'ufraw-batch'.\n"),
     "\n",
     N_("UFRaw first reads the setting from the resource file $HOME/.ufrawrc.\n"
     "Then, if an ID file is specified, its setting are read. Next, the setting from\n"
@@ -1798,7 +1836,7 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
            *createIDName = NULL, *outPath = NULL, *output = NULL, *conf = NULL,
             *interpolationName = NULL, *darkframeFile = NULL,
              *restoreName = NULL, *clipName = NULL, *grayscaleName = NULL,
-              *grayscaleMixer = NULL;
+              *grayscaleMixer = NULL, *serve = NULL;
     static const struct option options[] = {
         { "wb", 1, 0, 'w'},
         { "temperature", 1, 0, 't'},
@@ -1841,15 +1879,20 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
         { "crop-right", 1, 0, '3'},
         { "crop-bottom", 1, 0, '4'},
         { "aspect-ratio", 1, 0, 'P'},
+        { "jobs", 1, 0, 'J'},
+        { "prefetch", 1, 0, 'K'},
+        { "serve", 1, 0, 'V'},
         /* Binary flags that don't have a value are here at the end */
         { "zip", 0, 0, 'z'},
         { "nozip", 0, 0, 'Z'},
         { "overwrite", 0, 0, 'O'},
         { "color-smoothing", 0, 0, 'M' },
+        { "color-smoothing-buffered", 0, 0, 'N' },
         { "maximize-window", 0, 0, 'W'},
         { "exif", 0, 0, 'E'},
         { "noexif", 0, 0, 'F'},
         { "embedded-image", 0, 0, 'm'},
+        { "develop-lut", 0, 0, 'U'},
         { "silent", 0, 0, 'q'},
         { "help", 0, 0, 'h'},
         { "version", 0, 0, 'v'},
@@ -1880,7 +1923,7 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
         &createIDName, &outPath, &output, &darkframeFile,
         &restoreName, &clipName, &conf,
         &cmd->CropX1, &cmd->CropY1, &cmd->CropX2, &cmd->CropY2,
-        &cmd->aspectRatio
+        &cmd->aspectRatio, &cmd->jobs, &cmd->prefetch, &serve
     };
     cmd->autoExposure = disabled_state;
     cmd->autoBlack = disabled_state;
@@ -1891,7 +1934,10 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
     cmd->embedExif = -1;
     cmd->profile[1][0].BitDepth = -1;
     cmd->embeddedImage = FALSE;
+    cmd->developLUT = -1;
     cmd->silent = FALSE;
+    cmd->jobs = 1;
+    cmd->prefetch = conf_default.prefetch;
     cmd->profile[0][0].gamma = NULLF;
     cmd->profile[0][0].linear = NULLF;
     cmd->hotpixel = NULLF;
@@ -1915,6 +1961,7 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
     cmd->aspectRatio = 0.0;
     cmd->rotate = -1;
     cmd->smoothing = -1;
+    cmd->smoothingBuffered = -1;
 
     while (1) {
         c = getopt_long(*argc, *argv, "h", options, &index);
@@ -1972,6 +2019,8 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
             case '2':
             case '3':
             case '4':
+            case 'J':
+            case 'K':
                 locale = uf_set_locale_C();
                 if (sscanf(optarg, "%d", (int *)optPointer[index]) == 0) {
                     ufraw_message(UFRAW_ERROR,
@@ -1998,6 +2047,7 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
             case 'u':
             case 'Y':
             case 'a':
+            case 'V':
                 *(char **)optPointer[index] = optarg;
                 break;
             case 'O':
@@ -2009,9 +2059,16 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
             case 'm':
                 cmd->embeddedImage = TRUE;
                 break;
+            case 'U':
+                cmd->developLUT = TRUE;
+                break;
             case 'M':
                 cmd->smoothing = TRUE;
                 break;
+            case 'N':
+                cmd->smoothing = TRUE;
+                cmd->smoothingBuffered = TRUE;
+                break;
             case 'q':
                 cmd->silent = TRUE;
                 break;
@@ -2075,6 +2132,18 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
                 return -1;
         }
     }
+    if (cmd->jobs < 1) {
+        ufraw_message(UFRAW_ERROR,
+                      _("'%d' is not a valid value for the --%s option."),
+                      cmd->jobs, "jobs");
+        return -1;
+    }
+    if (cmd->prefetch < 0) {
+        ufraw_message(UFRAW_ERROR,
+                      _("'%d' is not a valid value for the --%s option."),
+                      cmd->prefetch, "prefetch");
+        return -1;
+    }
     cmd->BaseCurveIndex = -1;
     if (baseCurveFile != NULL) {
         baseCurveFile = uf_win32_locale_to_utf8(baseCurveFile);
@@ -2449,6 +2518,12 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
         g_strlcpy(cmd->darkframeFile, df, max_path);
         g_free(df);
     }
+    g_strlcpy(cmd->serveSocket, "", max_path);
+    if (serve != NULL) {
+        serve = uf_win32_locale_to_utf8(serve);
+        g_strlcpy(cmd->serveSocket, serve, max_path);
+        uf_win32_locale_free(serve);
+    }
     /* cmd->inputFilename is used to store the conf file */
     g_strlcpy(cmd->inputFilename, "", max_path);
     if (conf != NULL)
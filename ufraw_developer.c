@@ -30,6 +30,98 @@ static void lcms_message(cmsContext ContextID,
     ufraw_message(UFRAW_ERROR, "%s", ErrorText);
 }
 
+/*
+ * lcms precalculates the whole pipeline when a transform is created, which
+ * takes longer than developing a small image. Transforms are therefore kept
+ * in a small cache keyed by the MD5 of their profiles, so that developers
+ * with the same settings (the files of a batch or of a conversion server)
+ * share them. Shared transforms are only used by cmsDoTransform(), which
+ * can be called from several threads at once.
+ */
+#define transform_cache_size 8
+typedef struct {
+    int count, intent;
+    cmsUInt32Number inputFormat, outputFormat;
+    cmsUInt8Number id[5][16];
+} transform_key;
+
+static struct {
+    transform_key key;
+    cmsHTRANSFORM transform;
+    int refCount;
+    unsigned lastUse;
+} transformCache[transform_cache_size];
+static unsigned transformCacheClock;
+G_LOCK_DEFINE_STATIC(transformCache);
+
+static cmsHTRANSFORM developer_transform_new(cmsHPROFILE prof[], int count,
+        cmsUInt32Number inputFormat, cmsUInt32Number outputFormat, int intent)
+{
+    transform_key key;
+    cmsHTRANSFORM transform;
+    gboolean cache = count <= 5;
+    int i, slot;
+
+    memset(&key, 0, sizeof(key));
+    key.count = count;
+    key.intent = intent;
+    key.inputFormat = inputFormat;
+    key.outputFormat = outputFormat;
+    for (i = 0; i < count && cache; i++) {
+        cache = cmsMD5computeID(prof[i]);
+        cmsGetHeaderProfileID(prof[i], key.id[i]);
+    }
+    if (cache) {
+        G_LOCK(transformCache);
+        for (i = 0; i < transform_cache_size; i++) {
+            if (transformCache[i].transform != NULL &&
+                    memcmp(&transformCache[i].key, &key, sizeof(key)) == 0) {
+                transformCache[i].refCount++;
+                transformCache[i].lastUse = ++transformCacheClock;
+                G_UNLOCK(transformCache);
+                return transformCache[i].transform;
+            }
+        }
+        G_UNLOCK(transformCache);
+    }
+    transform = cmsCreateMultiprofileTransform(prof, count,
+                inputFormat, outputFormat, intent, 0);
+    if (!cache || transform == NULL)
+        return transform;
+    /* Replace the least recently used transform that is not in use */
+    G_LOCK(transformCache);
+    for (i = 0, slot = -1; i < transform_cache_size; i++) {
+        if (transformCache[i].refCount > 0)
+            continue;
+        if (slot < 0 || transformCache[i].lastUse < transformCache[slot].lastUse)
+            slot = i;
+    }
+    if (slot >= 0) {
+        if (transformCache[slot].transform != NULL)
+            cmsDeleteTransform(transformCache[slot].transform);
+        transformCache[slot].key = key;
+        transformCache[slot].transform = transform;
+        transformCache[slot].refCount = 1;
+        transformCache[slot].lastUse = ++transformCacheClock;
+    }
+    G_UNLOCK(transformCache);
+    return transform;
+}
+
+static void developer_transform_free(cmsHTRANSFORM transform)
+{
+    int i;
+    if (transform == NULL) return;
+    G_LOCK(transformCache);
+    for (i = 0; i < transform_cache_size; i++)
+        if (transformCache[i].transform == transform) break;
+    if (i < transform_cache_size)
+        transformCache[i].refCount--;
+    G_UNLOCK(transformCache);
+    if (i == transform_cache_size)
+        cmsDeleteTransform(transform);
+}
+
 developer_data *developer_init()
 {
     int i;
@@ -61,6 +153,7 @@ developer_data *developer_init()
     d->colorTransform = NULL;
     d->working2displayTransform = NULL;
     d->rgbtolabTransform = NULL;
+    d->lut = NULL;
     d->grayscaleMode = -1;
     d->grayscaleMixer[0] = d->grayscaleMixer[1] = d->grayscaleMixer[2] = -1;
     for (i = 0; i < max_adjustments; i++) { /* Suppress valgrind error. */
@@ -83,26 +176,23 @@ void developer_destroy(developer_data *d)
     cmsFreeToneCurve(d->TransferFunction[1]);
     cmsCloseProfile(d->saturationProfile);
     cmsCloseProfile(d->adjustmentProfile);
-    if (d->colorTransform != NULL)
-        cmsDeleteTransform(d->colorTransform);
+    developer_transform_free(d->colorTransform);
     if (d->working2displayTransform != NULL)
         cmsDeleteTransform(d->working2displayTransform);
-    if (d->rgbtolabTransform != NULL)
-        cmsDeleteTransform(d->rgbtolabTransform);
+    developer_transform_free(d->rgbtolabTransform);
+    g_free(d->lut);
     g_free(d);
 }
 
 static const char *embedded_display_profile = "embedded display profile";
 
 /*
- * Emulates cmsTakeProductName() from lcms 1.x.
- *
- * This is tailored for use with statically allocated strings and not
- * thread-safe.
+ * Emulates cmsTakeProductName() from lcms 1.x, writing the name to
+ * productName[max_name] instead of a static buffer.
  */
-const char *cmsTakeProductName(cmsHPROFILE profile)
+static void developer_product_name(cmsHPROFILE profile, char productName[])
 {
-    static char name[max_name * 2 + 4];
+    char name[max_name * 2 + 4];
     char manufacturer[max_name], model[max_name];
 
     name[0] = manufacturer[0] = model[0] = '\0';
@@ -123,7 +213,7 @@ const char *cmsTakeProductName(cmsHPROFILE profile)
             sprintf(name, "%s - %s", model, manufacturer);
     }
 
-    return name;
+    g_strlcpy(productName, name, max_name);
 }
 
 /* Update the profile in the developer
@@ -150,8 +240,7 @@ void developer_profile(developer_data *d, int type, profile_data *p)
     }
     if (d->updateTransform) {
         if (d->profile[type] != NULL)
-            g_strlcpy(p->productName, cmsTakeProductName(d->profile[type]),
-                      max_name);
+            developer_product_name(d->profile[type], p->productName);
         else
             strcpy(p->productName, "");
     }
@@ -183,8 +272,7 @@ void developer_display_profile(developer_data *d,
     }
     if (d->updateTransform) {
         if (d->profile[type] != NULL)
-            g_strlcpy(productName, cmsTakeProductName(d->profile[type]),
-                      max_name);
+            developer_product_name(d->profile[type], productName);
         else
             strcpy(productName, "");
     }
@@ -399,6 +487,9 @@ static void developer_create_transform(developer_data *d, DeveloperMode mode)
     if (!d->updateTransform)
         return;
     d->updateTransform = FALSE;
+    /* The LUT samples colorTransform */
+    g_free(d->lut);
+    d->lut = NULL;
     /* Create transformations according to mode:
      * auto_developer|output_developer:
      *	    colorTransformation from in to out
@@ -418,8 +509,7 @@ static void developer_create_transform(developer_data *d, DeveloperMode mode)
     } else {
         targetProfile = out_profile;
     }
-    if (d->colorTransform != NULL)
-        cmsDeleteTransform(d->colorTransform);
+    developer_transform_free(d->colorTransform);
     if (strcmp(d->profileFile[in_profile], "") == 0 &&
             strcmp(d->profileFile[targetProfile], "") == 0 &&
             d->luminosityProfile == NULL &&
@@ -438,8 +528,8 @@ static void developer_create_transform(developer_data *d, DeveloperMode mode)
         if (d->saturationProfile != NULL)
             prof[i++] = d->saturationProfile;
         prof[i++] = d->profile[targetProfile];
-        d->colorTransform = cmsCreateMultiprofileTransform(prof, i,
-                            TYPE_RGB_16, TYPE_RGB_16, d->intent[out_profile], 0);
+        d->colorTransform = developer_transform_new(prof, i,
+                            TYPE_RGB_16, TYPE_RGB_16, d->intent[out_profile]);
     }
 
     if (d->working2displayTransform != NULL)
@@ -458,11 +548,13 @@ static void developer_create_transform(developer_data *d, DeveloperMode mode)
     }
 
     if (d->rgbtolabTransform == NULL) {
-        cmsHPROFILE labProfile = cmsCreateLab2Profile(cmsD50_xyY());
-        d->rgbtolabTransform = cmsCreateTransform(d->profile[in_profile],
-                               TYPE_RGB_16, labProfile,
-                               TYPE_Lab_16, INTENT_ABSOLUTE_COLORIMETRIC, 0);
-        cmsCloseProfile(labProfile);
+        cmsHPROFILE prof[2] = { d->profile[in_profile],
+                                cmsCreateLab2Profile(cmsD50_xyY())
+                              };
+        d->rgbtolabTransform = developer_transform_new(prof, 2,
+                               TYPE_RGB_16, TYPE_Lab_16,
+                               INTENT_ABSOLUTE_COLORIMETRIC);
+        cmsCloseProfile(prof[1]);
     }
 }
 
@@ -476,6 +568,216 @@ static gboolean test_adjustments(const lightness_adjustment values[max_adjustmen
     return FALSE;
 }
 
+/*
+ * With conf->developLUT, the whole develop() chain of the file developer,
+ * from the white balance to the color transform, is sampled into a 3D LUT
+ * which develop() interpolates tetrahedrally. Only pixels that are not
+ * clipped by the white balance are in the LUT, the others still take the
+ * exact path. The grid nodes are spaced by the gamma of the input profile,
+ * so that the shadows are sampled as finely as the highlights.
+ */
+#define develop_lut_size 33
+
+/* The settings of develop_linear() that the LUT depends on. Changes to
+ * gammaCurve and colorTransform free the LUT instead. */
+typedef struct {
+    unsigned max, exposure, useMatrix;
+    int restoreDetails, clipHighlights;
+    int rgbWB[4], colorMatrix[3][4];
+    GrayscaleMode grayscaleMode;
+    double grayscaleMixer[3];
+} develop_lut_key;
+
+typedef struct {
+    develop_lut_key key;
+    /* Inputs up to limit[c] are in the LUT */
+    int limit[3];
+    /* Grid position of each input value, with an 8 bit fraction */
+    guint16 pos[3][0x10000];
+    guint16 grid[develop_lut_size][develop_lut_size][develop_lut_size][3];
+} develop_lut;
+
+static void develop_exact(guint16 *buf, guint16 *pix, developer_data *d,
+                          int count)
+{
+    guint16 c, tmppix[3];
+    int i;
+    for (i = 0; i < count; i++) {
+        develop_linear(pix + i * 4, tmppix, d);
+        for (c = 0; c < 3; c++)
+            buf[i * 3 + c] = d->gammaCurve[tmppix[c]];
+    }
+    if (d->colorTransform != NULL)
+        cmsDoTransform(d->colorTransform, buf, buf, count);
+}
+
+static inline gboolean develop_lut_covers(const develop_lut *lut,
+        const guint16 pix[4])
+{
+    return pix[0] <= lut->limit[0] && pix[1] <= lut->limit[1] &&
+           pix[2] <= lut->limit[2];
+}
+
+static inline void develop_lut_pixel(const develop_lut *lut,
+                                     const guint16 pix[4], guint16 out[3])
+{
+    const int s0 = develop_lut_size * develop_lut_size * 3;
+    const int s1 = develop_lut_size * 3, s2 = 3;
+    int i[3], f[3], c, w0, w1, w2, w3, a, b;
+
+    for (c = 0; c < 3; c++) {
+        i[c] = lut->pos[c][pix[c]] >> 8;
+        f[c] = lut->pos[c][pix[c]] & 0xFF;
+        if (i[c] == develop_lut_size - 1) {
+            i[c]--;
+            f[c] = 0x100;
+        }
+    }
+    /* Walk from the lower to the upper corner of the cell along the
+     * edges of the tetrahedron that contains the pixel. */
+    if (f[0] >= f[1]) {
+        if (f[1] >= f[2]) {
+            a = s0, b = s0 + s1;
+            w0 = 0x100 - f[0], w1 = f[0] - f[1], w2 = f[1] - f[2], w3 = f[2];
+        } else if (f[0] >= f[2]) {
+            a = s0, b = s0 + s2;
+            w0 = 0x100 - f[0], w1 = f[0] - f[2], w2 = f[2] - f[1], w3 = f[1];
+        } else {
+            a = s2, b = s0 + s2;
+            w0 = 0x100 - f[2], w1 = f[2] - f[0], w2 = f[0] - f[1], w3 = f[1];
+        }
+    } else {
+        if (f[0] >= f[2]) {
+            a = s1, b = s0 + s1;
+            w0 = 0x100 - f[1], w1 = f[1] - f[0], w2 = f[0] - f[2], w3 = f[2];
+        } else if (f[1] >= f[2]) {
+            a = s1, b = s1 + s2;
+            w0 = 0x100 - f[1], w1 = f[1] - f[2], w2 = f[2] - f[0], w3 = f[0];
+        } else {
+            a = s2, b = s1 + s2;
+            w0 = 0x100 - f[2], w1 = f[2] - f[1], w2 = f[1] - f[0], w3 = f[0];
+        }
+    }
+    const guint16 *p = lut->grid[i[0]][i[1]][i[2]];
+    for (c = 0; c < 3; c++)
+        out[c] = (p[c] * w0 + p[a + c] * w1 + p[b + c] * w2 +
+                  p[s0 + s1 + s2 + c] * w3 + 0x80) >> 8;
+}
+
+/* Report the color difference between the LUT and the exact path in the
+ * middle of the grid cells, where the interpolation is least accurate. */
+static void develop_lut_report(const develop_lut *lut, developer_data *d,
+                               int node[3][develop_lut_size])
+{
+    const int n = develop_lut_size - 1, count = n * n * n;
+    guint16 *pix = g_new(guint16, count * 4);
+    guint16 *exact = g_new(guint16, count * 3);
+    guint16 *approx = g_new(guint16, count * 3);
+    cmsCIELab *lab = g_new(cmsCIELab, count * 2);
+    double deltaE, sum = 0, max = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        int k[3] = { i / (n * n), i / n % n, i % n }, c;
+        for (c = 0; c < 3; c++)
+            pix[i * 4 + c] = (node[c][k[c]] + node[c][k[c] + 1]) / 2;
+        pix[i * 4 + 3] = 0;
+        develop_lut_pixel(lut, pix + i * 4, approx + i * 3);
+    }
+    develop_exact(exact, pix, d, count);
+
+    cmsHPROFILE labProfile = cmsCreateLab4Profile(NULL);
+    cmsHTRANSFORM toLab = cmsCreateTransform(d->profile[out_profile],
+                          TYPE_RGB_16, labProfile, TYPE_Lab_DBL,
+                          INTENT_RELATIVE_COLORIMETRIC, 0);
+    cmsCloseProfile(labProfile);
+    if (toLab != NULL) {
+        cmsDoTransform(toLab, exact, lab, count);
+        cmsDoTransform(toLab, approx, lab + count, count);
+        cmsDeleteTransform(toLab);
+        for (i = 0; i < count; i++) {
+            deltaE = cmsCIE2000DeltaE(&lab[i], &lab[count + i], 1, 1, 1);
+            sum += deltaE;
+            max = MAX(max, deltaE);
+        }
+        ufraw_message(UFRAW_BATCH_MESSAGE,
+                      "Develop LUT color difference (CIEDE2000): "
+                      "mean %.3f, maximum %.3f\n", sum / count, max);
+    }
+    g_free(lab);
+    g_free(approx);
+    g_free(exact);
+    g_free(pix);
+}
+
+static void developer_prepare_lut(developer_data *d, const conf_data *conf)
+{
+    const int n = develop_lut_size, count = n * n * n;
+    develop_lut *lut = d->lut;
+    develop_lut_key key;
+    int node[3][develop_lut_size];
+    int c, i, k, v;
+
+    if (!conf->developLUT || d->mode != file_developer || d->colors != 3) {
+        g_free(d->lut);
+        d->lut = NULL;
+        return;
+    }
+    memset(&key, 0, sizeof(key));
+    key.max = d->max;
+    key.exposure = d->exposure;
+    key.useMatrix = d->useMatrix;
+    key.restoreDetails = d->restoreDetails;
+    key.clipHighlights = d->clipHighlights;
+    memcpy(key.rgbWB, d->rgbWB, sizeof(key.rgbWB));
+    memcpy(key.colorMatrix, d->colorMatrix, sizeof(key.colorMatrix));
+    key.grayscaleMode = d->grayscaleMode;
+    memcpy(key.grayscaleMixer, d->grayscaleMixer, sizeof(key.grayscaleMixer));
+    if (lut != NULL && memcmp(&lut->key, &key, sizeof(key)) == 0)
+        return;
+
+    if (lut == NULL)
+        lut = d->lut = g_new(develop_lut, 1);
+    lut->key = key;
+    double power = d->gamma > 0 ? CLAMP(1 / d->gamma, 1.0, 3.0) : 1.0;
+    for (c = 0; c < 3; c++) {
+        /* The largest input that develop_linear() does not clip */
+        if (d->restoreDetails == clip_details)
+            lut->limit[c] = 0xFFFF;
+        else
+            lut->limit[c] = MIN((((gint64)d->max + 1) * 0x10000 - 1) /
+                                d->rgbWB[c], 0xFFFF);
+        if (lut->limit[c] < 4 * n) {
+            g_free(d->lut);
+            d->lut = NULL;
+            return;
+        }
+        for (k = 0; k < n; k++) {
+            node[c][k] = floor(lut->limit[c] * pow((double)k / (n - 1), power) + 0.5);
+            if (k > 0 && node[c][k] <= node[c][k - 1])
+                node[c][k] = node[c][k - 1] + 1;
+        }
+        for (k = 0, v = 0; k < n - 1; k++) {
+            int span = node[c][k + 1] - node[c][k];
+            for (; v < node[c][k + 1]; v++)
+                lut->pos[c][v] = k * 0x100 +
+                                 ((v - node[c][k]) * 0x100 + span / 2) / span;
+        }
+        for (; v < 0x10000; v++)
+            lut->pos[c][v] = (n - 1) * 0x100;
+    }
+    guint16 *pix = g_new(guint16, count * 4);
+    for (i = 0; i < count; i++) {
+        pix[i * 4 + 0] = node[0][i / (n * n)];
+        pix[i * 4 + 1] = node[1][i / n % n];
+        pix[i * 4 + 2] = node[2][i % n];
+        pix[i * 4 + 3] = 0;
+    }
+    develop_exact(&lut->grid[0][0][0][0], pix, d, count);
+    g_free(pix);
+    develop_lut_report(lut, d, node);
+}
+
 void developer_prepare(developer_data *d, conf_data *conf,
                        int rgbMax, float rgb_cam[3][4], int colors, int useMatrix,
                        DeveloperMode mode)
@@ -560,6 +862,9 @@ void developer_prepare(developer_data *d, conf_data *conf,
             exposure != d->exposure || clipHighlights != d->clipHighlights ||
             memcmp(baseCurve, &d->baseCurveData, sizeof(CurveData)) != 0) {
         d->baseCurveData = *baseCurve;
+        /* The LUT samples gammaCurve */
+        g_free(d->lut);
+        d->lut = NULL;
         guint16 BaseCurve[0x10000];
         CurveSample *cs = CurveSampleInit(0x10000, 0x10000);
         ufraw_message(UFRAW_RESET, NULL);
@@ -694,6 +999,7 @@ void developer_prepare(developer_data *d, conf_data *conf,
         d->updateTransform = TRUE;
     }
     developer_create_transform(d, mode);
+    developer_prepare_lut(d, conf);
 }
 
 static void apply_matrix(const developer_data *d,
@@ -851,9 +1157,29 @@ static void MaxMidMin(const gint64 p[3], int *maxc, int *midc, int *minc)
     *minc = min;
 }
 
+/* Develop 'count' pixels into 16 bit 'buf', through the LUT if there is one */
+static void develop_pixels(guint16 *buf, guint16 *pix, developer_data *d,
+                           int count)
+{
+    const develop_lut *lut = d->lut;
+    int i, j;
+
+    if (lut == NULL) {
+        develop_exact(buf, pix, d, count);
+        return;
+    }
+    for (i = 0; i < count; i = j) {
+        for (; i < count && develop_lut_covers(lut, pix + i * 4); i++)
+            develop_lut_pixel(lut, pix + i * 4, buf + i * 3);
+        for (j = i; j < count && !develop_lut_covers(lut, pix + j * 4); j++);
+        if (j > i)
+            develop_exact(buf + i * 3, pix + i * 4, d, j - i);
+    }
+}
+
 void develop(void *po, guint16 pix[4], developer_data *d, int mode, int count)
 {
-    guint16 c, tmppix[3], *buf;
+    guint16 *buf;
     int i;
     if (mode == 16) buf = po;
     else buf = g_alloca(count * 6);
@@ -862,29 +1188,16 @@ void develop(void *po, guint16 pix[4], developer_data *d, int mode, int count)
     #pragma omp parallel				\
     if (count > 16)				\
         default(none)				\
-        shared(d, buf, count, pix)			\
-        private(i, tmppix, c)
+        shared(d, buf, count, pix)
     {
         int chunk = count / omp_get_num_threads() + 1;
         int offset = chunk * omp_get_thread_num();
         int width = (chunk > count - offset) ? count - offset : chunk;
-        for (i = offset; i < offset + width; i++) {
-            develop_linear(pix + i * 4, tmppix, d);
-            for (c = 0; c < 3; c++)
-                buf[i * 3 + c] = d->gammaCurve[tmppix[c]];
-        }
-        if (d->colorTransform != NULL)
-            cmsDoTransform(d->colorTransform,
-                           buf + offset * 3, buf + offset * 3, width);
+        if (width > 0)
+            develop_pixels(buf + offset * 3, pix + offset * 4, d, width);
     }
 #else
-    for (i = 0; i < count; i++) {
-        develop_linear(pix + i * 4, tmppix, d);
-        for (c = 0; c < 3; c++)
-            buf[i * 3 + c] = d->gammaCurve[tmppix[c]];
-    }
-    if (d->colorTransform != NULL)
-        cmsDoTransform(d->colorTransform, buf, buf, count);
+    develop_pixels(buf, pix, d, count);
 #endif
 
     if (mode != 16) {
@@ -26,6 +26,8 @@
 #define UF_LF_TRANSFORM ( \
 	LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE)
 
+G_LOCK_DEFINE_STATIC(LensDB);
+
 namespace UFRaw
 {
 
@@ -64,11 +66,13 @@ public:
         return Lensfun::Parent(object.Parent());
     }
     static lfDatabase *LensDB() {
-        /* Load lens database only once */
+        /* Load lens database only once, batch jobs may ask concurrently */
+        G_LOCK(LensDB);
         if (_LensDB == NULL) {
             _LensDB = lfDatabase::Create();
             _LensDB->Load();
         }
+        G_UNLOCK(LensDB);
         return _LensDB;
     }
     void SetCamera(const lfCamera &camera) {
@@ -812,6 +816,53 @@ void Lensfun::Init(bool reset)
     (*this)[ufDistortion].Reset();
 }
 
+static const char *MLstr(const lfMLstr str)
+{
+    const char *value = lf_mlstr_get(str);
+    return value != NULL ? value : "";
+}
+
+// Describe what a modifier is made of: the camera, the lens with the
+// distortion or TCA calibration in use, and the values the modifier is
+// initialized with. The coordinate maps of ufraw_ufraw.c are keyed on it.
+static char *ModifierKey(Lensfun &Lensfun, bool tca, int width, int height,
+                         float scale, int target, int flags, bool reverse)
+{
+    const lfCamera &camera = Lensfun.Camera;
+    const lfLens &lens = Lensfun.Transformation;
+    const lfParameter **params;
+    GString *key = g_string_new(NULL);
+    g_string_append_printf(key, "%s|%s|%.9g|%s|%s|%d|%.9g|",
+                           MLstr(camera.Maker), MLstr(camera.Model),
+                           camera.CropFactor, MLstr(lens.Maker),
+                           MLstr(lens.Model), lens.Type, lens.CropFactor);
+    if (tca && lens.CalibTCA != NULL) {
+        for (int i = 0; lens.CalibTCA[i] != NULL; i++) {
+            const lfLensCalibTCA &calib = *lens.CalibTCA[i];
+            lfLens::GetTCAModelDesc(calib.Model, NULL, &params);
+            g_string_append_printf(key, "T%d %.9g", calib.Model, calib.Focal);
+            for (int j = 0; params != NULL && params[j] != NULL; j++)
+                g_string_append_printf(key, " %.9g", calib.Terms[j]);
+            g_string_append_c(key, '|');
+        }
+    }
+    if (!tca && lens.CalibDistortion != NULL) {
+        for (int i = 0; lens.CalibDistortion[i] != NULL; i++) {
+            const lfLensCalibDistortion &calib = *lens.CalibDistortion[i];
+            lfLens::GetDistortionModelDesc(calib.Model, NULL, &params);
+            g_string_append_printf(key, "D%d %.9g", calib.Model, calib.Focal);
+            for (int j = 0; params != NULL && params[j] != NULL; j++)
+                g_string_append_printf(key, " %.9g", calib.Terms[j]);
+            g_string_append_c(key, '|');
+        }
+    }
+    g_string_append_printf(key, "%.17g|%.17g|%.17g|%.9g|%d|%d|%d|%dx%d",
+                           Lensfun.FocalLengthValue, Lensfun.ApertureValue,
+                           Lensfun.DistanceValue, scale, target, flags,
+                           reverse, width, height);
+    return g_string_free(key, FALSE);
+}
+
 extern "C" {
 
     void ufraw_lensfun_init(UFObject *lensfun, UFBoolean reset)
@@ -851,7 +902,11 @@ extern "C" {
         if ((uf->modFlags & (UF_LF_TRANSFORM | LF_MODIFY_VIGNETTING)) == 0) {
             uf->modifier->Destroy();
             uf->modifier = NULL;
+            return;
         }
+        g_free(uf->modifierKey);
+        uf->modifierKey = ModifierKey(Lensfun, false, width, height, scale,
+                                      targetLensGeometry.Index(), uf->modFlags, reverse);
     }
 
     void ufraw_prepare_tca(ufraw_data *uf)
@@ -887,7 +942,11 @@ extern "C" {
         if ((modFlags & LF_MODIFY_TCA) == 0) {
             uf->TCAmodifier->Destroy();
             uf->TCAmodifier = NULL;
+            return;
         }
+        g_free(uf->TCAmodifierKey);
+        uf->TCAmodifierKey = ModifierKey(Lensfun, true, img->width, img->height,
+                                         1.0, targetLensGeometry.Index(), modFlags, false);
     }
 
     UFObject *ufraw_lensfun_new()
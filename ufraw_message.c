@@ -106,6 +106,51 @@ int ufraw_is_error(ufraw_data *uf)
 
 // Old error handling, should be removed after being fully implemented.
 
+typedef struct {
+    char *logBuffer;
+    char *errorBuffer;
+    gboolean errorFlag;
+    GString *output;
+} message_buffers;
+
+/* Threads converting files in parallel keep their own message buffers,
+ * see ufraw_message_thread_begin(). Other threads share one set. */
+#if GLIB_CHECK_VERSION(2,32,0)
+static GPrivate threadBuffers = G_PRIVATE_INIT(NULL);
+#define thread_buffers_get() ((message_buffers *)g_private_get(&threadBuffers))
+#define thread_buffers_set(b) g_private_set(&threadBuffers, (b))
+#else
+static GStaticPrivate threadBuffers = G_STATIC_PRIVATE_INIT;
+#define thread_buffers_get() \
+    ((message_buffers *)g_static_private_get(&threadBuffers))
+#define thread_buffers_set(b) g_static_private_set(&threadBuffers, (b), NULL)
+#endif
+
+/* Give the calling thread its own message buffers. If 'capture' is set,
+ * the batch messages it prints are collected instead of being written to
+ * stderr, so that they can be printed in order later. */
+void ufraw_message_thread_begin(gboolean capture)
+{
+    message_buffers *b = g_new0(message_buffers, 1);
+    if (capture) b->output = g_string_new(NULL);
+    thread_buffers_set(b);
+}
+
+/* Release the buffers of ufraw_message_thread_begin() and return the
+ * captured messages, which should be freed with g_free(). */
+char *ufraw_message_thread_end()
+{
+    message_buffers *b = thread_buffers_get();
+    char *output = NULL;
+    if (b == NULL) return NULL;
+    thread_buffers_set(NULL);
+    if (b->output != NULL) output = g_string_free(b->output, FALSE);
+    g_free(b->logBuffer);
+    g_free(b->errorBuffer);
+    g_free(b);
+    return output;
+}
+
 static char *ufraw_message_buffer(char *buffer, char *message)
 {
 #ifdef UFRAW_DEBUG
@@ -120,24 +165,33 @@ static char *ufraw_message_buffer(char *buffer, char *message)
 
 void ufraw_batch_messenger(char *message)
 {
+    message_buffers *b = thread_buffers_get();
+    GString *text = g_string_new(NULL);
     /* Print the 'ufraw:' header only if there are no newlines in the message
      * (not including possibly one at the end).
      * Otherwise, the header will be printed only for the first line. */
     if (g_strstr_len(message, strlen(message) - 1, "\n") == NULL)
-        g_printerr("%s: ", ufraw_binary);
-    g_printerr("%s%c", message, message[strlen(message) - 1] != '\n' ? '\n' : 0);
+        g_string_append_printf(text, "%s: ", ufraw_binary);
+    g_string_append(text, message);
+    if (message[strlen(message) - 1] != '\n')
+        g_string_append_c(text, '\n');
+    if (b != NULL && b->output != NULL)
+        g_string_append(b->output, text->str);
+    else
+        g_printerr("%s", text->str);
+    g_string_free(text, TRUE);
 }
 
 char *ufraw_message(int code, const char *format, ...)
 {
-    // TODO: The following static variables are not thread-safe
-    static char *logBuffer = NULL;
-    static char *errorBuffer = NULL;
-    static gboolean errorFlag = FALSE;
+    static message_buffers sharedBuffers = { NULL, NULL, FALSE, NULL };
+    // TODO: The following static variable is not thread-safe
     static void *parentWindow = NULL;
+    message_buffers *b = thread_buffers_get();
     char *message = NULL;
     void *saveParentWindow;
 
+    if (b == NULL) b = &sharedBuffers;
     if (code == UFRAW_SET_PARENT) {
         saveParentWindow = parentWindow;
         parentWindow = (void *)format;
@@ -151,27 +205,27 @@ char *ufraw_message(int code, const char *format, ...)
     }
     switch (code) {
         case UFRAW_SET_ERROR:
-            errorFlag = TRUE;
+            b->errorFlag = TRUE;
         case UFRAW_SET_WARNING:
-            errorBuffer = ufraw_message_buffer(errorBuffer, message);
+            b->errorBuffer = ufraw_message_buffer(b->errorBuffer, message);
         case UFRAW_SET_LOG:
         case UFRAW_DCRAW_SET_LOG:
-            logBuffer = ufraw_message_buffer(logBuffer, message);
+            b->logBuffer = ufraw_message_buffer(b->logBuffer, message);
             g_free(message);
             return NULL;
         case UFRAW_GET_ERROR:
-            if (!errorFlag) return NULL;
+            if (!b->errorFlag) return NULL;
         case UFRAW_GET_WARNING:
-            return errorBuffer;
+            return b->errorBuffer;
         case UFRAW_GET_LOG:
-            return logBuffer;
+            return b->logBuffer;
         case UFRAW_CLEAN:
-            g_free(logBuffer);
-            logBuffer = NULL;
+            g_free(b->logBuffer);
+            b->logBuffer = NULL;
         case UFRAW_RESET:
-            g_free(errorBuffer);
-            errorBuffer = NULL;
-            errorFlag = FALSE;
+            g_free(b->errorBuffer);
+            b->errorBuffer = NULL;
+            b->errorFlag = FALSE;
             return NULL;
         case UFRAW_BATCH_MESSAGE:
             if (parentWindow == NULL)
@@ -184,7 +238,7 @@ char *ufraw_message(int code, const char *format, ...)
             g_free(message);
             return NULL;
         case UFRAW_REPORT:
-            ufraw_messenger(errorBuffer, parentWindow);
+            ufraw_messenger(b->errorBuffer, parentWindow);
             return NULL;
         default:
             ufraw_messenger(message, parentWindow);
@@ -1008,16 +1008,12 @@ static gboolean render_preview_now(preview_data *data)
     data->FreezeDialog = FALSE;
     render_init(data);
 
-    /* This will trigger the untiled phases if necessary. The progress bar
-     * updates require gtk_main_iteration() calls which can only be
-     * done when there are no pending idle tasks which could recurse
-     * into ufraw_convert_image_area(). */
+    /* The untiled phases, if any, are triggered by render_preview_image()
+     * together with the first phase subareas it renders first. */
+    ufraw_image_data *img = ufraw_get_image(data->UF,
+                                            ufraw_display_phase, FALSE);
     preview_progress_enable(data);
-    data->FreezeDialog = TRUE;
-    ufraw_convert_image_area(data->UF, 0, ufraw_first_phase);
-    data->FreezeDialog = FALSE;
-
-    preview_progress(PROGRESS_RENDER, -32);
+    preview_progress(PROGRESS_RENDER, -ufraw_image_subareas(img));
     // Since we are already inside an idle callback, we should not use
     // gdk_threads_add_idle_full().
     g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
@@ -1131,7 +1127,7 @@ static gboolean render_raw_histogram(preview_data *data)
     return FALSE;
 }
 
-static int choose_subarea(preview_data *data, int *chosen)
+static int choose_subarea(preview_data *data, const int *chosen, int count)
 {
     int subarea = -1;
     int max_area = -1;
@@ -1146,16 +1142,16 @@ static int choose_subarea(preview_data *data, int *chosen)
     gtk_image_view_get_viewport(
         GTK_IMAGE_VIEW(data->PreviewWidget), &viewport);
 
-    int i;
-    for (i = 0; i < 32; i++) {
-        /* Skip valid subareas */
-        if (img->valid & (1 << i))
+    int i, j;
+    for (i = 0; i < ufraw_image_subareas(img); i++) {
+        /* Skip valid subareas and those claimed by threads */
+        if (!ufraw_image_subarea_dirty(img, i))
             continue;
-        /* Skip areas chosen by other threads */
-        if (*chosen & (1 << i))
+        /* Skip areas chosen for other threads */
+        for (j = 0; j < count && chosen[j] != i; j++);
+        if (j < count)
             continue;
 
-
         UFRectangle rec = ufraw_image_get_subarea_rectangle(img, i);
 
         gboolean noclip = TRUE;
@@ -1188,46 +1184,51 @@ static int choose_subarea(preview_data *data, int *chosen)
                 break;
         }
     }
-    if (subarea >= 0)
-        *chosen |= 1 << subarea;
     return subarea;
 }
 
 /*
- * render_preview_image() is called after all non-tiled phases are rendered.
+ * render_preview_image() renders a subarea with each thread, the most
+ * visible ones first.
  *
  * OpenMP notes:
  *
- * Unfortunately ufraw_convert_image_area() still has some OpenMP awareness
- * which is related to OpenMP here. That should not be necessary.
+ * The first phase subareas the chosen subareas need are converted
+ * beforehand, since the interpolation uses the threads itself. This also
+ * converts the untiled phases if necessary. The threads claim the
+ * subareas of the later phases, so those shared by several chosen
+ * subareas are converted only once. The progress bar updates
+ * require gtk_main_iteration() calls which can only be done when there
+ * are no pending idle tasks which could recurse into
+ * ufraw_convert_image_area(), hence the frozen dialog.
  */
 static gboolean render_preview_image(preview_data *data)
 {
     gboolean again = FALSE;
-    int chosen = 0;
 
     if (data->FreezeDialog) return FALSE;
     int subarea[uf_omp_get_max_threads()];
     int i;
-    for (i = 0; i < uf_omp_get_max_threads(); i++)
-        subarea[i] = -1;
-#ifdef _OPENMP
-    #pragma omp parallel shared(chosen,data) reduction(||:again)
-    {
-        #pragma omp critical
-#endif
-        subarea[uf_omp_get_thread_num()] = choose_subarea(data, &chosen);
-        if (subarea[uf_omp_get_thread_num()] < 0) {
+    for (i = 0; i < uf_omp_get_max_threads(); i++) {
+        subarea[i] = choose_subarea(data, subarea, i);
+        if (subarea[i] < 0)
             data->RenderSubArea = -1;
-        } else {
-            ufraw_convert_image_area(data->UF,
-                                     subarea[uf_omp_get_thread_num()], ufraw_phases_num - 1);
+        else
             again = TRUE;
-        }
-
-#ifdef _OPENMP
     }
+    data->FreezeDialog = TRUE;
+    for (i = 0; i < uf_omp_get_max_threads(); i++)
+        if (subarea[i] >= 0)
+            ufraw_convert_image_first_tiles(data->UF, subarea[i]);
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static, 1) shared(data, subarea)
 #endif
+    for (i = 0; i < uf_omp_get_max_threads(); i++)
+        if (subarea[i] >= 0)
+            ufraw_convert_image_area(data->UF, subarea[i],
+                                     ufraw_phases_num - 1);
+    data->FreezeDialog = FALSE;
+
     ufraw_image_data *img = ufraw_get_image(data->UF,
                                             ufraw_display_phase, FALSE);
     for (i = 0; i < uf_omp_get_max_threads(); i++) {
@@ -4490,6 +4491,8 @@ static void whitebalance_fill_interface(preview_data *data,
         if (data->UF->IsXTrans) {
             uf_combo_box_append_text(combo, _("X-Trans interpolation"),
                                      (void*)xtrans_interpolation);
+            uf_combo_box_append_text(combo, _("Draft interpolation"),
+                                     (void*)draft_interpolation);
         } else if (data->UF->colors == 4) {
             uf_combo_box_append_text(combo, _("VNG four color interpolation"),
                                      (void*)four_color_interpolation);
@@ -4502,6 +4505,8 @@ static void whitebalance_fill_interface(preview_data *data,
                                      (void*)four_color_interpolation);
             uf_combo_box_append_text(combo, _("PPG interpolation"),
                                      (void*)ppg_interpolation);
+            uf_combo_box_append_text(combo, _("Draft interpolation"),
+                                     (void*)draft_interpolation);
         }
         uf_combo_box_append_text(combo, _("Bilinear interpolation"),
                                  (void*)bilinear_interpolation);
@@ -5939,8 +5944,11 @@ int ufraw_preview(ufraw_data *uf, conf_data *rc, int plugin,
     update_crop_ranges(data, FALSE);
 
     /* Collect raw histogram data */
+    data->FreezeDialog = TRUE;
+    ufraw_convert_image_subareas(data->UF, ufraw_first_phase);
+    data->FreezeDialog = FALSE;
     ufraw_image_data *image = ufraw_get_image(data->UF,
-                              ufraw_first_phase, TRUE);
+                              ufraw_first_phase, FALSE);
     for (i = 0; i < image->height * image->width; i++) {
         guint16 *buf = (guint16*)(image->buffer + i * image->depth);
         for (c = 0; c < data->UF->colors; c++)
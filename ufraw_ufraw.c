@@ -29,6 +29,9 @@
 #ifdef HAVE_LIBBZ2
 #include <bzlib.h>
 #endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 void (*ufraw_progress)(int what, int ticks) = NULL;
 
@@ -41,20 +44,26 @@ static void ufraw_convert_image_tca(ufraw_data *uf, ufraw_image_data *img,
                                     ufraw_image_data *outimg,
                                     UFRectangle *area);
 void ufraw_prepare_tca(ufraw_data *uf);
+static void ufraw_coord_map_release(struct ufraw_coord_map *map);
 #endif
 static void ufraw_image_format(int *colors, int *bytes, ufraw_image_data *img,
                                const char *formats, const char *caller);
+static int ufraw_calculate_scale(ufraw_data *uf);
 static void ufraw_convert_image_raw(ufraw_data *uf, UFRawPhase phase);
 static void ufraw_convert_image_first(ufraw_data *uf, UFRawPhase phase);
 static void ufraw_convert_image_transform(ufraw_data *uf, ufraw_image_data *img,
-        ufraw_image_data *outimg, UFRectangle *area);
+        ufraw_image_data *outimg, UFRectangle *area, guint8 *dest, int rowstride);
 static void ufraw_convert_prepare_first_buffer(ufraw_data *uf,
         ufraw_image_data *img);
+static gboolean ufraw_convert_image_first_bands(ufraw_data *uf);
 static void ufraw_convert_prepare_transform_buffer(ufraw_data *uf,
         ufraw_image_data *img, int width, int height);
-static void ufraw_convert_reverse_wb(ufraw_data *uf, UFRawPhase phase);
+static void ufraw_convert_reverse_wb(ufraw_data *uf, UFRawPhase phase,
+                                     UFRectangle *area);
 static void ufraw_convert_import_buffer(ufraw_data *uf, UFRawPhase phase,
                                         dcraw_image_data *dcimg);
+static void ufraw_image_init(ufraw_image_data *img,
+                             int width, int height, int bitdepth);
 
 static int make_temporary(char *basefilename, char **tmpfilename)
 {
@@ -243,11 +252,20 @@ ufraw_data *ufraw_open(char *filename)
     uf->unzippedBufLen = unzippedBufLen;
     uf->conf = conf;
     g_strlcpy(uf->filename, filename, max_path);
+    const char *subareaEnv = g_getenv("UFRAW_SUBAREA_SIZE");
+    int subareaSize = subareaEnv != NULL ? atoi(subareaEnv) : 0;
+    /* Smaller subareas would mostly convert their interpolation margin */
+    if (subareaSize < 32)
+        subareaSize = UFRAW_DEFAULT_SUBAREA_SIZE;
     int i;
     for (i = ufraw_raw_phase; i < ufraw_phases_num; i++) {
         uf->Images[i].buffer = NULL;
         uf->Images[i].width = 0;
         uf->Images[i].height = 0;
+        uf->Images[i].tileSize = subareaSize;
+        uf->Images[i].tilesX = 0;
+        uf->Images[i].tilesY = 0;
+        uf->Images[i].tiles = NULL;
         uf->Images[i].valid = 0;
         uf->Images[i].invalidate_event = TRUE;
     }
@@ -266,6 +284,9 @@ ufraw_data *ufraw_open(char *filename)
     uf->modFlags = 0;
     uf->TCAmodifier = NULL;
     uf->modifier = NULL;
+    uf->TCAmodifierKey = NULL;
+    uf->modifierKey = NULL;
+    uf->transformMap = NULL;
 #endif
     uf->inputExifBuf = NULL;
     uf->outputExifBuf = NULL;
@@ -400,7 +421,11 @@ void ufraw_get_image_dimensions(ufraw_data *uf)
 /* Get scaled crop coordinates in final image coordinates */
 void ufraw_get_scaled_crop(ufraw_data *uf, UFRectangle *crop)
 {
-    ufraw_image_data *img = ufraw_get_image(uf, ufraw_transform_phase, FALSE);
+    ufraw_image_data *img;
+    if (uf->streamTransform || uf->firstRegion.width > 0)
+        img = &uf->Images[ufraw_transform_phase];
+    else
+        img = ufraw_get_image(uf, ufraw_transform_phase, FALSE);
 
     float scale_x = ((float)img->width) / uf->rotatedWidth;
     float scale_y = ((float)img->height) / uf->rotatedHeight;
@@ -760,8 +785,10 @@ void ufraw_close(ufraw_data *uf)
     g_free(uf->inputExifBuf);
     g_free(uf->outputExifBuf);
     int i;
-    for (i = ufraw_raw_phase; i < ufraw_phases_num; i++)
+    for (i = ufraw_raw_phase; i < ufraw_phases_num; i++) {
         g_free(uf->Images[i].buffer);
+        g_free(uf->Images[i].tiles);
+    }
     g_free(uf->thumb.buffer);
     developer_destroy(uf->developer);
     developer_destroy(uf->AutoDeveloper);
@@ -772,6 +799,9 @@ void ufraw_close(ufraw_data *uf)
         lf_modifier_destroy(uf->TCAmodifier);
     if (uf->modifier != NULL)
         lf_modifier_destroy(uf->modifier);
+    g_free(uf->TCAmodifierKey);
+    g_free(uf->modifierKey);
+    ufraw_coord_map_release(uf->transformMap);
 #endif
     ufobject_delete(uf->conf->ufobject);
     g_free(uf->conf);
@@ -779,21 +809,25 @@ void ufraw_close(ufraw_data *uf)
     ufraw_message(UFRAW_CLEAN, NULL);
 }
 
+/* Free the buffers kept for the next image, once no more images will be
+ * opened. */
+void ufraw_release_buffers()
+{
+    dcraw_release_buffers();
+}
+
 /* Return the coordinates and the size of given image subarea.
- * There are always 32 subareas, numbered 0 to 31, ordered in a 4x8 matrix.
+ * The subareas are the tiles of a tilesX x tilesY grid, numbered row by row.
+ * Those in the last column and row are cut at the image border.
  */
 UFRectangle ufraw_image_get_subarea_rectangle(ufraw_image_data *img,
         unsigned saidx)
 {
-    int saw = (img->width + 3) / 4;
-    int sah = (img->height + 7) / 8;
-    int sax = saidx % 4;
-    int say = saidx / 4;
     UFRectangle area;
-    area.x = saw * sax;
-    area.y = sah * say;
-    area.width = (sax < 3) ? saw : (img->width - saw * 3);
-    area.height = (say < 7) ? sah : (img->height - sah * 7);
+    area.x = saidx % img->tilesX * img->tileSize;
+    area.y = saidx / img->tilesX * img->tileSize;
+    area.width = MIN(img->tileSize, img->width - area.x);
+    area.height = MIN(img->tileSize, img->height - area.y);
     return area;
 }
 
@@ -801,9 +835,118 @@ UFRectangle ufraw_image_get_subarea_rectangle(ufraw_image_data *img,
  */
 unsigned ufraw_img_get_subarea_idx(ufraw_image_data *img, int x, int y)
 {
-    int saw = (img->width + 3) / 4;
-    int sah = (img->height + 7) / 8;
-    return (x / saw) + (y / sah) * 4;
+    return x / img->tileSize + y / img->tileSize * img->tilesX;
+}
+
+/* Return the number of subareas of the image */
+int ufraw_image_subareas(ufraw_image_data *img)
+{
+    return img->tilesX * img->tilesY;
+}
+
+/* Subareas which are neither valid nor claimed by some thread */
+gboolean ufraw_image_subarea_dirty(ufraw_image_data *img, unsigned saidx)
+{
+    return g_atomic_int_get(&img->tiles[saidx]) == ufraw_tile_dirty;
+}
+
+gboolean ufraw_image_subarea_valid(ufraw_image_data *img, unsigned saidx)
+{
+    return g_atomic_int_get(&img->tiles[saidx]) == ufraw_tile_valid;
+}
+
+/* Check that all the subareas of the image are valid */
+gboolean ufraw_image_valid(ufraw_image_data *img)
+{
+    return g_atomic_int_get(&img->valid) == ufraw_image_subareas(img);
+}
+
+/* Threads waiting for a subarea claimed by another thread sleep on
+ * subareaCond until some subarea becomes valid. */
+#if GLIB_CHECK_VERSION(2,32,0)
+static GMutex subareaMutex;
+static GCond subareaCond;
+#define subarea_mutex() (&subareaMutex)
+#define subarea_cond() (&subareaCond)
+#else
+static GStaticMutex subareaMutex = G_STATIC_MUTEX_INIT;
+static gpointer subarea_cond_new(gpointer data)
+{
+    (void)data;
+    return g_cond_new();
+}
+static GCond *subarea_cond()
+{
+    static GOnce once = G_ONCE_INIT;
+    return g_once(&once, subarea_cond_new, NULL);
+}
+#define subarea_mutex() g_static_mutex_get_mutex(&subareaMutex)
+#endif
+
+/* Try to take a dirty subarea for converting it. Only one thread succeeds,
+ * the others have to wait for the subarea to become valid. */
+static gboolean ufraw_image_claim_subarea(ufraw_image_data *img,
+        unsigned saidx)
+{
+    return g_atomic_int_compare_and_exchange(&img->tiles[saidx],
+            ufraw_tile_dirty, ufraw_tile_busy);
+}
+
+static void ufraw_image_wait_subarea(ufraw_image_data *img, unsigned saidx)
+{
+    GMutex *mutex = subarea_mutex();
+    g_mutex_lock(mutex);
+    while (!ufraw_image_subarea_valid(img, saidx))
+        g_cond_wait(subarea_cond(), mutex);
+    g_mutex_unlock(mutex);
+}
+
+static void ufraw_image_validate_subarea(ufraw_image_data *img,
+        unsigned saidx)
+{
+    GMutex *mutex;
+
+    if (ufraw_image_subarea_valid(img, saidx))
+        return;
+    mutex = subarea_mutex();
+    g_mutex_lock(mutex);
+    g_atomic_int_set(&img->tiles[saidx], ufraw_tile_valid);
+    g_atomic_int_inc(&img->valid);
+    g_cond_broadcast(subarea_cond());
+    g_mutex_unlock(mutex);
+}
+
+/* The following functions must not run concurrently with conversions
+ * of the image. */
+static void ufraw_image_invalidate(ufraw_image_data *img)
+{
+    int i;
+    for (i = 0; i < ufraw_image_subareas(img); i++)
+        img->tiles[i] = ufraw_tile_dirty;
+    img->valid = 0;
+}
+
+static void ufraw_image_validate(ufraw_image_data *img)
+{
+    int i;
+    for (i = 0; i < ufraw_image_subareas(img); i++)
+        img->tiles[i] = ufraw_tile_valid;
+    img->valid = ufraw_image_subareas(img);
+}
+
+/* Resize the grid of subareas to the image size. A new grid is all dirty,
+ * an image whose size changed has to be invalidated anyway. */
+static void ufraw_image_fit_tiles(ufraw_image_data *img)
+{
+    int tilesX = (img->width + img->tileSize - 1) / img->tileSize;
+    int tilesY = (img->height + img->tileSize - 1) / img->tileSize;
+    if (tilesX == img->tilesX && tilesY == img->tilesY)
+        return;
+    g_free(img->tiles);
+    img->tiles = g_new0(gint, tilesX * tilesY);
+    img->tilesX = tilesX;
+    img->tilesY = tilesY;
+    img->valid = 0;
 }
 
 void ufraw_developer_prepare(ufraw_data *uf, DeveloperMode mode)
@@ -833,15 +976,37 @@ void ufraw_developer_prepare(ufraw_data *uf, DeveloperMode mode)
     }
 }
 
-int ufraw_convert_image(ufraw_data *uf)
+/* Render the raw and first phases of a full conversion, in bands of rows
+ * if 'bands' is set and the conversion allows it */
+static ufraw_image_data *ufraw_convert_image_first_phases(ufraw_data *uf,
+        gboolean bands)
 {
     uf->mark_hotpixels = FALSE;
     ufraw_developer_prepare(uf, file_developer);
-    ufraw_convert_image_raw(uf, ufraw_raw_phase);
-
     ufraw_image_data *img = &uf->Images[ufraw_first_phase];
     ufraw_convert_prepare_first_buffer(uf, img);
+    if (bands && ufraw_convert_image_first_bands(uf))
+        return img;
+
+    ufraw_convert_image_raw(uf, ufraw_raw_phase);
     ufraw_convert_image_first(uf, ufraw_first_phase);
+    return img;
+}
+
+static void ufraw_convert_image_auto_crop(ufraw_data *uf)
+{
+    if (uf->conf->autoCrop && !uf->LoadingID) {
+        ufraw_get_image_dimensions(uf);
+        uf->conf->CropX1 = (uf->rotatedWidth - uf->autoCropWidth) / 2;
+        uf->conf->CropX2 = uf->conf->CropX1 + uf->autoCropWidth;
+        uf->conf->CropY1 = (uf->rotatedHeight - uf->autoCropHeight) / 2;
+        uf->conf->CropY2 = uf->conf->CropY1 + uf->autoCropHeight;
+    }
+}
+
+int ufraw_convert_image(ufraw_data *uf)
+{
+    ufraw_image_data *img = ufraw_convert_image_first_phases(uf, FALSE);
 
     UFRectangle area = { 0, 0, img->width, img->height };
     // prepare_transform has to be called before applying vignetting
@@ -856,21 +1021,250 @@ int ufraw_convert_image(ufraw_data *uf)
         area.width = img2->width;
         area.height = img2->height;
         /* Apply distortion, geometry and rotation */
-        ufraw_convert_image_transform(uf, img, img2, &area);
+        ufraw_convert_image_transform(uf, img, img2, &area,
+                                      img2->buffer, img2->rowstride);
         g_free(img->buffer);
         *img = *img2;
         img2->buffer = NULL;
     }
-    if (uf->conf->autoCrop && !uf->LoadingID) {
-        ufraw_get_image_dimensions(uf);
-        uf->conf->CropX1 = (uf->rotatedWidth - uf->autoCropWidth) / 2;
-        uf->conf->CropX2 = uf->conf->CropX1 + uf->autoCropWidth;
-        uf->conf->CropY1 = (uf->rotatedHeight - uf->autoCropHeight) / 2;
-        uf->conf->CropY2 = uf->conf->CropY1 + uf->autoCropHeight;
+    ufraw_convert_image_auto_crop(uf);
+    return UFRAW_SUCCESS;
+}
+
+/* Map 'rect' from the unflipped image of width x height pixels to the
+ * image flipped by 'flip', as dcraw_flip_image() does, or back again. */
+static void ufraw_flip_rectangle(UFRectangle *rect, int width, int height,
+                                 int flip, gboolean reverse)
+{
+    int tmp;
+    if (reverse && (flip & 4)) {
+        tmp = rect->x, rect->x = rect->y, rect->y = tmp;
+        tmp = rect->width, rect->width = rect->height, rect->height = tmp;
+    }
+    if (flip & 1)
+        rect->x = width - rect->x - rect->width;
+    if (flip & 2)
+        rect->y = height - rect->y - rect->height;
+    if (!reverse && (flip & 4)) {
+        tmp = rect->x, rect->x = rect->y, rect->y = tmp;
+        tmp = rect->width, rect->width = rect->height, rect->height = tmp;
+    }
+}
+
+/*
+ * Find the part 'area' of the first phase image 'img' that the transform
+ * phase 'img2' needs to render 'rect', by tracing the border of 'rect'
+ * back the same way ufraw_convert_image_transform() does. Returns FALSE
+ * if 'rect' maps to no part of the first phase.
+ */
+static gboolean ufraw_transform_source_rectangle(ufraw_data *uf,
+        ufraw_image_data *img, ufraw_image_data *img2, UFRectangle *rect,
+        UFRectangle *area)
+{
+    float sine = sin(uf->conf->rotationAngle * 2 * M_PI / 360);
+    float cosine = cos(uf->conf->rotationAngle * 2 * M_PI / 360);
+    float baseX = img->width / 2 - img2->width / 2 * cosine - img2->height / 2 * sine;
+    float baseY = img->height / 2 + img2->width / 2 * sine - img2->height / 2 * cosine;
+#ifdef HAVE_LENSFUN
+    gboolean applyLF = uf->modifier != NULL && (uf->modFlags & UF_LF_TRANSFORM);
+#endif
+    float minX = img->width, minY = img->height, maxX = 0, maxY = 0;
+    int i, k;
+    for (i = 0; i < rect->width + rect->height; i++) {
+        for (k = 0; k < 2; k++) {
+            int x, y;
+            if (i < rect->width) { // Top and bottom borders
+                x = rect->x + i;
+                y = k ? rect->y + rect->height - 1 : rect->y;
+            } else { // Left and right borders
+                x = k ? rect->x + rect->width - 1 : rect->x;
+                y = rect->y + i - rect->width;
+            }
+            float srcX = baseX + y * sine + x * cosine;
+            float srcY = baseY + y * cosine - x * sine;
+#ifdef HAVE_LENSFUN
+            if (applyLF) {
+                float buff[2];
+                lf_modifier_apply_geometry_distortion(uf->modifier,
+                                                      srcX, srcY, 1, 1, buff);
+                srcX = buff[0];
+                srcY = buff[1];
+            }
+#endif
+            minX = MIN(minX, srcX);
+            maxX = MAX(maxX, srcX);
+            minY = MIN(minY, srcY);
+            maxY = MAX(maxY, srcY);
+        }
     }
+    /* Leave room for the linear interpolation */
+    area->x = MAX(floor(minX) - 1, 0);
+    area->width = MIN(ceil(maxX) + 2, img->width) - area->x;
+    area->y = MAX(floor(minY) - 1, 0);
+    area->height = MIN(ceil(maxY) + 2, img->height) - area->y;
+    return area->width > 0 && area->height > 0;
+}
+
+/*
+ * Set 'region' to a copy of 'raw' holding only the part of 'image' from
+ * x0,y0 to x1,y1, in full size pixels. 'image' has the size of raw->raw.
+ * x0 and y0 should be multiples of 48, see ufraw_convert_prepare_region().
+ */
+static void ufraw_copy_raw_region(dcraw_data *raw, dcraw_image_type *image,
+                                  dcraw_data *region, int x0, int y0, int x1, int y1)
+{
+    const int shrink = raw->shrink;
+    int i, rx, ry, rw, rh;
+
+    rx = x0 >> shrink;
+    ry = y0 >> shrink;
+    rw = ((x1 - 1) >> shrink) - rx + 1;
+    rh = ((y1 - 1) >> shrink) - ry + 1;
+    *region = *raw;
+    region->width = MIN(rw << shrink, raw->width - x0);
+    region->height = MIN(rh << shrink, raw->height - y0);
+    region->raw.width = rw;
+    region->raw.height = rh;
+    region->raw.image = g_new(dcraw_image_type, rw * rh);
+    for (i = 0; i < rh; i++)
+        memcpy(region->raw.image + i * rw,
+               image + (ry + i) * raw->raw.width + rx,
+               rw * sizeof(dcraw_image_type));
+}
+
+/*
+ * Find the part of the raw image that is needed to render the crop,
+ * including margins for the raw phase denoising and despeckling and for
+ * the interpolation and color smoothing. 'region' is set to a copy of
+ * uf->raw holding only that part and uf->firstRegion to the matching part
+ * of the first phase image. Returns FALSE if the whole image should be
+ * converted, either because the crop covers most of it or because some
+ * step depends on the geometry of the whole image.
+ */
+static gboolean ufraw_convert_prepare_region(ufraw_data *uf,
+        dcraw_data *region)
+{
+    dcraw_data *raw = uf->raw;
+    ufraw_image_data *img = &uf->Images[ufraw_first_phase];
+    ufraw_image_data *img2 = &uf->Images[ufraw_transform_phase];
+    const int flip = uf->conf->orientation;
+    const int shrink = raw->shrink;
+    UFRectangle crop, area;
+    int c, margin, despeckle, x0, y0, x1, y1;
+
+    uf->firstRegion.width = 0;
+    if (uf->conf->darkframe != NULL || raw->fuji_width != 0 ||
+            raw->pixel_aspect != 1 || !(raw->shrink || uf->IsXTrans) ||
+            uf->conf->size > 0 || uf->conf->shrink > 1 ||
+            ufraw_calculate_scale(uf) != 1)
+        return FALSE;
+#ifdef HAVE_LENSFUN
+    /* The TCA correction is set up for the whole raw image */
+    uf->Images[ufraw_raw_phase].width = raw->raw.width;
+    uf->Images[ufraw_raw_phase].height = raw->raw.height;
+    ufraw_prepare_tca(uf);
+    if (uf->TCAmodifier != NULL)
+        return FALSE;
+#endif
+    /* The crop area in the transform phase */
+    crop.x = MAX(uf->conf->CropX1, 0);
+    crop.width = MIN(uf->conf->CropX2, img2->width) - crop.x;
+    crop.y = MAX(uf->conf->CropY1, 0);
+    crop.height = MIN(uf->conf->CropY2, img2->height) - crop.y;
+    if (crop.width <= 0 || crop.height <= 0)
+        return FALSE;
+
+    if (!uf->streamTransform)
+        area = crop;
+    else if (!ufraw_transform_source_rectangle(uf, img, img2, &crop, &area))
+        return FALSE;
+    ufraw_flip_rectangle(&area, raw->width, raw->height, flip, TRUE);
+
+    /* Despeckling spreads each pixel over window * passes pixels */
+    despeckle = 0;
+    for (c = 0; c < 3; c++)
+        despeckle = MAX(despeckle, (int)(uf->conf->despeckleWindow[c] *
+                                         uf->conf->despecklePasses[c] + 0.01));
+    /* The raw phase margin covers the wavelet denoising, the full size
+     * margin covers the interpolation and color smoothing. */
+    margin = ((64 + despeckle) << shrink) + 16;
+    /* The color filter pattern repeats every 16 rows for Bayer sensors
+     * and every 6 pixels for X-Trans sensors. Aligning the region to 48
+     * keeps it in place without touching the margins in uf->raw. */
+    x0 = MAX(area.x - margin, 0) / 48 * 48;
+    y0 = MAX(area.y - margin, 0) / 48 * 48;
+    x1 = MIN(area.x + area.width + margin, raw->width);
+    y1 = MIN(area.y + area.height + margin, raw->height);
+    /* Not worth the trouble if most of the image is needed anyway */
+    if ((gint64)(x1 - x0) * (y1 - y0) * 4 > (gint64)raw->width * raw->height * 3)
+        return FALSE;
+
+    ufraw_copy_raw_region(raw, raw->raw.image, region, x0, y0, x1, y1);
+    uf->firstRegion.x = x0;
+    uf->firstRegion.y = y0;
+    uf->firstRegion.width = region->width;
+    uf->firstRegion.height = region->height;
+    ufraw_flip_rectangle(&uf->firstRegion, raw->width, raw->height, flip, FALSE);
+    return TRUE;
+}
+
+/*
+ * Like ufraw_convert_image(), but for saving the image. The transform
+ * phase is not rendered as a whole. Instead, ufraw_write_image_data()
+ * renders the rows it needs with ufraw_convert_image_transform_area()
+ * just before developing them. The raw phase and the interpolation are
+ * done in bands, so only the first phase is ever held whole. If the image
+ * is cropped, only the part of the raw image needed for the crop is
+ * converted.
+ */
+int ufraw_convert_image_for_saving(ufraw_data *uf)
+{
+    ufraw_convert_image_auto_crop(uf);
+    ufraw_image_data *img = &uf->Images[ufraw_first_phase];
+    ufraw_convert_prepare_first_buffer(uf, img);
+    // prepare_transform has to be called before applying vignetting
+    ufraw_image_data *img2 = &uf->Images[ufraw_transform_phase];
+    ufraw_convert_prepare_transform_buffer(uf, img2, img->width, img->height);
+    /* Only the dimensions of the transform phase are needed */
+    uf->streamTransform = img2->buffer != NULL;
+    g_free(img2->buffer);
+    img2->buffer = NULL;
+    ufraw_image_invalidate(img2);
+
+    dcraw_data *raw = uf->raw, region;
+    if (ufraw_convert_prepare_region(uf, &region)) {
+        uf->raw = &region;
+        img = ufraw_convert_image_first_phases(uf, TRUE);
+        uf->raw = raw;
+        g_free(region.raw.image);
+    } else {
+        img = ufraw_convert_image_first_phases(uf, TRUE);
+    }
+    ufraw_image_data *rawImg = &uf->Images[ufraw_raw_phase];
+    g_free(rawImg->buffer);
+    rawImg->buffer = NULL;
+    ufraw_image_invalidate(rawImg);
+#ifdef HAVE_LENSFUN
+    if (uf->modifier != NULL) {
+        UFRectangle area = { uf->firstRegion.x, uf->firstRegion.y,
+                             img->width, img->height
+                           };
+        ufraw_convert_image_vignetting(uf, img, &area);
+    }
+#endif
     return UFRAW_SUCCESS;
 }
 
+/* Render the transform phase of 'area' into 'dest', whose rows are
+ * 'rowstride' bytes apart, after ufraw_convert_image_for_saving(). */
+void ufraw_convert_image_transform_area(ufraw_data *uf, UFRectangle *area,
+                                        guint8 *dest, int rowstride)
+{
+    ufraw_convert_image_transform(uf, &uf->Images[ufraw_first_phase],
+                                  &uf->Images[ufraw_transform_phase],
+                                  area, dest, rowstride);
+}
+
 #ifdef HAVE_LENSFUN
 static void ufraw_convert_image_vignetting(ufraw_data *uf,
         ufraw_image_data *img, UFRectangle *area)
@@ -882,7 +1276,212 @@ static void ufraw_convert_image_vignetting(ufraw_data *uf,
             area->x, area->y, area->width, area->height,
             LF_CR_4(RED, GREEN, BLUE, UNKNOWN), img->rowstride);
 }
-#endif
+
+/*
+ * Tracing pixels through lensfun is the slowest part of the TCA and
+ * transform corrections, yet the files of a batch or of a conversion
+ * server mostly share their lens settings. The traced coordinates are
+ * therefore kept in a small cache of maps, sampled every coord_map_step
+ * pixels and interpolated linearly in between. The maps are keyed by the
+ * image sizes, the rotation and what the lensfun modifier is made of.
+ * A map is only interpolated if lensfun agrees with it to within
+ * coord_map_tolerance pixels at the centre of every grid cell, which a
+ * geometry conversion may not near the image edges. Otherwise the map
+ * only records that every pixel has to be traced. The border trace of
+ * ufraw_convert_prepare_transform_buffer() is cached the same way, as a
+ * single node.
+ */
+#define coord_map_cache_size 4
+#define coord_map_step 8
+#define coord_map_tolerance 0.05
+typedef enum { coord_map_transform, coord_map_tca, coord_map_border }
+coord_map_kind;
+
+typedef struct {
+    int kind, width, height, srcWidth, srcHeight;
+    double param[4];
+    /* ufraw_data modifierKey or TCAmodifierKey */
+    char *modifier;
+} coord_map_key;
+
+/* 'floats' values per node, on a gridWidth x gridHeight grid. If 'exact'
+ * is set, the grid was too far from lensfun and has no nodes. */
+struct ufraw_coord_map {
+    coord_map_key key;
+    int floats, gridWidth, gridHeight;
+    gboolean exact;
+    float *node;
+};
+typedef struct ufraw_coord_map coord_map;
+
+static struct {
+    coord_map *map;
+    int refCount;
+    unsigned lastUse;
+} coordMapCache[coord_map_cache_size];
+static unsigned coordMapCacheClock;
+G_LOCK_DEFINE_STATIC(coordMapCache);
+
+/* Start a key for mapping width x height pixels from a srcWidth x
+ * srcHeight image with the modifier described by 'modifier' */
+static void ufraw_coord_map_key(coord_map_key *key, coord_map_kind kind,
+                                int width, int height, int srcWidth, int srcHeight,
+                                char *modifier)
+{
+    memset(key, 0, sizeof(*key));
+    key->kind = kind;
+    key->width = width;
+    key->height = height;
+    key->srcWidth = srcWidth;
+    key->srcHeight = srcHeight;
+    key->modifier = modifier;
+}
+
+static gboolean ufraw_coord_map_key_equal(const coord_map_key *a,
+        const coord_map_key *b)
+{
+    return a->kind == b->kind && a->width == b->width &&
+           a->height == b->height && a->srcWidth == b->srcWidth &&
+           a->srcHeight == b->srcHeight &&
+           memcmp(a->param, b->param, sizeof(a->param)) == 0 &&
+           strcmp(a->modifier, b->modifier) == 0;
+}
+
+/* Return a reference to the cached map for 'key', or NULL */
+static coord_map *ufraw_coord_map_lookup(const coord_map_key *key)
+{
+    int i;
+    G_LOCK(coordMapCache);
+    for (i = 0; i < coord_map_cache_size; i++) {
+        if (coordMapCache[i].map != NULL &&
+                ufraw_coord_map_key_equal(&coordMapCache[i].map->key, key)) {
+            coordMapCache[i].refCount++;
+            coordMapCache[i].lastUse = ++coordMapCacheClock;
+            G_UNLOCK(coordMapCache);
+            return coordMapCache[i].map;
+        }
+    }
+    G_UNLOCK(coordMapCache);
+    return NULL;
+}
+
+/* A new map for width x height pixels */
+static coord_map *ufraw_coord_map_new(const coord_map_key *key, int floats,
+                                      int width, int height)
+{
+    coord_map *map = g_new(coord_map, 1);
+    map->key = *key;
+    map->key.modifier = g_strdup(key->modifier);
+    map->exact = FALSE;
+    map->floats = floats;
+    map->gridWidth = (width - 1) / coord_map_step + 2;
+    map->gridHeight = (height - 1) / coord_map_step + 2;
+    map->node = g_new(float, map->gridWidth * map->gridHeight * floats);
+    return map;
+}
+
+static void ufraw_coord_map_free(coord_map *map)
+{
+    g_free(map->key.modifier);
+    g_free(map->node);
+    g_free(map);
+}
+
+/* Check the 'floats' values lensfun gives at the centre of grid cell
+ * gx,gy against the ones interpolated there */
+static gboolean ufraw_coord_map_cell_ok(const coord_map *map, int gx, int gy,
+                                        const float *exact)
+{
+    const int n = map->floats;
+    const float *top = map->node + (gy * map->gridWidth + gx) * n;
+    const float *bottom = top + map->gridWidth * n;
+    int k;
+
+    for (k = 0; k < n; k++) {
+        float value = (top[k] + top[k + n] + bottom[k] + bottom[k + n]) / 4;
+        /* Not a number fails too */
+        if (!(fabs(value - exact[k]) <= coord_map_tolerance))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Drop the nodes of a map that failed ufraw_coord_map_cell_ok() */
+static void ufraw_coord_map_set_exact(coord_map *map)
+{
+    map->exact = TRUE;
+    g_free(map->node);
+    map->node = NULL;
+}
+
+/* Put a new map in the cache, in place of the least recently used map
+ * that is not in use. Returns the map to use, which is the cached one if
+ * another thread was quicker. */
+static coord_map *ufraw_coord_map_insert(coord_map *map)
+{
+    int i, slot;
+    G_LOCK(coordMapCache);
+    for (i = 0, slot = -1; i < coord_map_cache_size; i++) {
+        if (coordMapCache[i].map != NULL &&
+                ufraw_coord_map_key_equal(&coordMapCache[i].map->key,
+                                          &map->key)) {
+            coordMapCache[i].refCount++;
+            coordMapCache[i].lastUse = ++coordMapCacheClock;
+            G_UNLOCK(coordMapCache);
+            ufraw_coord_map_free(map);
+            return coordMapCache[i].map;
+        }
+        if (coordMapCache[i].refCount > 0)
+            continue;
+        if (slot < 0 || coordMapCache[i].lastUse < coordMapCache[slot].lastUse)
+            slot = i;
+    }
+    if (slot >= 0) {
+        if (coordMapCache[slot].map != NULL)
+            ufraw_coord_map_free(coordMapCache[slot].map);
+        coordMapCache[slot].map = map;
+        coordMapCache[slot].refCount = 1;
+        coordMapCache[slot].lastUse = ++coordMapCacheClock;
+    }
+    G_UNLOCK(coordMapCache);
+    return map;
+}
+
+static void ufraw_coord_map_release(coord_map *map)
+{
+    int i;
+    if (map == NULL) return;
+    G_LOCK(coordMapCache);
+    for (i = 0; i < coord_map_cache_size; i++)
+        if (coordMapCache[i].map == map) break;
+    if (i < coord_map_cache_size)
+        coordMapCache[i].refCount--;
+    G_UNLOCK(coordMapCache);
+    if (i == coord_map_cache_size)
+        ufraw_coord_map_free(map);
+}
+
+/* Interpolate the values of 'width' pixels of row 'y' from column 'x0' */
+static void ufraw_coord_map_row(const coord_map *map, int y, int x0,
+                                int width, float *out)
+{
+    const int n = map->floats;
+    const int gy = y / coord_map_step;
+    const float fy = (float)(y % coord_map_step) / coord_map_step;
+    const float *top = map->node + gy * map->gridWidth * n;
+    const float *bottom = top + map->gridWidth * n;
+    int x, k;
+
+    for (x = x0; x < x0 + width; x++, out += n) {
+        const int gx = x / coord_map_step;
+        const float fx = (float)(x % coord_map_step) / coord_map_step;
+        const float *t = top + gx * n, *b = bottom + gx * n;
+        for (k = 0; k < n; k++)
+            out[k] = (1 - fy) * ((1 - fx) * t[k] + fx * t[k + n]) +
+                     fy * ((1 - fx) * b[k] + fx * b[k + n]);
+    }
+}
+#endif /* HAVE_LENSFUN */
 
 /*
 	ufraw_interpolate_pixel_linearly()
@@ -896,7 +1495,7 @@ static void ufraw_convert_image_vignetting(ufraw_data *uf,
 */
 #define SCALAR 256
 
-static inline void ufraw_interpolate_pixel_linearly(ufraw_image_data *image, float x, float y, ufraw_image_type *dst, int color)
+void ufraw_interpolate_pixel_linearly(ufraw_image_data *image, float x, float y, ufraw_image_type *dst, int color)
 {
 
     int i, j, c, cmax, xx, yy;
@@ -969,12 +1568,173 @@ static inline void ufraw_interpolate_pixel_linearly(ufraw_image_data *image, flo
     }
 }
 
+#ifdef __SSE2__
+/* The products of the four 32 bit lanes of a and b, modulo 2^32 */
+static inline __m128i ufraw_mullo_epu32(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+/* The four colors of two pixels, in the low and high half of ab,
+ * weighted by the 16 bit weights in w and added, as 32 bit lanes. */
+static inline __m128i ufraw_weigh_pixel_pair(__m128i ab, __m128i w)
+{
+    __m128i lo = _mm_mullo_epi16(ab, w);
+    __m128i hi = _mm_mulhi_epu16(ab, w);
+    return _mm_add_epi32(_mm_unpacklo_epi16(lo, hi),
+                         _mm_unpackhi_epi16(lo, hi));
+}
+#endif
+
+/*
+	ufraw_interpolate_row_linearly()
+	Interpolate 'width' pixels, all four colors of each, at the coordinates
+	given in pairs by 'coord' less x0,y0, and write them to dst. The pixels
+	are the same as those of ufraw_interpolate_pixel_linearly(), which
+	still handles the ones near a border. The fourth color is interpolated
+	even if it is not used. UFRAW_NO_SIMD in the environment keeps the
+	scalar code.
+*/
+void ufraw_interpolate_row_linearly(ufraw_image_data *image,
+        const float *coord, int width, int x0, int y0, ufraw_image_type *dst)
+{
+    int i, c, xx, yy;
+    unsigned int dx, dy;
+    float x, y;
+    ufraw_image_type *src;
+#ifdef __SSE2__
+    const gboolean simd = g_getenv("UFRAW_NO_SIMD") == NULL;
+#endif
+
+    for (i = 0; i < width; i++, coord += 2, dst++) {
+        /* The same rounding as ufraw_interpolate_pixel_linearly() */
+        x = coord[0] - x0 + 2;
+        y = coord[1] - y0 + 2;
+        xx = x;
+        yy = y;
+        dx = (int)(x * SCALAR + 0.5) - (xx * SCALAR);
+        dy = (int)(y * SCALAR + 0.5) - (yy * SCALAR);
+        xx -= 2;
+        yy -= 2;
+        if (xx < 0 || yy < 0 || xx + 1 >= image->width ||
+                yy + 1 >= image->height) {
+            ufraw_interpolate_pixel_linearly(image, coord[0] - x0,
+                                             coord[1] - y0, dst, -1);
+            continue;
+        }
+        src = (ufraw_image_type *)image->buffer + yy * image->width + xx;
+#ifdef __SSE2__
+        if (simd) {
+            /* Weigh the columns, then the rows, which adds up to the same
+             * sum as the 2x2 weights. Nothing overflows 32 bits. */
+            __m128i wx = _mm_set_epi16(dx, dx, dx, dx, SCALAR - dx, SCALAR - dx,
+                                       SCALAR - dx, SCALAR - dx);
+            __m128i top = ufraw_weigh_pixel_pair(
+                              _mm_loadu_si128((__m128i *)src), wx);
+            __m128i bottom = ufraw_weigh_pixel_pair(
+                                 _mm_loadu_si128((__m128i *)(src + image->width)), wx);
+            __m128i v = _mm_add_epi32(
+                            ufraw_mullo_epu32(top, _mm_set1_epi32(SCALAR - dy)),
+                            ufraw_mullo_epu32(bottom, _mm_set1_epi32(dy)));
+            /* Divide by SCALAR^2 and pack the unsigned 16 bit results */
+            v = _mm_sub_epi32(_mm_srli_epi32(v, 16), _mm_set1_epi32(0x8000));
+            v = _mm_xor_si128(_mm_packs_epi32(v, v), _mm_set1_epi16(-0x8000));
+            _mm_storel_epi64((__m128i *)dst, v);
+            continue;
+        }
+#endif
+        for (c = 0; c < 4; c++)
+            dst[0][c] = ((SCALAR - dy) * ((SCALAR - dx) * src[0][c] +
+                                          dx * src[1][c]) +
+                         dy * ((SCALAR - dx) * src[image->width][c] +
+                               dx * src[image->width + 1][c])) /
+                        (SCALAR * SCALAR);
+    }
+}
+
 #undef SCALAR
 
 
-/* Apply distortion, geometry and rotation in a single pass */
+#ifdef HAVE_LENSFUN
+/*
+ * Return the map of the source coordinates of every pixel of 'outimg',
+ * rotated as by ufraw_convert_image_transform() and then distorted. It
+ * is looked up once after each ufraw_convert_prepare_transform_buffer().
+ */
+static coord_map *ufraw_transform_map(ufraw_data *uf,
+                                      ufraw_image_data *outimg, int width, int height,
+                                      float sine, float cosine, float baseX, float baseY)
+{
+    coord_map_key key;
+    coord_map *map;
+    gboolean inexact = FALSE;
+    int gx, gy;
+
+    G_LOCK(coordMapCache);
+    map = uf->transformMap;
+    G_UNLOCK(coordMapCache);
+    if (map != NULL)
+        return map;
+    ufraw_coord_map_key(&key, coord_map_transform, outimg->width,
+                        outimg->height, width, height, uf->modifierKey);
+    key.param[0] = sine;
+    key.param[1] = cosine;
+    key.param[2] = baseX;
+    key.param[3] = baseY;
+    map = ufraw_coord_map_lookup(&key);
+    if (map == NULL) {
+        map = ufraw_coord_map_new(&key, 2, outimg->width, outimg->height);
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(static) private(gx)
+#endif
+        for (gy = 0; gy < map->gridHeight; gy++) {
+            for (gx = 0; gx < map->gridWidth; gx++) {
+                int x = gx * coord_map_step, y = gy * coord_map_step;
+                float *node = map->node + 2 * (gy * map->gridWidth + gx);
+                lf_modifier_apply_geometry_distortion(uf->modifier,
+                                                      baseX + y * sine + x * cosine,
+                                                      baseY + y * cosine - x * sine, 1, 1, node);
+            }
+        }
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(static) private(gx) \
+        reduction(|:inexact)
+#endif
+        for (gy = 0; gy < map->gridHeight - 1; gy++) {
+            for (gx = 0; gx < map->gridWidth - 1; gx++) {
+                float x = (gx + 0.5) * coord_map_step;
+                float y = (gy + 0.5) * coord_map_step;
+                float exact[2];
+                lf_modifier_apply_geometry_distortion(uf->modifier,
+                                                      baseX + y * sine + x * cosine,
+                                                      baseY + y * cosine - x * sine, 1, 1, exact);
+                inexact |= !ufraw_coord_map_cell_ok(map, gx, gy, exact);
+            }
+        }
+        if (inexact)
+            ufraw_coord_map_set_exact(map);
+        map = ufraw_coord_map_insert(map);
+    }
+    /* Another thread may have looked it up meanwhile */
+    G_LOCK(coordMapCache);
+    if (uf->transformMap == NULL) {
+        uf->transformMap = map;
+        map = NULL;
+    }
+    G_UNLOCK(coordMapCache);
+    ufraw_coord_map_release(map);
+    return uf->transformMap;
+}
+#endif
+
+/* Apply distortion, geometry and rotation in a single pass. 'dest' points
+ * to the top-left pixel of 'area' in rows of 'rowstride' bytes. Only the
+ * dimensions of 'outimg' are used. */
 static void ufraw_convert_image_transform(ufraw_data *uf, ufraw_image_data *img,
-        ufraw_image_data *outimg, UFRectangle *area)
+        ufraw_image_data *outimg, UFRectangle *area, guint8 *dest, int rowstride)
 {
     float sine = sin(uf->conf->rotationAngle * 2 * M_PI / 360);
     float cosine = cos(uf->conf->rotationAngle * 2 * M_PI / 360);
@@ -986,31 +1746,59 @@ static void ufraw_convert_image_transform(ufraw_data *uf, ufraw_image_data *img,
     // baseX = img->width/2;
     // baseY = img->height/2;
     // Since we rotate around the top-left corner, the base offset is:
-    float baseX = img->width / 2 - outimg->width / 2 * cosine - outimg->height / 2 * sine;
-    float baseY = img->height / 2 + outimg->width / 2 * sine - outimg->height / 2 * cosine;
+    // If 'img' only holds uf->firstRegion, the base offset is for the
+    // whole image and the region offset is subtracted at the end.
+    int width = img->width, height = img->height;
+    if (uf->firstRegion.width > 0) {
+        width = uf->initialWidth;
+        height = uf->initialHeight;
+    }
+    float baseX = width / 2 - outimg->width / 2 * cosine - outimg->height / 2 * sine;
+    float baseY = height / 2 + outimg->width / 2 * sine - outimg->height / 2 * cosine;
 #ifdef HAVE_LENSFUN
-    gboolean applyLF = uf->modifier != NULL && (uf->modFlags & UF_LF_TRANSFORM);
+    coord_map *map = NULL;
+    if (uf->modifier != NULL && (uf->modFlags & UF_LF_TRANSFORM))
+        map = ufraw_transform_map(uf, outimg, width, height, sine, cosine,
+                                  baseX, baseY);
 #endif
     int x, y;
-    for (y = area->y; y < area->y + area->height; y++) {
-        guint8 *cur0 = outimg->buffer + y * outimg->rowstride;
-        float srcX0 = y * sine + baseX;
-        float srcY0 = y * cosine + baseY;
-        for (x = area->x; x < area->x + area->width; x++) {
-            guint16 *cur = (guint16 *)(cur0 + x * outimg->depth);
-            float srcX = srcX0 + x * cosine;
-            float srcY = srcY0 - x * sine;
+    /* Each row first gets the source coordinates of all its pixels */
+#ifdef _OPENMP
+    #pragma omp parallel \
+    shared(uf,img,outimg,area,dest,rowstride,sine,cosine,baseX,baseY) \
+    private(x,y)
+#endif
+    {
+        float *coord = g_new(float, 2 * area->width);
+#ifdef _OPENMP
+        #pragma omp for schedule(static)
+#endif
+        for (y = area->y; y < area->y + area->height; y++) {
+            float srcX0 = y * sine + baseX;
+            float srcY0 = y * cosine + baseY;
 #ifdef HAVE_LENSFUN
-            if (applyLF) {
-                float buff[2];
+            if (map != NULL && !map->exact)
+                ufraw_coord_map_row(map, y, area->x, area->width, coord);
+            else if (map != NULL && sine == 0 && cosine == 1)
                 lf_modifier_apply_geometry_distortion(uf->modifier,
-                                                      srcX, srcY, 1, 1, buff);
-                srcX = buff[0];
-                srcY = buff[1];
-            }
+                                                      srcX0 + area->x, srcY0, area->width, 1, coord);
+            else
+#endif
+                for (x = 0; x < area->width; x++) {
+                    coord[2 * x] = srcX0 + (area->x + x) * cosine;
+                    coord[2 * x + 1] = srcY0 - (area->x + x) * sine;
+#ifdef HAVE_LENSFUN
+                    if (map != NULL)
+                        lf_modifier_apply_geometry_distortion(uf->modifier,
+                                                              coord[2 * x], coord[2 * x + 1], 1, 1,
+                                                              coord + 2 * x);
 #endif
-            ufraw_interpolate_pixel_linearly(img, srcX, srcY, (ufraw_image_type *)cur, -1);
+                }
+            ufraw_interpolate_row_linearly(img, coord, area->width,
+                                           uf->firstRegion.x, uf->firstRegion.y,
+                                           (ufraw_image_type *)(dest + (y - area->y) * rowstride));
         }
+        g_free(coord);
     }
 }
 
@@ -1030,13 +1818,59 @@ static void ufraw_convert_image_transform(ufraw_data *uf, ufraw_image_data *img,
  * -	use ufraw_image_format()
  * -	use uf->rgbMax (check, must be about 64k)
  */
+static int ufraw_shave_hotpixels_row(ufraw_data *uf, dcraw_image_type *prev,
+                                     dcraw_image_type *cur,
+                                     const dcraw_image_type *next, int width,
+                                     int colors, unsigned delta)
+{
+    int w, c, i, count = 0;
+    unsigned t, v, hi;
+
+    for (w = 1; w < width - 1; ++w) {
+        for (c = 0; c < colors; ++c) {
+            t = cur[w][c];
+            if (t <= delta)
+                continue;
+            t -= delta;
+            v = cur[w - 1][c];
+            if (v > t)
+                continue;
+            hi = v;
+            v = cur[w + 1][c];
+            if (v > t)
+                continue;
+            if (v > hi)
+                hi = v;
+            v = prev[w][c];
+            if (v > t)
+                continue;
+            if (v > hi)
+                hi = v;
+            v = next[w][c];
+            if (v > t)
+                continue;
+            if (v > hi)
+                hi = v;
+            /* mark the pixel using the original hot value */
+            if (uf->mark_hotpixels) {
+                for (i = -10; i >= -20 && w + i >= 0; --i)
+                    memcpy(cur[w + i], cur[w], sizeof(cur[w + i]));
+                for (i = 10; i <= 20 && w + i < width; ++i)
+                    memcpy(cur[w + i], cur[w], sizeof(cur[w + i]));
+            }
+            cur[w][c] = hi;
+            ++count;
+        }
+    }
+    return count;
+}
+
 static void ufraw_shave_hotpixels(ufraw_data *uf, dcraw_image_type *img,
                                   int width, int height, int colors,
                                   unsigned rgbMax)
 {
-    int w, h, c, i, count;
-    unsigned delta, t, v, hi;
-    dcraw_image_type *p;
+    int h, count;
+    unsigned delta;
 
     uf->hotpixels = 0;
     if (uf->conf->hotpixel <= 0.0)
@@ -1045,52 +1879,84 @@ static void ufraw_shave_hotpixels(ufraw_data *uf, dcraw_image_type *img,
     count = 0;
 #ifdef _OPENMP
     #pragma omp parallel for schedule(static) \
-    shared(uf,img,width,height,colors,rgbMax,delta) \
+    shared(uf,img,width,height,colors,delta) \
 reduction(+:count) \
-    private(h,p,w,c,t,v,hi,i)
+    private(h)
 #endif
-    for (h = 1; h < height - 1; ++h) {
-        p = img + 1 + h * width;
-        for (w = 1; w < width - 1; ++w, ++p) {
-            for (c = 0; c < colors; ++c) {
-                t = p[0][c];
-                if (t <= delta)
-                    continue;
-                t -= delta;
-                v = p[-1][c];
-                if (v > t)
-                    continue;
-                hi = v;
-                v = p[1][c];
-                if (v > t)
-                    continue;
-                if (v > hi)
-                    hi = v;
-                v = p[-width][c];
-                if (v > t)
-                    continue;
-                if (v > hi)
-                    hi = v;
-                v = p[width][c];
-                if (v > t)
-                    continue;
-                if (v > hi)
-                    hi = v;
-                /* mark the pixel using the original hot value */
-                if (uf->mark_hotpixels) {
-                    for (i = -10; i >= -20 && w + i >= 0; --i)
-                        memcpy(p[i], p[0], sizeof(p[i]));
-                    for (i = 10; i <= 20 && w + i < width; ++i)
-                        memcpy(p[i], p[0], sizeof(p[i]));
+    for (h = 1; h < height - 1; ++h)
+        count += ufraw_shave_hotpixels_row(uf, img + (h - 1) * width,
+                                           img + h * width,
+                                           img + (h + 1) * width,
+                                           width, colors, delta);
+    uf->hotpixels = count;
+}
+
+/* Rows of the raw phase a thread does in one go */
+#define RAW_STRIP 32
+
+/*
+ * Hot pixels, black level, dark frame and white balance in a single pass
+ * from the dcraw image to rows y0 to y1 of the raw phase, which are
+ * written to 'out' starting with row y0. Each
+ * strip of rows keeps three rows with their hot pixels shaved. A row is
+ * finalized as soon as the row below it is shaved, since the dark frame
+ * may need both of its neighbours. The first row of a strip is compared
+ * to the unshaved row above it, so the result does not depend on the
+ * number of threads. Strips start at multiples of RAW_STRIP, also when
+ * y0 does not, so converting the rows in parts gives the same result as
+ * converting them all at once. Returns the number of hot pixels found.
+ */
+static int ufraw_convert_image_raw_rows(ufraw_data *uf, dcraw_data *raw,
+                                        dcraw_data *dark, int y0, int y1, dcraw_image_type *out)
+{
+    dcraw_image_type *src = raw->raw.image;
+    const int width = raw->raw.width, height = raw->raw.height;
+    const int colors = raw->raw.colors;
+    const gboolean shave = uf->conf->hotpixel > 0.0;
+    const unsigned delta = shave ? raw->rgbMax / (uf->conf->hotpixel + 1.0) : 0;
+    const int *rgbWB = uf->developer->rgbWB;
+    int top, count = 0;
+
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic) default(shared) \
+    private(top) reduction(+:count)
+#endif
+    for (top = y0 / RAW_STRIP * RAW_STRIP; top < y1; top += RAW_STRIP) {
+        const int first = MAX(top - 1, 0);
+        const int start = MAX(top, y0);
+        const int bottom = MIN(top + RAW_STRIP, y1);
+        dcraw_image_type *ring = g_new(dcraw_image_type, 3 * width);
+        dcraw_image_type *rows[3], *prev;
+        int row, n;
+        for (row = first; row <= bottom; row++) {
+            if (row < height) {
+                dcraw_image_type *cur = ring + row % 3 * width;
+                memcpy(cur, src + row * width, width * sizeof(*cur));
+                if (shave && row > 0 && row < height - 1) {
+                    prev = row > first ? ring + (row - 1) % 3 * width :
+                           src + (row - 1) * width;
+                    n = ufraw_shave_hotpixels_row(uf, prev, cur,
+                                                  src + (row + 1) * width,
+                                                  width, colors, delta);
+                    if (row >= start && row < bottom)
+                        count += n;
                 }
-                p[0][c] = hi;
-                ++count;
             }
+            if (row - 1 < start)
+                continue;
+            rows[0] = row - 2 >= 0 ? ring + (row - 2) % 3 * width : NULL;
+            rows[1] = ring + (row - 1) % 3 * width;
+            rows[2] = row < height ? ring + row % 3 * width : NULL;
+            dcraw_finalize_raw_row(raw, dark, rgbWB, rows,
+                                   out + (row - 1 - y0) * width, row - 1);
         }
+        g_free(ring);
     }
-    uf->hotpixels = count;
+    return count;
 }
 
+#undef RAW_STRIP
+
 static void ufraw_despeckle_line(guint16 *base, int step, int size, int window,
                                  double decay, int colors, int c)
 {
@@ -1243,7 +2109,8 @@ static void ufraw_convertshrink(ufraw_data *uf, dcraw_image_data *final)
 
     if (uf->HaveFilters && scale == 1)
         dcraw_finalize_interpolate(final, raw, uf->conf->interpolation,
-                                   uf->conf->smoothing);
+                                   uf->conf->smoothing,
+                                   uf->conf->smoothingBuffered);
     else
         dcraw_finalize_shrink(final, raw, scale);
 
@@ -1276,6 +2143,33 @@ static void ufraw_convertshrink(ufraw_data *uf, dcraw_image_data *final)
     }
 }
 
+/*
+ * Without the wavelet denoising, despeckling and TCA correction, which
+ * need the whole image, the raw phase is converted a row of subareas at
+ * a time by ufraw_convert_image_raw_rows(). Prepares the raw phase for
+ * that and returns TRUE, or returns FALSE if it has to be converted as
+ * a whole.
+ */
+static gboolean ufraw_convert_prepare_raw_rows(ufraw_data *uf,
+        ufraw_image_data *img)
+{
+    dcraw_data *raw = uf->raw;
+
+    if (!(uf->IsXTrans || uf->conf->threshold == 0) ||
+            ufraw_despeckle_active(uf))
+        return FALSE;
+    ufraw_image_init(img, raw->raw.width, raw->raw.height,
+                     sizeof(dcraw_image_type));
+#ifdef HAVE_LENSFUN
+    ufraw_prepare_tca(uf);
+    if (uf->TCAmodifier != NULL)
+        return FALSE;
+#endif
+    img->rgbg = raw->raw.colors == 4;
+    uf->hotpixels = 0;
+    return TRUE;
+}
+
 /*
  * Interface of ufraw_shave_hotpixels(), dcraw_finalize_raw() and preferably
  * dcraw_wavelet_denoise() too should change to accept a phase argument and
@@ -1288,16 +2182,32 @@ static void ufraw_convert_image_raw(ufraw_data *uf, UFRawPhase phase)
     dcraw_data *raw = uf->raw;
     dcraw_image_type *rawimage;
 
-    ufraw_convert_import_buffer(uf, phase, &raw->raw);
+    /* Bytes read and written per pixel for the import copy, hot pixels,
+     * and black, dark frame and white balance, when done one by one */
+    int moved = 16 + (uf->conf->hotpixel > 0.0 ? 8 : 0) + 16 + (dark ? 8 : 0);
+
+    if (uf->IsXTrans || uf->conf->threshold == 0) {
+        /* Without the wavelet denoising in between, these steps can read
+         * the dcraw image once and write the raw phase once */
+        ufraw_image_init(img, raw->raw.width, raw->raw.height,
+                         sizeof(dcraw_image_type));
+        uf->hotpixels = ufraw_convert_image_raw_rows(uf, raw, dark,
+                        0, img->height, (dcraw_image_type *)img->buffer);
+        ufraw_message(UFRAW_SET_LOG, "ufraw_convert_image_raw: "
+                      "%d bytes per pixel moved instead of %d\n",
+                      16 + (dark ? 8 : 0), moved);
+    } else {
+        ufraw_convert_import_buffer(uf, phase, &raw->raw);
+        ufraw_shave_hotpixels(uf, (dcraw_image_type *)(img->buffer), img->width,
+                              img->height, raw->raw.colors, raw->rgbMax);
+        rawimage = raw->raw.image;
+        raw->raw.image = (dcraw_image_type *)img->buffer;
+        /* The threshold is scaled for compatibility */
+        dcraw_wavelet_denoise(raw, uf->conf->threshold * sqrt(uf->raw_multiplier));
+        dcraw_finalize_raw(raw, dark, uf->developer->rgbWB);
+        raw->raw.image = rawimage;
+    }
     img->rgbg = raw->raw.colors == 4;
-    ufraw_shave_hotpixels(uf, (dcraw_image_type *)(img->buffer), img->width,
-                          img->height, raw->raw.colors, raw->rgbMax);
-    rawimage = raw->raw.image;
-    raw->raw.image = (dcraw_image_type *)img->buffer;
-    /* The threshold is scaled for compatibility */
-    if (!uf->IsXTrans) dcraw_wavelet_denoise(raw, uf->conf->threshold * sqrt(uf->raw_multiplier));
-    dcraw_finalize_raw(raw, dark, uf->developer->rgbWB);
-    raw->raw.image = rawimage;
     ufraw_despeckle(uf, phase);
 #ifdef HAVE_LENSFUN
     ufraw_prepare_tca(uf);
@@ -1348,15 +2258,241 @@ static void ufraw_convert_image_first(ufraw_data *uf, UFRawPhase phase)
     out->rowstride = out->width * out->depth;
     out->buffer = (guint8 *)final.image;
 
-    ufraw_convert_reverse_wb(uf, phase);
+    UFRectangle area = { 0, 0, out->width, out->height };
+    ufraw_convert_reverse_wb(uf, phase, &area);
 }
 
-static void ufraw_convert_reverse_wb(ufraw_data *uf, UFRawPhase phase)
+/*
+ * Convert the rows of raw phase subareas from row 'y0' to 'y1', or the
+ * whole raw phase if ufraw_convert_prepare_raw_rows() says so.
+ */
+static void ufraw_convert_image_raw_area(ufraw_data *uf, UFRawPhase phase,
+        int y0, int y1)
+{
+    ufraw_image_data *img = &uf->Images[phase];
+    dcraw_data *dark = uf->conf->darkframe ? uf->conf->darkframe->raw : NULL;
+    UFRectangle area;
+    int i, j, saidx;
+
+#ifdef _OPENMP
+    #pragma omp critical(ufraw_raw_phase)
+#endif
+    if (img->valid == 0 && !ufraw_convert_prepare_raw_rows(uf, img)) {
+        ufraw_convert_image_raw(uf, phase);
+        ufraw_image_fit_tiles(img);
+        ufraw_image_validate(img);
+    } else {
+        for (i = y0 / img->tileSize; i < img->tilesY &&
+                i * img->tileSize < y1; i++) {
+            saidx = i * img->tilesX;
+            if (ufraw_image_subarea_valid(img, saidx))
+                continue;
+            area = ufraw_image_get_subarea_rectangle(img, saidx);
+            uf->hotpixels += ufraw_convert_image_raw_rows(uf, uf->raw, dark,
+                             area.y, area.y + area.height,
+                             (dcraw_image_type *)img->buffer + area.y * img->width);
+            for (j = saidx; j < saidx + img->tilesX; j++)
+                ufraw_image_validate_subarea(img, j);
+        }
+    }
+}
+
+/*
+ * The first phase can be converted a subarea at a time if it only
+ * interpolates and flips the raw phase of a Bayer sensor. The X-Trans
+ * interpolation depends on the order of its tiles and the X-Trans
+ * denoising needs the whole image. So does the color smoothing, unless
+ * it is buffered, since in place each row sees the ones above it smoothed.
+ */
+static gboolean ufraw_first_phase_tiled(ufraw_data *uf)
+{
+    dcraw_data *raw = uf->raw;
+    ufraw_image_data *img = &uf->Images[ufraw_first_phase];
+    int height, width;
+
+    if (!uf->HaveFilters || uf->IsXTrans || raw->shrink == 0 ||
+            raw->fuji_width != 0 || raw->pixel_aspect != 1 ||
+            (uf->conf->smoothing && !uf->conf->smoothingBuffered) ||
+            ufraw_calculate_scale(uf) != 1)
+        return FALSE;
+    /* The preview zoomed in beyond 100% resizes to the same size */
+    dcraw_image_dimensions(raw, uf->conf->orientation, 1, &height, &width);
+    return img->height == height && img->width == width;
+}
+
+/* Margin for the interpolation and color smoothing, in full size pixels */
+#define FIRST_PHASE_MARGIN 16
+/* Full size rows of the first phase converted at a time while saving */
+#define FIRST_PHASE_BAND 240
+
+/*
+ * Interpolate 'region', the part of the raw phase from x0,y0 in full size
+ * pixels, crop 'rect' out of it and flip it into 'area' of the first phase.
+ */
+static void ufraw_convert_first_region(ufraw_data *uf, UFRawPhase phase,
+                                       dcraw_data *region, int x0, int y0,
+                                       UFRectangle *rect, UFRectangle *area)
+{
+    ufraw_image_data *out = &uf->Images[phase];
+    dcraw_data *raw = uf->raw;
+    const int flip = uf->conf->orientation;
+    dcraw_image_data final;
+    dcraw_image_type *tile;
+    int i, width, height;
+
+    final.image = NULL;
+    dcraw_finalize_interpolate(&final, region, uf->conf->interpolation,
+                               uf->conf->smoothing,
+                               uf->conf->smoothingBuffered);
+    /* dcraw_finalize_interpolate() changes these as for the whole image */
+    raw->filters = region->filters;
+    raw->message = region->message;
+
+    tile = g_new(dcraw_image_type, rect->width * rect->height);
+    for (i = 0; i < rect->height; i++)
+        memcpy(tile + i * rect->width,
+               final.image + (rect->y - y0 + i) * final.width + rect->x - x0,
+               rect->width * sizeof(dcraw_image_type));
+    g_free(final.image);
+    width = rect->width;
+    height = rect->height;
+    dcraw_flip_buffer(tile, sizeof(dcraw_image_type), &height, &width, flip);
+    for (i = 0; i < area->height; i++)
+        memcpy(out->buffer + (area->y + i) * out->rowstride +
+               area->x * out->depth, tile + i * area->width,
+               area->width * out->depth);
+    g_free(tile);
+
+    ufraw_convert_reverse_wb(uf, phase, area);
+}
+
+/*
+ * Convert 'area' of the first phase. The part of the raw phase under it
+ * is interpolated with a margin, which gives the same pixels as doing the
+ * whole image, then cropped and flipped into place.
+ */
+static void ufraw_convert_image_first_area(ufraw_data *uf, UFRawPhase phase,
+        UFRectangle *area)
+{
+    ufraw_image_data *in = &uf->Images[phase - 1];
+    ufraw_image_data *out = &uf->Images[phase];
+    dcraw_data *raw = uf->raw, region;
+    const int margin = FIRST_PHASE_MARGIN;
+    UFRectangle rect = *area;
+    int x0, y0, x1, y1;
+
+    ufraw_flip_rectangle(&rect, raw->width, raw->height,
+                         uf->conf->orientation, TRUE);
+    /* Aligned as in ufraw_convert_prepare_region() */
+    x0 = MAX(rect.x - margin, 0) / 48 * 48;
+    y0 = MAX(rect.y - margin, 0) / 48 * 48;
+    x1 = MIN(rect.x + rect.width + margin, raw->width);
+    y1 = MIN(rect.y + rect.height + margin, raw->height);
+
+    /* The rows of the raw phase under the region */
+    ufraw_convert_image_raw_area(uf, phase - 1, y0 >> raw->shrink,
+                                 ((y1 - 1) >> raw->shrink) + 1);
+
+    if (g_atomic_int_get(&out->valid) == 0) {
+        out->depth = sizeof(dcraw_image_type);
+        out->rowstride = out->width * out->depth;
+        out->buffer = g_realloc(out->buffer, out->height * out->rowstride);
+    }
+    ufraw_copy_raw_region(raw, (dcraw_image_type *)in->buffer, &region,
+                          x0, y0, x1, y1);
+    ufraw_convert_first_region(uf, phase, &region, x0, y0, &rect, area);
+    g_free(region.raw.image);
+#ifdef HAVE_LENSFUN
+    /* Lensfun takes the pixels of the area itself and its position in
+     * the image */
+    ufraw_image_data areaImg = *out;
+    areaImg.buffer = out->buffer + area->y * out->rowstride +
+                     area->x * out->depth;
+    ufraw_convert_image_vignetting(uf, &areaImg, area);
+#endif
+}
+
+/*
+ * Convert the raw and first phases of the whole image for saving, a band
+ * of FIRST_PHASE_BAND rows at a time. Only the first phase is kept whole,
+ * the raw phase and the interpolation never hold more than a band and its
+ * margins. The raw phase rows of the margin above a band are taken over
+ * from the previous band. The raw phase buffer is released either way.
+ * Returns FALSE if the image cannot be converted in bands.
+ */
+static gboolean ufraw_convert_image_first_bands(ufraw_data *uf)
+{
+    ufraw_image_data *rawImg = &uf->Images[ufraw_raw_phase];
+    ufraw_image_data *out = &uf->Images[ufraw_first_phase];
+    dcraw_data *dark = uf->conf->darkframe ? uf->conf->darkframe->raw : NULL;
+    dcraw_data *raw = uf->raw, region;
+    const int shrink = raw->shrink, width = raw->raw.width;
+    const int margin = FIRST_PHASE_MARGIN;
+    dcraw_image_type *prev = NULL;
+    UFRectangle rect, area;
+    int top, y0, ry0, ry1, prevY0 = 0, prevY1 = 0;
+
+    g_free(rawImg->buffer);
+    rawImg->buffer = NULL;
+    rawImg->width = raw->raw.width;
+    rawImg->height = raw->raw.height;
+    ufraw_image_fit_tiles(rawImg);
+    ufraw_image_invalidate(rawImg);
+    if (!ufraw_first_phase_tiled(uf) || uf->conf->threshold != 0 ||
+            ufraw_despeckle_active(uf))
+        return FALSE;
+#ifdef HAVE_LENSFUN
+    ufraw_prepare_tca(uf);
+    if (uf->TCAmodifier != NULL)
+        return FALSE;
+#endif
+    rawImg->rgbg = raw->raw.colors == 4;
+    out->depth = sizeof(dcraw_image_type);
+    out->rowstride = out->width * out->depth;
+    out->buffer = g_realloc(out->buffer, out->height * out->rowstride);
+    uf->hotpixels = 0;
+    for (top = 0; top < raw->height; top += FIRST_PHASE_BAND) {
+        rect.x = 0;
+        rect.y = top;
+        rect.width = raw->width;
+        rect.height = MIN(FIRST_PHASE_BAND, raw->height - top);
+        y0 = MAX(top - margin, 0) / 48 * 48;
+        ry0 = y0 >> shrink;
+        ry1 = ((MIN(top + rect.height + margin, raw->height) - 1) >> shrink) + 1;
+        region = *raw;
+        region.height = MIN((ry1 - ry0) << shrink, raw->height - y0);
+        region.raw.height = ry1 - ry0;
+        region.raw.image = g_new(dcraw_image_type, region.raw.height * width);
+        if (prev != NULL && prevY1 > ry0)
+            memcpy(region.raw.image, prev + (ry0 - prevY0) * width,
+                   (prevY1 - ry0) * width * sizeof(dcraw_image_type));
+        g_free(prev);
+        uf->hotpixels += ufraw_convert_image_raw_rows(uf, raw, dark,
+                         MAX(prevY1, ry0), ry1, region.raw.image +
+                         (MAX(prevY1, ry0) - ry0) * width);
+        area = rect;
+        ufraw_flip_rectangle(&area, raw->width, raw->height,
+                             uf->conf->orientation, FALSE);
+        ufraw_convert_first_region(uf, ufraw_first_phase, &region, 0, y0,
+                                   &rect, &area);
+        prev = region.raw.image;
+        prevY0 = ry0;
+        prevY1 = ry1;
+    }
+    g_free(prev);
+    return TRUE;
+}
+
+#undef FIRST_PHASE_BAND
+#undef FIRST_PHASE_MARGIN
+
+static void ufraw_convert_reverse_wb(ufraw_data *uf, UFRawPhase phase,
+                                     UFRectangle *area)
 {
     ufraw_image_data *img = &uf->Images[phase];
     guint32 mul[4], px;
     guint16 *p16;
-    int i, size, c;
+    int i, y, c;
 
     ufraw_image_format(NULL, NULL, img, "6", G_STRFUNC);
     /* The speedup trick is to keep the non-constant (or ugly constant)
@@ -1364,19 +2500,21 @@ static void ufraw_convert_reverse_wb(ufraw_data *uf, UFRawPhase phase)
      * use double division (can be much faster, apparently). */
     for (i = 0; i < uf->colors; ++i)
         mul[i] = (guint64)0x10000 * 0x10000 / uf->developer->rgbWB[i];
-    size = img->height * img->width;
 #ifdef _OPENMP
     #pragma omp parallel for schedule(static) \
-    shared(uf,phase,img,mul,size) \
-    private(i,p16,c,px)
+    shared(uf,phase,img,mul,area) \
+    private(i,y,p16,c,px)
 #endif
-    for (i = 0; i < size; ++i) {
-        p16 = (guint16 *)&img->buffer[i * img->depth];
-        for (c = 0; c < uf->colors; ++c) {
-            px = p16[c] * (guint64)mul[c] / 0x10000;
-            if (px > 0xffff)
-                px = 0xffff;
-            p16[c] = px;
+    for (y = area->y; y < area->y + area->height; ++y) {
+        p16 = (guint16 *)(img->buffer + y * img->rowstride +
+                          area->x * img->depth);
+        for (i = 0; i < area->width; ++i, p16 += img->depth / 2) {
+            for (c = 0; c < uf->colors; ++c) {
+                px = p16[c] * (guint64)mul[c] / 0x10000;
+                if (px > 0xffff)
+                    px = 0xffff;
+                p16[c] = px;
+            }
         }
     }
 }
@@ -1389,10 +2527,41 @@ static void ufraw_convert_image_tca(ufraw_data *uf, ufraw_image_data *img,
 {
     if (uf->TCAmodifier == NULL)
         return;
-    int y;
+    coord_map_key key;
+    ufraw_coord_map_key(&key, coord_map_tca, img->width, img->height,
+                        img->width, img->height, uf->TCAmodifierKey);
+    coord_map *map = ufraw_coord_map_lookup(&key);
+    gboolean inexact = FALSE;
+    int x, y;
+    if (map == NULL) {
+        map = ufraw_coord_map_new(&key, 6, img->width, img->height);
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(static) private(x)
+#endif
+        for (y = 0; y < map->gridHeight; y++)
+            for (x = 0; x < map->gridWidth; x++)
+                lf_modifier_apply_subpixel_distortion(uf->TCAmodifier,
+                                                      x * coord_map_step, y * coord_map_step, 1, 1,
+                                                      map->node + 6 * (y * map->gridWidth + x));
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(static) private(x) \
+        reduction(|:inexact)
+#endif
+        for (y = 0; y < map->gridHeight - 1; y++)
+            for (x = 0; x < map->gridWidth - 1; x++) {
+                float exact[6];
+                lf_modifier_apply_subpixel_distortion(uf->TCAmodifier,
+                                                      (x + 0.5) * coord_map_step, (y + 0.5) * coord_map_step,
+                                                      1, 1, exact);
+                inexact |= !ufraw_coord_map_cell_ok(map, x, y, exact);
+            }
+        if (inexact)
+            ufraw_coord_map_set_exact(map);
+        map = ufraw_coord_map_insert(map);
+    }
 #ifdef _OPENMP
     #pragma omp parallel for schedule(static) \
-    shared(uf,img,outimg,area)
+    shared(uf,img,outimg,area,map)
 #endif
     for (y = area->y; y < area->y + area->height; y++) {
         guint16 *dst = (guint16*)(outimg->buffer + y * outimg->rowstride +
@@ -1402,8 +2571,11 @@ static void ufraw_convert_image_tca(ufraw_data *uf, ufraw_image_data *img,
         ufraw_image_type *srcEnd = (ufraw_image_type *)(img->buffer +
                                    y * img->rowstride + (area->x + area->width) * img->depth);
         float buff[3 * 2 * area->width];
-        lf_modifier_apply_subpixel_distortion(uf->TCAmodifier,
-                                              area->x, y, area->width, 1, buff);
+        if (map->exact)
+            lf_modifier_apply_subpixel_distortion(uf->TCAmodifier, area->x, y,
+                                                  area->width, 1, buff);
+        else
+            ufraw_coord_map_row(map, y, area->x, area->width, buff);
         float *modcoord = buff;
         for (; src < srcEnd; src++, dst += outimg->depth / 2) {
             int c;
@@ -1417,6 +2589,7 @@ static void ufraw_convert_image_tca(ufraw_data *uf, ufraw_image_data *img,
                 dst[c] = src[0][c];
         }
     }
+    ufraw_coord_map_release(map);
 }
 #endif // HAVE_LENSFUN
 
@@ -1440,12 +2613,13 @@ static void ufraw_image_init(ufraw_image_data *img,
             img->depth == bitdepth && img->buffer != NULL)
         return;
 
-    img->valid = 0;
     img->height = height;
     img->width = width;
     img->depth = bitdepth;
     img->rowstride = img->width * img->depth;
     img->buffer = g_realloc(img->buffer, img->height * img->rowstride);
+    ufraw_image_fit_tiles(img);
+    ufraw_image_invalidate(img);
 }
 
 static void ufraw_convert_prepare_first_buffer(ufraw_data *uf,
@@ -1495,43 +2669,14 @@ void ufraw_convert_prepare_transform(ufraw_data *uf,
                                      float scale);
 #endif
 
-static void ufraw_convert_prepare_transform_buffer(ufraw_data *uf,
-        ufraw_image_data *img, int width, int height)
+/*
+ * Trace the left and bottom border of the iWidth x iHeight image through
+ * lensfun and the rotation. 'trace' gets the scale that keeps the area of
+ * the image, then the largest and the smallest half width and height.
+ */
+static void ufraw_trace_transform_border(ufraw_data *uf, int iWidth,
+        int iHeight, double aspectRatio, float *trace)
 {
-    const int iWidth = uf->initialWidth;
-    const int iHeight = uf->initialHeight;
-
-    double aspectRatio = uf->conf->aspectRatio;
-
-    if (aspectRatio == 0)
-        aspectRatio = ((double)iWidth) / iHeight;
-
-#ifdef HAVE_LENSFUN
-    ufraw_convert_prepare_transform(uf, iWidth, iHeight, TRUE, 1.0);
-    if (uf->conf->rotationAngle == 0 &&
-            (uf->modifier == NULL || !(uf->modFlags & UF_LF_TRANSFORM))) {
-#else
-    if (uf->conf->rotationAngle == 0) {
-#endif
-        g_free(img->buffer);
-        img->buffer = NULL;
-        img->width = width;
-        img->height = height;
-        // We still need the transform for vignetting
-#ifdef HAVE_LENSFUN
-        ufraw_convert_prepare_transform(uf, width, height, FALSE, 1.0);
-#endif
-        uf->rotatedWidth = iWidth;
-        uf->rotatedHeight = iHeight;
-        uf->autoCropWidth = iWidth;
-        uf->autoCropHeight = iHeight;
-        if ((double)uf->autoCropWidth / uf->autoCropHeight > aspectRatio)
-            uf->autoCropWidth = floor(uf->autoCropHeight * aspectRatio + 0.5);
-        else
-            uf->autoCropHeight = floor(uf->autoCropWidth / aspectRatio + 0.5);
-
-        return;
-    }
     const double sine = sin(uf->conf->rotationAngle * 2 * M_PI / 360);
     const double cosine = cos(uf->conf->rotationAngle * 2 * M_PI / 360);
 
@@ -1579,7 +2724,78 @@ static void ufraw_convert_prepare_transform_buffer(ufraw_data *uf,
         else
             minY = MIN(minY, fabs(srcY));
     }
-    float scale = sqrt((iWidth - 1) * (iHeight - 1) / area);
+    trace[0] = sqrt((iWidth - 1) * (iHeight - 1) / area);
+    trace[1] = maxX;
+    trace[2] = maxY;
+    trace[3] = minX;
+    trace[4] = minY;
+}
+
+static void ufraw_convert_prepare_transform_buffer(ufraw_data *uf,
+        ufraw_image_data *img, int width, int height)
+{
+#ifdef HAVE_LENSFUN
+    /* The transform map is looked up again for the new settings */
+    ufraw_coord_map_release(uf->transformMap);
+    uf->transformMap = NULL;
+#endif
+    const int iWidth = uf->initialWidth;
+    const int iHeight = uf->initialHeight;
+
+    double aspectRatio = uf->conf->aspectRatio;
+
+    if (aspectRatio == 0)
+        aspectRatio = ((double)iWidth) / iHeight;
+
+#ifdef HAVE_LENSFUN
+    ufraw_convert_prepare_transform(uf, iWidth, iHeight, TRUE, 1.0);
+    if (uf->conf->rotationAngle == 0 &&
+            (uf->modifier == NULL || !(uf->modFlags & UF_LF_TRANSFORM))) {
+#else
+    if (uf->conf->rotationAngle == 0) {
+#endif
+        g_free(img->buffer);
+        img->buffer = NULL;
+        img->width = width;
+        img->height = height;
+        // We still need the transform for vignetting
+#ifdef HAVE_LENSFUN
+        ufraw_convert_prepare_transform(uf, width, height, FALSE, 1.0);
+#endif
+        uf->rotatedWidth = iWidth;
+        uf->rotatedHeight = iHeight;
+        uf->autoCropWidth = iWidth;
+        uf->autoCropHeight = iHeight;
+        if ((double)uf->autoCropWidth / uf->autoCropHeight > aspectRatio)
+            uf->autoCropWidth = floor(uf->autoCropHeight * aspectRatio + 0.5);
+        else
+            uf->autoCropHeight = floor(uf->autoCropWidth / aspectRatio + 0.5);
+
+        return;
+    }
+    float trace[5];
+#ifdef HAVE_LENSFUN
+    /* The border trace is cached along with the coordinate maps */
+    if (uf->modifier != NULL && (uf->modFlags & UF_LF_TRANSFORM)) {
+        coord_map_key key;
+        ufraw_coord_map_key(&key, coord_map_border, iWidth, iHeight,
+                            iWidth, iHeight, uf->modifierKey);
+        key.param[0] = uf->conf->rotationAngle;
+        key.param[1] = aspectRatio;
+        coord_map *map = ufraw_coord_map_lookup(&key);
+        if (map == NULL) {
+            map = ufraw_coord_map_new(&key, 5, 1, 1);
+            ufraw_trace_transform_border(uf, iWidth, iHeight, aspectRatio,
+                                         map->node);
+            map = ufraw_coord_map_insert(map);
+        }
+        memcpy(trace, map->node, sizeof(trace));
+        ufraw_coord_map_release(map);
+    } else
+#endif
+        ufraw_trace_transform_border(uf, iWidth, iHeight, aspectRatio, trace);
+    float scale = trace[0], maxX = trace[1], maxY = trace[2];
+    float minX = trace[3], minY = trace[4];
     // Do not allow increasing canvas size by more than a factor of 2
     uf->rotatedWidth = MIN(ceil(2 * maxX + 1.0) * scale, 2 * iWidth);
     uf->rotatedHeight = MIN(ceil(2 * maxY + 1.0) * scale, 2 * iHeight);
@@ -1612,23 +2828,32 @@ static void ufraw_convert_prepare_buffers(ufraw_data *uf, UFRawPhase phase)
         return;
     img->invalidate_event = FALSE;
     int width = 0, height = 0;
-    if (phase > ufraw_first_phase) {
+    if (phase > ufraw_raw_phase) {
         ufraw_convert_prepare_buffers(uf, phase - 1);
         width = uf->Images[phase - 1].width;
         height = uf->Images[phase - 1].height;
     }
     switch (phase) {
         case ufraw_raw_phase:
-            return;
+            /* The conversion allocates the buffer */
+            width = ((dcraw_data *)uf->raw)->raw.width;
+            height = ((dcraw_data *)uf->raw)->raw.height;
+            if (img->width != width || img->height != height) {
+                g_free(img->buffer);
+                img->buffer = NULL;
+                img->width = width;
+                img->height = height;
+            }
+            break;
         case ufraw_first_phase:
             ufraw_convert_prepare_first_buffer(uf, img);
-            return;
+            break;
         case ufraw_transform_phase:
             ufraw_convert_prepare_transform_buffer(uf, img, width, height);
-            return;
+            break;
         case ufraw_develop_phase:
             ufraw_image_init(img, width, height, 3);
-            return;
+            break;
         case ufraw_display_phase:
             if (uf->developer->working2displayTransform == NULL) {
                 g_free(img->buffer);
@@ -1638,10 +2863,12 @@ static void ufraw_convert_prepare_buffers(ufraw_data *uf, UFRawPhase phase)
             } else {
                 ufraw_image_init(img, width, height, 3);
             }
-            return;
+            break;
         default:
             g_warning("ufraw_convert_prepare_buffers: unsupported phase %d", phase);
+            return;
     }
+    ufraw_image_fit_tiles(img);
 }
 
 /*
@@ -1695,97 +2922,131 @@ ufraw_image_data *ufraw_get_image(ufraw_data *uf, UFRawPhase phase,
     if (bufferok) {
         /* It should never be necessary to actually finish the conversion
          * because it can break render_preview_image() which uses the
-         * final image "valid" mask for deciding what to update in the
+         * final image subarea states for deciding what to update in the
          * pixbuf. That can be fixed but is suboptimal anyway. The best
          * we can do is print a warning in case we need to finish the
          * conversion and finish it here. */
-        if (uf->Images[phase].valid != 0xffffffff) {
+        if (!ufraw_image_valid(&uf->Images[phase])) {
             g_warning("%s: fixing unfinished conversion for phase %d.\n",
                       G_STRFUNC, phase);
-            int i;
-            for (i = 0; i < 32; ++i)
-                ufraw_convert_image_area(uf, i, phase);
+            ufraw_convert_image_subareas(uf, phase);
         }
     }
     return &uf->Images[phase];
 }
 
+/*
+ * Convert the first phase subareas that subarea 'saidx' of the transform
+ * phase is rendered from. The preview does this for the subareas it is
+ * about to render before handing them to its threads, so that the
+ * interpolation can use all the threads.
+ */
+void ufraw_convert_image_first_tiles(ufraw_data *uf, unsigned saidx)
+{
+    ufraw_image_data *img = &uf->Images[ufraw_first_phase];
+    ufraw_image_data *img2 = &uf->Images[ufraw_transform_phase];
+    UFRectangle rect, area;
+    unsigned first, last, x, y;
+
+    ufraw_convert_prepare_buffers(uf, ufraw_transform_phase);
+    if (img2->buffer == NULL) {
+        ufraw_convert_image_area(uf, saidx, ufraw_first_phase);
+        return;
+    }
+    rect = ufraw_image_get_subarea_rectangle(img2, saidx);
+    if (!ufraw_transform_source_rectangle(uf, img, img2, &rect, &area))
+        return;
+    first = ufraw_img_get_subarea_idx(img, area.x, area.y);
+    last = ufraw_img_get_subarea_idx(img, area.x + area.width - 1,
+                                     area.y + area.height - 1);
+    for (y = first / img->tilesX; y <= last / img->tilesX; y++)
+        for (x = first % img->tilesX; x <= last % img->tilesX; x++)
+            ufraw_convert_image_area(uf, x + y * img->tilesX,
+                                     ufraw_first_phase);
+}
+
+/* Convert all the subareas of 'phase' that are not valid yet */
+void ufraw_convert_image_subareas(ufraw_data *uf, UFRawPhase phase)
+{
+    int i;
+
+    ufraw_convert_prepare_buffers(uf, phase);
+    for (i = 0; i < ufraw_image_subareas(&uf->Images[phase]); i++)
+        ufraw_convert_image_area(uf, i, phase);
+}
+
 ufraw_image_data *ufraw_convert_image_area(ufraw_data *uf, unsigned saidx,
         UFRawPhase phase)
 {
     int yy;
     ufraw_image_data *out = &uf->Images[phase];
 
-    if (out->valid & (1 << saidx))
+    // ufraw_convert_prepare_buffers() may set out->buffer to NULL.
+    ufraw_convert_prepare_buffers(uf, phase);
+    if (ufraw_image_subarea_valid(out, saidx))
         return out; // the subarea has been already computed
 
-    /* Get the subarea image for previous phase */
+    /* Get the subarea image for previous phase. The first phase gets
+     * the rows of the raw phase it needs by itself. */
     ufraw_image_data *in = NULL;
-    if (phase > ufraw_raw_phase) {
+    if (phase == ufraw_transform_phase) {
+        ufraw_convert_image_first_tiles(uf, saidx);
+        in = &uf->Images[phase - 1];
+    } else if (phase > ufraw_first_phase) {
         in = ufraw_convert_image_area(uf, saidx, phase - 1);
     }
-    // ufraw_convert_prepare_buffers() may set out->buffer to NULL.
-    ufraw_convert_prepare_buffers(uf, phase);
     if (phase > ufraw_first_phase && out->buffer == NULL)
         return in; // skip phase
 
     /* Get subarea coordinates */
     UFRectangle area = ufraw_image_get_subarea_rectangle(out, saidx);
-    guint8 *dest = out->buffer + area.y * out->rowstride + area.x * out->depth;
-    guint8 *src = NULL;
-    if (in != NULL)
-        src = in->buffer + area.y * in->rowstride + area.x * in->depth;
 
     switch (phase) {
         case ufraw_raw_phase:
-            ufraw_convert_image_raw(uf, phase);
-            out->valid = 0xffffffff;
+            ufraw_convert_image_raw_area(uf, phase, area.y,
+                                         area.y + area.height);
             return out;
 
         case ufraw_first_phase:
+            if (ufraw_first_phase_tiled(uf)) {
+#ifdef _OPENMP
+                #pragma omp critical(ufraw_first_phase)
+#endif
+                if (!ufraw_image_subarea_valid(out, saidx)) {
+                    ufraw_convert_image_first_area(uf, phase, &area);
+                    ufraw_image_validate_subarea(out, saidx);
+                }
+                return out;
+            }
+            ufraw_convert_image_raw_area(uf, phase - 1, 0,
+                                         uf->Images[phase - 1].height);
             ufraw_convert_image_first(uf, phase);
-            out->valid = 0xffffffff;
+            ufraw_image_fit_tiles(out);
+            ufraw_image_validate(out);
 #ifdef HAVE_LENSFUN
             UFRectangle allArea = { 0, 0, out->width, out->height };
             ufraw_convert_image_vignetting(uf, out, &allArea);
 #endif /* HAVE_LENSFUN */
             return out;
 
-        case ufraw_transform_phase: {
-            /* Area calculation is not needed at the moment since
-             * ufraw_first_phase is not tiled yet. */
-            /*
-                        int yy;
-                        float *buff = g_new (float, (w < 8) ? 8 * 2 * 3 : w * 2 * 3);
-
-                        // Compute the previous stage subareas, if needed
-                        lf_modifier_apply_subpixel_geometry_distortion (
-                            uf->modifier, x, y, 1, 1, buff);
-                        lf_modifier_apply_subpixel_geometry_distortion (
-                            uf->modifier, x + w/2, y, 1, 1, buff + 2 * 3);
-                        lf_modifier_apply_subpixel_geometry_distortion (
-                            uf->modifier, x + w-1, y, 1, 1, buff + 4 * 3);
-                        lf_modifier_apply_subpixel_geometry_distortion (
-                            uf->modifier, x, y + h/2, 1, 1, buff + 6 * 3);
-                        lf_modifier_apply_subpixel_geometry_distortion (
-                            uf->modifier, x + w-1, y + h/2, 1, 1, buff + 8 * 3);
-                        lf_modifier_apply_subpixel_geometry_distortion (
-                            uf->modifier, x, y + h-1, 1, 1, buff + 10 * 3);
-                        lf_modifier_apply_subpixel_geometry_distortion (
-                            uf->modifier, x + w/2, y + h-1, 1, 1, buff + 12 * 3);
-                        lf_modifier_apply_subpixel_geometry_distortion (
-                            uf->modifier, x + w-1, y + h-1, 1, 1, buff + 14 * 3);
-
-                        for (yy = 0; yy < 8 * 2 * 3; yy += 2)
-                        {
-                            int idx = ufraw_img_get_subarea_idx (in, buff [yy], buff [yy + 1]);
-                            if (idx <= 31)
-                                ufraw_convert_image_area (uf, idx, phase - 1);
-                        }
-            */
-            ufraw_convert_image_transform(uf, in, out, &area);
-        }
-        break;
+        default:
+            break;
+    }
+
+    /* The other phases are converted by whichever thread claims the
+     * subarea first. */
+    if (!ufraw_image_claim_subarea(out, saidx)) {
+        ufraw_image_wait_subarea(out, saidx);
+        return out;
+    }
+    guint8 *dest = out->buffer + area.y * out->rowstride + area.x * out->depth;
+    guint8 *src = in->buffer + area.y * in->rowstride + area.x * in->depth;
+
+    switch (phase) {
+        case ufraw_transform_phase:
+            ufraw_convert_image_transform(uf, in, out, &area, dest,
+                                          out->rowstride);
+            break;
 
         case ufraw_develop_phase:
             for (yy = 0; yy < area.height; yy++, dest += out->rowstride,
@@ -1803,14 +3064,8 @@ ufraw_image_data *ufraw_convert_image_area(ufraw_data *uf, unsigned saidx,
 
         default:
             g_warning("%s: invalid phase %d\n", G_STRFUNC, phase);
-            return in;
     }
-
-#ifdef _OPENMP
-    #pragma omp critical
-#endif
-    // Mark the subarea as valid
-    out->valid |= (1 << saidx);
+    ufraw_image_validate_subarea(out, saidx);
 
     return out;
 }
@@ -1819,47 +3074,16 @@ static void ufraw_flip_image_buffer(ufraw_image_data *img, int flip)
 {
     if (img->buffer == NULL)
         return;
-    /* Following code was copied from dcraw's flip_image()
-     * and modified to work with any pixel depth. */
-    int base, dest, next, row, col;
-    guint8 *image = img->buffer;
-    int height = img->height;
-    int width = img->width;
-    int depth = img->depth;
-    int size = height * width;
-    guint8 hold[8];
-    unsigned *flag = g_new0(unsigned, (size + 31) >> 5);
-    for (base = 0; base < size; base++) {
-        if (flag[base >> 5] & (1 << (base & 31)))
-            continue;
-        dest = base;
-        memcpy(hold, image + base * depth, depth);
-        while (1) {
-            if (flip & 4) {
-                row = dest % height;
-                col = dest / height;
-            } else {
-                row = dest / width;
-                col = dest % width;
-            }
-            if (flip & 2)
-                row = height - 1 - row;
-            if (flip & 1)
-                col = width - 1 - col;
-            next = row * width + col;
-            if (next == base) break;
-            flag[next >> 5] |= 1 << (next & 31);
-            memcpy(image + dest * depth, image + next * depth, depth);
-            dest = next;
-        }
-        memcpy(image + dest * depth, hold, depth);
-    }
-    g_free(flag);
-    if (flip & 4) {
-        img->height = width;
-        img->width = height;
-        img->rowstride = height * depth;
-    }
+    gboolean valid = ufraw_image_valid(img);
+    dcraw_flip_buffer(img->buffer, img->depth, &img->height, &img->width,
+                      flip);
+    img->rowstride = img->width * img->depth;
+    /* Subareas only flip onto subareas if the image is all valid */
+    ufraw_image_fit_tiles(img);
+    if (valid)
+        ufraw_image_validate(img);
+    else
+        ufraw_image_invalidate(img);
 }
 
 void ufraw_flip_orientation(ufraw_data *uf, int flip)
@@ -1960,7 +3184,7 @@ void ufraw_flip_image(ufraw_data *uf, int flip)
 void ufraw_invalidate_layer(ufraw_data *uf, UFRawPhase phase)
 {
     for (; phase < ufraw_phases_num; phase++) {
-        uf->Images[phase].valid = 0;
+        ufraw_image_invalidate(&uf->Images[phase]);
         uf->Images[phase].invalidate_event = TRUE;
     }
 }
@@ -1999,7 +3223,7 @@ void ufraw_invalidate_despeckle_layer(ufraw_data *uf)
 void ufraw_invalidate_whitebalance_layer(ufraw_data *uf)
 {
     ufraw_invalidate_layer(uf, ufraw_develop_phase);
-    uf->Images[ufraw_raw_phase].valid = 0;
+    ufraw_image_invalidate(&uf->Images[ufraw_raw_phase]);
     uf->Images[ufraw_raw_phase].invalidate_event = TRUE;
 
     /* Despeckling is sensitive for WB changes because it is nonlinear. */
@@ -229,6 +229,10 @@ void ufraw_write_image_data(
     int byteDepth = (bitDepth + 7) / 8;
     guint8 *pixbuf8 = g_new(guint8,
                             Crop->width * 3 * byteDepth * DEVELOP_BATCH);
+    /* Rows of the transform phase, if it is rendered while saving */
+    ufraw_image_type *transformRows = NULL;
+    if (uf->streamTransform)
+        transformRows = g_new(ufraw_image_type, Crop->width * DEVELOP_BATCH);
 
     progress(PROGRESS_SAVE, -Crop->height);
     for (row0 = 0; row0 < Crop->height; row0 += DEVELOP_BATCH) {
@@ -240,8 +244,19 @@ void ufraw_write_image_data(
             if (row + row0 >= Crop->height)
                 continue;
             guint8 *rowbuf = &pixbuf8[row * Crop->width * 3 * byteDepth];
-            develop(rowbuf, rawImage[(Crop->y + row + row0)*rowStride + Crop->x],
-                    uf->developer, bitDepth, Crop->width);
+            ufraw_image_type *src;
+            if (transformRows != NULL) {
+                UFRectangle area = { Crop->x, Crop->y + row + row0,
+                                     Crop->width, 1
+                                   };
+                src = &transformRows[row * Crop->width];
+                ufraw_convert_image_transform_area(uf, &area, (guint8 *)src,
+                                                   Crop->width * sizeof(ufraw_image_type));
+            } else {
+                src = &rawImage[(Crop->y - uf->firstRegion.y + row + row0) * rowStride
+                                + Crop->x - uf->firstRegion.x];
+            }
+            develop(rowbuf, src[0], uf->developer, bitDepth, Crop->width);
             if (grayscaleMode)
                 grayscale_buffer(rowbuf, Crop->width, bitDepth);
         }
@@ -251,6 +266,7 @@ void ufraw_write_image_data(
             break;
     }
     g_free(pixbuf8);
+    g_free(transformRows);
 }
 
 int ufraw_write_image(ufraw_data *uf)
@@ -358,7 +374,13 @@ int ufraw_write_image(ufraw_data *uf)
             }
         }
     // TODO: error handling
-    ufraw_convert_image(uf);
+#ifdef HAVE_LIBCFITSIO
+    /* The FITS writer needs the whole image at once */
+    if (uf->conf->type == fits_type)
+        ufraw_convert_image(uf);
+    else
+#endif
+        ufraw_convert_image_for_saving(uf);
     UFRectangle Crop;
     ufraw_get_scaled_crop(uf, &Crop);
     volatile int BitDepth = uf->conf->profile[out_profile]
@@ -795,6 +817,15 @@ int ufraw_write_image(ufraw_data *uf)
                     }
                 }
         }
+    if (uf->streamTransform) {
+        uf->streamTransform = FALSE;
+        ufraw_invalidate_layer(uf, ufraw_transform_phase);
+    }
+    if (uf->firstRegion.width > 0) {
+        uf->firstRegion.width = 0;
+        uf->firstRegion.x = uf->firstRegion.y = 0;
+        ufraw_invalidate_layer(uf, ufraw_raw_phase);
+    }
     if (uf->conf->createID == also_id) {
         if (ufraw_get_message(uf) != NULL)
             ufraw_message(UFRAW_SET_LOG, ufraw_get_message(uf));